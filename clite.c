@@ -21,15 +21,37 @@ Don't tell me this is not idiomatic C. I already know that.
 
 #include <string.h>
 #include <stdbool.h>
+#include <setjmp.h>
+#include <errno.h>
 
 #include <glib.h>
 #include <glib/gprintf.h>
 
+#ifdef G_OS_UNIX
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifdef ARENA
 #include "arena.h"
 #endif
 
+#ifndef CLITE_LIBRARY
+#include <zlib.h>
+#endif
+
 #include "lutils.h"
+#include "clite.h"
 
 /**
 Lack of tuples
@@ -37,16 +59,48 @@ Lack of tuples
 
 In the snippet below I overcomed such deficiency by declaring a struct. Using the new constructor syntax makes
 initializing a static table simple.
+
+A language can also have line doc comments, which are narrative up to the end of the line when `-d` is given, and
+the extensions of its files, which pick the language when translating a tree with `-r`. The HTML output highlights
+its code with its keywords and types, and with `#` lines if it has a preprocessor.
 **/
 
-typedef struct LangSymbols { char language[40]; char start[10]; char end[10];} LangSymbols;
+typedef struct LangSymbols {
+    char language[40]; char start[10]; char end[10]; char line[10]; char extensions[20];
+    const char* keywords; const char* types; bool preprocessor;
+} LangSymbols;
 
 static
 LangSymbols* s_lang_params_table[] = {
-    &(LangSymbols) {.language = "fsharp",   .start = "(*" "*", .end = "*" "*)"},
-    &(LangSymbols) {.language = "c",        .start = "/*" "*", .end = "*" "*/"},
-    &(LangSymbols) {.language = "csharp",   .start = "/*" "*", .end = "*" "*/"},
-    &(LangSymbols) {.language = "java",     .start = "/*" "*", .end = "*" "*/"},
+    &(LangSymbols) {.language = "fsharp",   .start = "(*" "*", .end = "*" "*)", .line = "//" "/",
+                    .extensions = ".fs .fsi .fsx",
+                    .keywords = "abstract and as assert base begin class default delegate do done downcast downto elif "
+                                "else end exception extern false finally for fun function global if in inherit inline "
+                                "interface internal lazy let match member module mutable namespace new not null of open "
+                                "or override private public rec return static struct then to true try type upcast use "
+                                "val void when while with yield",
+                    .types    = "bool byte char decimal double float int int64 list option seq string unit array"},
+    &(LangSymbols) {.language = "c",        .start = "/*" "*", .end = "*" "*/", .line = "//" "/",
+                    .extensions = ".c .h",
+                    .keywords = "auto break case const continue default do else enum extern for goto if inline "
+                                "register restrict return sizeof static struct switch typedef union volatile while",
+                    .types    = "bool char double float int long short signed unsigned void", .preprocessor = true},
+    &(LangSymbols) {.language = "csharp",   .start = "/*" "*", .end = "*" "*/", .line = "//" "/",
+                    .extensions = ".cs",
+                    .keywords = "abstract as base break case catch checked class const continue default delegate do "
+                                "else enum event explicit extern false finally fixed for foreach goto if implicit in "
+                                "interface internal is lock namespace new null operator out override params private "
+                                "protected public readonly ref return sealed sizeof stackalloc static struct switch "
+                                "this throw true try typeof unchecked unsafe using var virtual volatile while yield",
+                    .types    = "bool byte char decimal double float int long object sbyte short string uint ulong "
+                                "ushort void", .preprocessor = true},
+    &(LangSymbols) {.language = "java",     .start = "/*" "*", .end = "*" "*/", .line = "//" "/",
+                    .extensions = ".java",
+                    .keywords = "abstract assert break case catch class const continue default do else enum extends "
+                                "false final finally for goto if implements import instanceof interface native new "
+                                "null package private protected public return static strictfp super switch "
+                                "synchronized this throw throws transient true try volatile while",
+                    .types    = "boolean byte char double float int long short void"},
     NULL
 };
 
@@ -64,6 +118,7 @@ usable and I add a version of it without the `_z` to lutils.h.
 
 #define array_foreach_z(p) for(; *symbols != NULL; ++symbols)
 
+#ifndef CLITE_LIBRARY
 static
 char* summary(LangSymbols** symbols) {
 
@@ -82,6 +137,7 @@ char* summary(LangSymbols** symbols) {
 
     return usage->str;
 }
+#endif
 
 /**
 Find an item in an array based on some expression. Returns NULL if not found. Again, this is a common task,
@@ -102,6 +158,28 @@ LangSymbols* lang_find_symbols(LangSymbols** symbols, char* lang) {
     return array_find(symbols, !strcmp((*symbols)->language, lang));
 }
 
+#ifndef CLITE_LIBRARY
+// The language of a file from its extension, not counting a final .gz
+static
+LangSymbols* lang_find_extension(LangSymbols** symbols, const char* file) {
+    g_assert(symbols);
+    g_assert(file);
+
+    gsize len           = strlen(file) - (g_str_has_suffix(file, ".gz") ? 3 : 0);
+    const char* dot     = g_strrstr_len(file, len, ".");
+    const char* slash   = strrchr(file, '/');
+    if(!dot || dot == file || (slash && dot <= slash + 1)) return NULL;
+
+    gsize n             = file + len - dot;
+    bool has(const char* list) {
+        for(const char* p = list; (p = strchr(p, '.')); ++p)
+            if((p == list || p[-1] == ' ') && !strncmp(p, dot, n) && (p[n] == ' ' || !p[n])) return true;
+        return false;
+    }
+    return array_find(symbols, has((*symbols)->extensions));
+}
+#endif
+
 /**
 Deallocating stuff
 ==================
@@ -117,23 +195,44 @@ and pre-declare two functions.
 
 **/
 
-union_decl(CodeSymbols, Indented, Surrounded)
+union_decl(CodeSymbols, Indented, Surrounded, Html, Json)
     union_type(Indented,    int indentation;)
     union_type(Surrounded,  char* start_code; char* end_code;)
+    union_type(Html,        char* language; char* css_href; char* css_text; struct Highlighter* highlighter;)
+    union_type(Json,        char* language;)
 union_end(CodeSymbols);
 
-typedef struct Options {
+typedef enum Format { FormatMarkdown, FormatHtml, FormatJson } Format;
+
+typedef struct Failure Failure;
+typedef struct Automaton Automaton;
+typedef struct RenderCache RenderCache;
+
+typedef struct Options Options;
+typedef const char* (*ScanFunc)(Options*, const char* p, const char* stop, const char* limit, int* pattern);
+
+// The narrative delimiters after the first pair, a pair ending with a new line is a line doc comment
+typedef struct NarrativePair { char* start; char* end; } NarrativePair;
+
+struct Options {
     char*           start_narrative;
     char*           end_narrative;
     CodeSymbols*    code_symbols;
-} Options;
+    Failure*        failure;
+    ScanFunc        scan;
+    GArray*         more_pairs;
+    Automaton*      automaton;
+    bool            toc;
+    bool            headings;       // the tagged narrative blocks keep the headings they have
+    RenderCache*    cache;
+};
 
 static
 gchar* translate(Options*, gchar*);
 
 union_decl(Block, Code, Narrative)
     union_type(Code,        char* code)
-    union_type(Narrative,   char* narrative)
+    union_type(Narrative,   char* narrative; int pair; GArray* headings)
 union_end(Block);
 
 /**
@@ -143,10 +242,15 @@ Main data structure
 We want to use higher level abstractions that standard C arrays, hence we'll pick a convenient data structure
 to use in the rest of the code. A queue lets you to insert at the front and back, with just a one pointer
 overhead over a single linked list. Hence it is my data structure of choice for this program.
+
+The blocks of a whole document are the exception: there are many of them and every phase walks them all, so they
+are kept in a vector, described after the flattener.
 **/
 
+typedef struct Blocks Blocks;
+
 static
-GQueue* blockize(Options*, char*);
+Blocks* blockize(Options*, char*);
 
 /**
 There is already a function in glib to check if a string has a certain prefix (`g_str_has_prefix`). We need one
@@ -154,6 +258,7 @@ that returns the remaining string after the prefix. We also define a g_slow_asse
 G_ENABLE_SLOW_ASSERT is defined
 **/
 
+#if !defined(NDEBUG) && !defined(CLITE_LIBRARY)
 static
 char* str_after_prefix(char* src, char* prefix) {
     g_assert(src);
@@ -166,6 +271,7 @@ char* str_after_prefix(char* src, char* prefix) {
 
     return src;
 }
+#endif
 
 /**
 Tokenizer
@@ -182,14 +288,179 @@ It is nothing magic, just a way to have a case statment as an expression, but it
 #define NL "\n"
 
 union_decl(Token, OpenComment, CloseComment, Text)
-    union_type(OpenComment, int line)
-    union_type(CloseComment,int line)
+    union_type(OpenComment, int line; int pair)
+    union_type(CloseComment,int line; int pair)
     union_type(Text,        char* text)
 union_end(Token);
 
-GQueue* tokenize(Options* options, char* source) {
+/**
+Where the errors are
+====================
+
+Lines are needed only for errors, so the tokenizers that work on a buffer don't count them at all. When an error needs
+its position, a `LineIndex` of the source is built: the number of new lines before every `LINE_INDEX_STEP` bytes,
+counted 16 bytes at the time with SSE2. The line of an offset is then the one of the checkpoint before it plus the
+new lines in between, and its column is the number of chars from the start of its line, both counting from one.
+The error shows the line too, cut around the column if it is long, with a caret under the column.
+**/
+
+#define LINE_INDEX_STEP     (64 * 1024)
+#define EXCERPT_BEFORE      60
+#define EXCERPT_AFTER       40
+
+typedef struct LineIndex { const char* source; gsize size; gsize* lines; } LineIndex;
+
+typedef struct Position { int line; int column; gsize line_start; gsize line_end; } Position;
+
+static
+gsize count_newlines(const char* p, gsize n) {
+    const char* end = p + n;
+    gsize count     = 0;
+#ifdef __SSE2__
+    __m128i nl      = _mm_set1_epi8('\n');
+    for(; p + 16 <= end; p += 16)
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), nl)));
+#endif
+    for(; p < end; ++p) count += *p == '\n';
+    return count;
+}
+
+static
+LineIndex* line_index_new(const char* source, gsize size) {
+    LineIndex* index    = g_new(LineIndex, 1);
+    gsize n             = size / LINE_INDEX_STEP + 1;
+    index->source       = source;
+    index->size         = size;
+    index->lines        = g_new(gsize, n);
+    index->lines[0]     = 0;
+    for(gsize k = 1; k < n; ++k)
+        index->lines[k] = index->lines[k - 1] + count_newlines(source + (k - 1) * LINE_INDEX_STEP, LINE_INDEX_STEP);
+    return index;
+}
+
+static
+void line_index_free(LineIndex* index) {
+    if(!index) return;
+    g_free(index->lines);
+    g_free(index);
+}
+
+static inline
+bool is_utf8_continuation(char c) { return ((guchar) c & 0xC0) == 0x80; }
+
+static
+Position locate(LineIndex* index, gsize offset) {
+    offset              = MIN(offset, index->size);
+    gsize k             = offset / LINE_INDEX_STEP;
+    const char* s       = index->source;
+    gsize lines         = index->lines[k] + count_newlines(s + k * LINE_INDEX_STEP, offset - k * LINE_INDEX_STEP);
+
+    gsize start         = offset;
+    while(start > 0 && s[start - 1] != '\n') --start;
+    const char* nl      = memchr(s + offset, '\n', index->size - offset);
+    gsize end           = nl ? (gsize) (nl - s) : index->size;
+
+    int column          = 1;
+    for(gsize i = start; i < offset; ++i) column += !is_utf8_continuation(s[i]);
+    return (Position) {.line = lines + 1, .column = column, .line_start = start, .line_end = end};
+}
+
+// The line of the position and a caret under its column, cut at chars boundaries when the line is long
+static
+char* excerpt(LineIndex* index, Position p) {
+    const char* s   = index->source;
+    gsize end       = p.line_end > p.line_start && s[p.line_end - 1] == '\r' ? p.line_end - 1 : p.line_end;
+    gsize at        = p.line_start;
+    for(int c = 1; c < p.column && at < p.line_end; ++at)
+        c += at + 1 < p.line_end && !is_utf8_continuation(s[at + 1]);
+
+    gsize from      = at - p.line_start > EXCERPT_BEFORE ? at - EXCERPT_BEFORE : p.line_start;
+    gsize to        = end > at && end - at > EXCERPT_AFTER ? at + EXCERPT_AFTER : end;
+    while(from > p.line_start && is_utf8_continuation(s[from])) --from;
+    while(to < end && is_utf8_continuation(s[to])) ++to;
+
+    // Tabs are kept under the line so that the caret lines up with it
+    GString* res    = g_string_sized_new(2 * (to - from) + 32);
+    g_string_append_printf(res, "%6i | %s", p.line, from > p.line_start ? "..." : "");
+    g_string_append_len(res, s + from, to - from);
+    g_string_append_printf(res, "%s\n       | %s", to < end ? "..." : "", from > p.line_start ? "   " : "");
+    for(gsize i = from; i < at; ++i)
+        if(!is_utf8_continuation(s[i])) g_string_append_c(res, s[i] == '\t' ? '\t' : ' ');
+    return g_string_free(g_string_append_c(res, '^'), false);
+}
+
+/**
+The tokenizers for a whole buffer don't build a `Token` for each token, as a token in a queue is two allocations
+that every later phase has to chase. They fill a `TokenStream` instead: parallel arrays, grown geometrically, with
+the kind of each token as a byte, the pair of its delimiter, and its offset and length in the source. A text token is
+just the span of the source it covers, so nothing is copied, and the parser walks the arrays one after the other.
+
+The position of a token is needed just for errors, so the stream builds the index of the lines of its source the
+first time it is asked for one.
+**/
+
+typedef struct TokenStream {
+    const char* source;
+    gsize       size;
+    guint8*     kinds;
+    gint32*     pairs;
+    gsize*      offsets;
+    gsize*      lengths;
+    gsize       len;
+    gsize       room;
+    LineIndex*  lines;
+} TokenStream;
+
+static
+TokenStream* token_stream_new(const char* source, gsize size) {
+    TokenStream* ts = g_new0(TokenStream, 1);
+    ts->source      = source;
+    ts->size        = size;
+    return ts;
+}
+
+static
+void token_stream_free(TokenStream* ts) {
+    if(!ts) return;
+    line_index_free(ts->lines);
+    g_free(ts->kinds);
+    g_free(ts->pairs);
+    g_free(ts->offsets);
+    g_free(ts->lengths);
+    g_free(ts);
+}
+
+static inline
+void token_stream_push(TokenStream* ts, int kind, int pair, gsize offset, gsize length) {
+    if(ts->len == ts->room) {
+        ts->room    = MAX(64, 2 * ts->room);
+        ts->kinds   = g_renew(guint8, ts->kinds, ts->room);
+        ts->pairs   = g_renew(gint32, ts->pairs, ts->room);
+        ts->offsets = g_renew(gsize, ts->offsets, ts->room);
+        ts->lengths = g_renew(gsize, ts->lengths, ts->room);
+    }
+    ts->kinds[ts->len]      = kind;
+    ts->pairs[ts->len]      = pair;
+    ts->offsets[ts->len]    = offset;
+    ts->lengths[ts->len]    = length;
+    ++ts->len;
+}
+
+static
+Position token_position(TokenStream* ts, gsize i) {
+    g_assert(i < ts->len);
+
+    if(!ts->lines) ts->lines = line_index_new(ts->source, ts->size);
+    return locate(ts->lines, ts->offsets[i]);
+}
+
+#if !defined(NDEBUG) && !defined(CLITE_LIBRARY)
+// The first tokenizer, which the others are tested against and only the tests use
+static
+GQueue* tokenize_sequential(Options* options, char* source) {
     g_assert(options);
     g_assert(source);
+    g_assert(!options->more_pairs);
 
     struct tuple { int line; GString* acc; char* rem;};
 
@@ -228,387 +499,3905 @@ GQueue* tokenize(Options* options, char* source) {
                                     struct tuple t = text(src, g_string_sized_new(200), line);
                                     tokenize_rec(t.rem,
                                         g_queue_push_back(acc, union_new(
-                                                    Token, Text, .text = t.acc->str)), t.line);
+                                                    Token, Text, .text = g_string_free(t.acc, false))), t.line);
                                  });
     }
 
     return tokenize_rec(source, g_queue_new(), 1);
 }
+#endif
 
 /**
-Parser
-======
+Specialised scanners
+====================
 
-This again has a similar structure to the F# version, just longer. It is very long because it contains 3 (nested) functions which
-are on the verbose side in C.
+The other tokenizers below don't go char by char through recursion, they ask a scanner for the next delimiter
+starting in `[p, stop)`. A delimiter can extend up to `limit`, the end of the buffer.
 
-The creation of a `error` macro is unfortunate. I just don't know how to adapt `g_assert_e` so that it works for not pointer returning functions.
+The generic scanner compares the delimiters from the options with `g_str_has_prefix`. But the languages I know about
+all use three chars delimiters, so for those the delimiters are packed in integers once for each call, and the scanner
+loads four bytes as an integer and compares it, masked, with them. The scanner is picked once, from the length of the
+delimiters, when the options are created, so it works for any language in the table and for `-p` and `-c` too.
 
-I also need a simple function `report_error` to exit gracefully giving a message to the user. I didn't found such thing in glib (?)
+A scanner tells which delimiter it found as a pattern number: `2 * pair` for the opening delimiter of a pair and
+`2 * pair + 1` for the closing one. The pair in `start_narrative` and `end_narrative` is the first one.
 **/
 
-#define report_error_z(...) G_STMT_START { g_print(__VA_ARGS__); exit(1); } G_STMT_END                                                            \
-
-union_decl(Chunk, NarrativeChunk, CodeChunk)
-    union_type(NarrativeChunk,  GQueue* tokens)
-    union_type(CodeChunk,       GQueue* tokens)
-union_end(Chunk);
+#define PATTERN_KIND(pattern)   ((pattern) % 2 ? CloseComment : OpenComment)
+#define PATTERN_PAIR(pattern)   ((pattern) / 2)
 
 static
-GQueue* parse(Options* options, GQueue* tokens) {
-    g_assert(options);
-    g_assert(tokens);
-
-    struct tuple { GQueue* acc; GQueue* rem;};
-
-    #define error(...) \
-        ({ report_error(__VA_ARGS__); (struct tuple) {.acc = NULL, .rem = NULL}; })
+const char* scan_generic(Options* options, const char* p, const char* stop, G_GNUC_UNUSED const char* limit,
+                         int* pattern) {
+    char o = options->start_narrative[0];
+    char c = options->end_narrative[0];
+
+    for(; p < stop; ++p) {
+        if(*p == o && g_str_has_prefix(p, options->start_narrative)) { *pattern = 0; return p; }
+        if(*p == c && g_str_has_prefix(p, options->end_narrative))   { *pattern = 1; return p; }
+    }
+    return NULL;
+}
 
-    struct tuple parse_narrative(GQueue* acc, GQueue* rem) {
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define PACK3(s)    ((guint32) (guchar) (s)[0] | (guint32) (guchar) (s)[1] << 8 | (guint32) (guchar) (s)[2] << 16)
+#define MASK3       0x00FFFFFFu
+#else
+#define PACK3(s)    ((guint32) (guchar) (s)[0] << 24 | (guint32) (guchar) (s)[1] << 16 | (guint32) (guchar) (s)[2] << 8)
+#define MASK3       0xFFFFFF00u
+#endif
 
-        bool isEmpty    = g_queue_is_empty(rem);
-        Token* h        = g_queue_pop_head(rem);
-        GQueue* t       = rem;
+static
+const char* scan_packed(Options* options, const char* p, const char* stop, const char* limit, int* pattern) {
+    const guint32 open = PACK3(options->start_narrative), close = PACK3(options->end_narrative);
+
+    for(; p < stop && p + 4 <= limit; ++p) {
+        guint32 w;
+        memcpy(&w, p, 4);
+        w &= MASK3;
+        if(w == open)   { *pattern = 0; return p; }
+        if(w == close)  { *pattern = 1; return p; }
+    }
+    for(; p < stop && p + 3 <= limit; ++p) {
+        if(PACK3(p) == open)    { *pattern = 0; return p; }
+        if(PACK3(p) == close)   { *pattern = 1; return p; }
+    }
+    return NULL;
+}
 
-        return  isEmpty                 ?
-                                    error("You haven't closed your last narrative comment") :
-                h->kind == OpenComment  ?
-                    error("Don't open narrative comments inside narrative comments at line %i",
-                          h->OpenComment.line)                                              :
-                h->kind == CloseComment ? (struct tuple) {.acc = acc, .rem = t}             :
-                h->kind == Text         ? parse_narrative(g_queue_push_back(acc, h), t)     :
-                                          error("Should never get here");
-    };
+// The scanner for the delimiters of the options
+static
+ScanFunc find_scanner(const char* start, const char* end) {
+    return strlen(start) == 3 && strlen(end) == 3 ? scan_packed : scan_generic;
+}
 
-    struct tuple parse_code(GQueue* acc, GQueue* rem) {
+static inline
+const char* scan(Options* options, const char* p, const char* stop, const char* limit, int* pattern) {
+    return (options->scan ? options->scan : scan_generic)(options, p, stop, limit, pattern);
+}
 
-        bool isEmpty    = g_queue_is_empty(rem);
-        Token* h    = g_queue_pop_head(rem);
-        GQueue* t   = rem;
+/**
+Several narrative delimiters
+============================
 
-        return  isEmpty                 ? (struct tuple) {.acc = acc, .rem = t}         :
-                h->kind == OpenComment  ?
-                    (struct tuple) {.acc = acc, .rem = g_queue_push_front(rem, h)}      :
-                h->kind == CloseComment ? parse_code(g_queue_push_back(acc, h), rem)    :
-                h->kind == Text         ? parse_code(g_queue_push_back(acc, h), rem)    :
-                                          error("Should never get here");
-    };
-    #undef error
+Sources often mix the narrative comments with line doc comments, so the options can have more pairs of delimiters.
+A pair whose closing delimiter is a new line is a line doc comment, and the new line is part of the delimiter.
 
-    GQueue* parse_rec(GQueue* acc, GQueue* rem) {
+With more than one pair the delimiters are all found in one pass by an [Aho-Corasick](https://en.wikipedia.org/wiki/Aho%E2%80%93Corasick_algorithm)
+automaton. It is compiled when a pair is added, as a table with a transition for each state and byte, so scanning
+costs a load per byte whatever the number of delimiters. Each state knows the delimiters that end there.
 
-        bool isEmpty    = g_queue_is_empty(rem);
-        Token* h    = g_queue_pop_head(rem);
-        GQueue* t   = rem;
+The automaton finds delimiters by where they end, but the tokenizer wants them by where they start. So after the first
+match the scanner keeps going as long as a longer delimiter could still start before it. At the same position
+an opening delimiter wins, as in the other scanners, and then the pair declared first.
+**/
 
-        return  isEmpty                 ? acc                                           :
-                h->kind == OpenComment  ? ({
-                                           GQueue* emp = g_queue_new();
-                                           struct tuple tu = parse_narrative(emp, t);
-                                           Chunk* ch = union_new(
-                                                Chunk, NarrativeChunk, .tokens = tu.acc );
-                                           GQueue* newQ = g_queue_push_back(acc, ch);
-                                           parse_rec(newQ, tu.rem);
-                                           })                                            :
-                h->kind == CloseComment ?
-                    report_error_e(
-                        "Don't insert a close narrative comment at the start of your"
-                        " program at line %i",
-                                            h->OpenComment.line)                         :
-                h->kind == Text         ?
-                                        ({
-                                           GQueue* emp = g_queue_new();
-                                           struct tuple tu =
-                                                parse_code(g_queue_push_front(emp, h), t);
-                                           parse_rec(g_queue_push_back
-                                            (acc,
-                                             union_new(Chunk, CodeChunk, .tokens = tu.acc)),
-                                             tu.rem);
-                                          })                                                               :
-                                          g_assert_no_match;
-    }
+struct Automaton {
+    gint32*     next;       // 256 transitions for each state
+    gint32*     first;      // where the delimiters ending in a state start in matches
+    gint32*     matches;    // the delimiters ending in each state, each list ends with -1
+    guint*      lengths;
+    guint       max_length;
+};
 
-    return parse_rec(g_queue_new(), tokens);
+static inline
+int pairs_count(Options* options) {
+    return 1 + (options->more_pairs ? (int) options->more_pairs->len : 0);
 }
 
-/**
-Flattener
-=========
+static inline
+const char* pattern_string(Options* options, int pattern) {
+    int pair = PATTERN_PAIR(pattern);
+    NarrativePair* np = pair ? &g_array_index(options->more_pairs, NarrativePair, pair - 1) : NULL;
 
-This follows the usual practice of representing fold as foreach statments (and maps to). Pheraps I shall build
-better abstractions for them at some point. I also introduce a little macro to simplify writing of GFunc lambdas, given how pervasive
-they are.
+    return  pattern == 0    ? options->start_narrative  :
+            pattern == 1    ? options->end_narrative    :
+            pattern % 2     ? np->end                   :
+                              np->start;
+}
 
-Again, note how heavy ternary operated this is ...
-**/
+static inline
+gsize delimiter_length(Options* options, int kind, int pair) {
+    return strlen(pattern_string(options, 2 * pair + (kind == CloseComment)));
+}
 
-#define g_func_z(type, name, ...) lambda(void,                                              \
-                                        (void* private_it, G_GNUC_UNUSED void* private_no){ \
-                                       type name = private_it;                              \
-                                       __VA_ARGS__                                          \
-                                })
+static inline
+bool is_line_pair(Options* options, int pair) {
+    return !strcmp(pattern_string(options, 2 * pair + 1), NL);
+}
 
 static
-GQueue* flatten(Options* options, GQueue* chunks) {
-    GString* token_to_string_narrative(Token* tok) {
-        return  tok->kind == OpenComment ||
-                tok->kind == CloseComment   ?
-                    report_error_e("Cannot nest narrative comments at line %i",
-                                   tok->OpenComment.line)                                   :
-                tok->kind == Text           ? g_string_new(tok->Text.text)                  :
-                                              g_assert_no_match;
-    }
-    GString* token_to_string_code(Token* tok) {
-        return  tok->kind == OpenComment    ?
-                report_error_e(
-                    "Open narrative comment cannot be in code at line %i."
-                    " Pheraps you have an open comment "
-                    "in a code string before this comment tag?"
-                    , tok->OpenComment.line)                                                :
-                tok->kind == CloseComment   ? g_string_new(options->end_narrative)          :
-                tok->kind == Text           ? g_string_new(tok->Text.text)                  :
-                                              g_assert_no_match;
-    }
-    Block* flatten_chunk(Chunk* ch) {
-        return  ch->kind == NarrativeChunk  ? ({
-                               GQueue* tokens = ch->NarrativeChunk.tokens;
-                               GString* res = g_string_sized_new(256);
-                               g_queue_foreach(tokens, g_func(Token*, tok,
-                                                g_string_append(
-                                                    res,
-                                                    token_to_string_narrative(tok)->str);
-                                                ), NULL);
-                               union_new(Block, Narrative, .narrative = res->str);
-                                               })   :
-                ch->kind == CodeChunk       ? ({
-                               GQueue* tokens = ch->CodeChunk.tokens;
-                               GString* res = g_string_sized_new(256);
-                               g_queue_foreach(tokens, g_func(Token*, tok,
-                                                        g_string_append(
-                                                            res,
-                                                            token_to_string_code(tok)->str);
-                                                        ), NULL);
-                               union_new(Block, Code, .code = res->str);
-                                               })   :
-                               g_assert_no_match;
-    }
-
-    GQueue* res = g_queue_new();
-    g_queue_foreach(chunks, g_func(Chunk*, ch,
-                                Block* b = flatten_chunk(ch);
-                                g_queue_push_tail(res, b);
-                                ) ,NULL);
+gsize max_delimiter_length(Options* options) {
+    gsize res = 0;
+    for(int i = 0; i < 2 * pairs_count(options); ++i) res = MAX(res, strlen(pattern_string(options, i)));
     return res;
 }
 
-/**
-Now we can tie everything together to build blockize, which is our parse tree.
-**/
-
 static
-GQueue* blockize(Options* options, char* source) {
-    GQueue* tokens  = tokenize(options, source);
-    GQueue* blocks  = parse(options, tokens);
-    return flatten(options, blocks);
-}
-
-/**
-Define the phases
-=================
+Automaton* automaton_new(Options* options) {
+    int count       = 2 * pairs_count(options);
+    GArray* next    = g_array_new(false, false, sizeof(gint32));
+    GPtrArray* out  = g_ptr_array_new();
+
+    gint32 add_state() {
+        for(int c = 0; c < 256; ++c) g_array_append_val(next, (gint32) {-1});
+        g_ptr_array_add(out, g_array_new(false, false, sizeof(gint32)));
+        return out->len - 1;
+    }
+    #define NEXT(s, c) g_array_index(next, gint32, (s) * 256 + (guchar) (c))
+
+    Automaton* a    = g_new0(Automaton, 1);
+    a->lengths      = g_new(guint, count);
+    add_state();
+
+    // The trie of the delimiters
+    for(gint32 i = 0; i < count; ++i) {
+        const char* pattern = pattern_string(options, i);
+        gint32 s            = 0;
+        for(const char* c = pattern; *c; ++c) {
+            if(NEXT(s, *c) < 0) { gint32 n = add_state(); NEXT(s, *c) = n; }
+            s = NEXT(s, *c);
+        }
+        g_array_append_val(g_ptr_array_index(out, s), i);
+        a->lengths[i]   = strlen(pattern);
+        a->max_length   = MAX(a->max_length, a->lengths[i]);
+    }
 
-In C you can easily forward declare function, so you don't have to come up with some clever escabotage like we had to do in F#.
-**/
+    // Fills the missing transitions with the ones of the failure state, breadth first
+    gint32* fail    = g_new0(gint32, out->len);
+    gint32* queue   = g_new(gint32, out->len);
+    int head = 0, tail = 0;
+    for(int c = 0; c < 256; ++c)
+        if(NEXT(0, c) < 0)  NEXT(0, c) = 0;
+        else                queue[tail++] = NEXT(0, c);
+
+    while(head < tail) {
+        gint32 u        = queue[head++];
+        GArray* from    = g_ptr_array_index(out, fail[u]);
+        g_array_append_vals(g_ptr_array_index(out, u), from->data, from->len);
+
+        for(int c = 0; c < 256; ++c)
+            if(NEXT(u, c) < 0)  NEXT(u, c) = NEXT(fail[u], c);
+            else {
+                fail[NEXT(u, c)] = NEXT(fail[u], c);
+                queue[tail++]    = NEXT(u, c);
+            }
+    }
+    #undef NEXT
+
+    GArray* matches = g_array_new(false, false, sizeof(gint32));
+    a->first        = g_new(gint32, out->len);
+    for(guint s = 0; s < out->len; ++s) {
+        GArray* o   = g_ptr_array_index(out, s);
+        a->first[s] = matches->len;
+        g_array_append_vals(matches, o->data, o->len);
+        g_array_append_val(matches, (gint32) {-1});
+        g_array_free(o, true);
+    }
 
-static
-GQueue* remove_empty_blocks(Options*, GQueue*);
-static
-GQueue* merge_blocks(Options*, GQueue*);
-static
-GQueue* add_code_tags(Options*, GQueue*);
+    a->matches  = (gint32*) g_array_free(matches, false);
+    a->next     = (gint32*) g_array_free(next, false);
+    g_ptr_array_free(out, true);
+    g_free(fail);
+    g_free(queue);
+    return a;
+}
 
 static
-GQueue* process_phases(Options* options, GQueue* blocks) {
-
-    blocks          = remove_empty_blocks(options, blocks);
-    blocks          = merge_blocks(options, blocks);
-    blocks          = add_code_tags(options, blocks);
-    return blocks;
+void automaton_free(Automaton* a) {
+    if(!a) return;
+    g_free(a->next);
+    g_free(a->first);
+    g_free(a->matches);
+    g_free(a->lengths);
+    g_free(a);
 }
 
 static
-char* extract(Block* b) {
-    return  b->kind == Code         ? b->Code.code          :
-            b->kind == Narrative    ? b->Narrative.narrative:
-                                      g_assert_no_match;
+const char* scan_automaton(Options* options, const char* p, const char* stop, const char* limit, int* pattern) {
+    Automaton* a        = options->automaton;
+    const char* best    = NULL;
+    const char* end     = MIN(limit, stop + a->max_length - 1);
+
+    bool preferred(int x, int y) { return x % 2 != y % 2 ? x % 2 == 0 : x < y; }
+
+    gint32 s = 0;
+    for(const char* q = p; q < end; ++q) {
+        s = a->next[s * 256 + (guchar) *q];
+        for(gint32* m = a->matches + a->first[s]; *m >= 0; ++m) {
+            const char* start = q + 1 - a->lengths[*m];
+            if(start >= stop) continue;
+            if(!best || start < best || (start == best && preferred(*m, *pattern))) {
+                best        = start;
+                *pattern    = *m;
+            }
+        }
+        if(best) end = MIN(end, best + a->max_length);
+    }
+    return best;
 }
 
 /**
-There must be a higher level way to write this utility function ...
+Not all the delimiters that the scanner finds are real ones. Inside a line doc comment just its new line counts, and
+a new line closes nothing outside of it. A line doc comment doesn't start inside a narrative comment either. Other
+opening delimiters inside narrative comments, and stray closing ones in the code, are kept to give the usual errors. `open` is the pair of the narrative comment the tokenizer is in, or -1.
+With just one pair every delimiter is accepted, as before.
 **/
 
 static
-bool is_str_all_spaces(const char* str) {
-    g_assert(str);
-    while(*str != '\0') {
-        if(!g_ascii_isspace(*str))
-            return false;
-        str++;
-    }
-    return true;
+bool accept_delimiter(Options* options, int* open, int kind, int pair) {
+    bool accepted   = kind == OpenComment   ? *open < 0 || !(is_line_pair(options, *open) || is_line_pair(options, pair)) :
+                      *open >= 0            ? pair == *open                 :
+                                              !is_line_pair(options, pair);
+
+    if(accepted) *open = kind == CloseComment ? -1 : *open >= 0 ? *open : pair;
+    return accepted;
 }
 
 static
-GQueue* remove_empty_blocks(G_GNUC_UNUSED Options* options, GQueue* blocks) {
+bool options_add_pair(Options* options, const char* start, const char* end, char** error) {
+    g_assert(options);
+    g_assert(error);
 
-    g_queue_foreach(blocks, g_func(Block*, b,
-        if(is_str_all_spaces(extract(b)))
-            g_queue_remove(blocks, b);
-                                   ), NULL);
-    return blocks;
-}
+    *error = !start || !*start || !end || !*end ? g_strdup("Narrative delimiters can't be empty") : NULL;
+    if(*error) return false;
 
-static
-GQueue* merge_blocks(G_GNUC_UNUSED Options*options, GQueue* blocks) {
-    return  g_queue_is_empty(blocks)            ? blocks            :
-            g_queue_get_length(blocks) == 1     ? blocks            :
-                ({
-                 Block* h1 = g_queue_pop_head(blocks);
-                 Block* h2 = g_queue_pop_head(blocks);
-                 h1->kind == Code && h2->kind == Code ? ({
-                     char* newCode =
-                        g_strjoin("", h1->Code.code, NL, h2->Code.code, NULL);
-                     Block* b = union_new(Block, Code, .code = newCode);
-                     merge_blocks(options, g_queue_push_front(blocks, b));
-                                                         })         :
-                 h1->kind == Narrative && h2->kind == Narrative ? ({
-                     char* newNarr =
-                        g_strjoin(
-                            "", h1->Narrative.narrative, NL, h2->Narrative.narrative, NULL);
-                     Block* b = union_new(Block, Narrative, .narrative = newNarr);
-                     merge_blocks(options, g_queue_push_front(blocks, b));
-                                                         })         :
-                                                         ({
-                     GQueue* newBlocks =
-                        merge_blocks(options, g_queue_push_front(blocks, h2));
-                     g_queue_push_front(newBlocks, h1);
-                                                         });
-                 });
+    if(!options->more_pairs) options->more_pairs = g_array_new(false, false, sizeof(NarrativePair));
+    g_array_append_val(options->more_pairs, ((NarrativePair) {.start = g_strdup(start), .end = g_strdup(end)}));
+
+    automaton_free(options->automaton);
+    options->automaton  = automaton_new(options);
+    options->scan       = scan_automaton;
+    return true;
 }
 
 /**
-This really should be in glib ...
+Tokenizing big files in parallel
+================================
+
+The recursive tokenizer above is nice to read, but it walks the buffer one char at a time on a single core. For big
+generated files (100 MB and up) that is the whole cost of the program, so for them I split the work in phases:
+
+1. the buffer is cut into one segment per core and each worker finds all the positions where a delimiter *could* start.
+   A delimiter can straddle the end of a segment, that's fine as the worker is allowed to look past its end.
+2. a sequential pass walks the candidates in order and keeps the ones that the recursive tokenizer would have seen.
+   That's the case when a candidate starts after the end of the last accepted delimiter. At the same position an
+   opening comment wins over a closing one, as in `tokenize_rec`. This is cheap, as it touches just the candidates.
+   It is also where line doc comments are tracked, with a line doc comment still open at the end closed there.
+3. the token stream is the accepted delimiters with the spans of text between them. A token is just an offset and a
+   length, and the lines are counted only when asked, so this is a cheap sequential pass too.
+
+The result is exactly the same token sequence that the sequential tokenizer produces. With just one segment there are no
+threads and no recursion, so it is used for small files too and the recursive tokenizer stays as the reference
+that the others are tested against.
 **/
 
-inline static
-gint g_asprintf_z(gchar** string, gchar const *format, ...) {
-	va_list argp;
-	va_start(argp, format);
-	gint bytes = g_vasprintf(string, format, argp);
-	va_end(argp);
-    return bytes;
-}
+#define PARALLEL_TOKENIZE_MIN_SIZE (1 << 20)
 
-static
-char* indent(int n, char* s) {
-    g_assert(s);
+typedef struct Delimiter { gsize pos; int kind; int pair; } Delimiter;
 
-    char* ind       = g_strnfill(n, ' ');
-    char* tmp;
-    g_asprintf(&tmp, "%s%s", ind, s);
+static
+void parallel_for(int n, void (*body)(int)) {
+    g_assert(n > 0);
 
-    char* withNl;
-    g_asprintf(&withNl, "\n%s", ind);
+    gpointer run(gpointer i) { body(GPOINTER_TO_INT(i)); return NULL; }
 
-    return g_strjoinv(withNl, g_strsplit(tmp, NL, -1));
+    GThread** threads = g_new(GThread*, n);
+    for(int i = 1; i < n; ++i) threads[i] = g_thread_new("clite-worker", run, GINT_TO_POINTER(i));
+    body(0);
+    for(int i = 1; i < n; ++i) g_thread_join(threads[i]);
+    g_free(threads);
 }
 
 /**
-And finally I ended up defining map. See if you like how the usage looks in the function below.
+Under `make -jN` each clite on its own would start a worker for each core, and N of them would run N times too many
+threads. So when make shares its jobserver, the work that is split between a pool of workers (the files of a batch,
+the blocks to tag) takes its parallelism from there: the first worker runs on the token that make gave to the
+process, and each other one starts when a token is read from the jobserver, and writes it back when it is done. A
+helper thread waits for the tokens, as long as there is work left that a new worker could take. The work that is split
+in a fixed number of pieces, as the segments of the tokenizer, isn't split at all under a jobserver.
+
+The tokens that are taken are kept in the `Jobserver` until they are given back, so that when an error ends the
+process half way `jobserver_release`, called at exit, gives back the ones the workers still have. Otherwise make
+would run the rest of the build with fewer jobs.
 **/
 
-#define g_queue_map_z(q, type, name, ...) ({                                \
-        GQueue* private_res = g_queue_new();                                \
-        g_queue_foreach(q, g_func(type, name,                               \
-            name = __VA_ARGS__;                                             \
-            g_queue_push_tail(private_res, name);                           \
-            ), NULL);                                                       \
-        private_res;                                                        \
-                                      })
+typedef struct Jobserver { int read; int write; GString* held; } Jobserver;
+
+static Jobserver* s_jobserver = NULL;
+static GMutex s_jobserver_lock;
 
 static
-GQueue* add_code_tags(Options* options, GQueue* blocks) {
+void jobserver_take(Jobserver* js, char token) {
+    g_mutex_lock(&s_jobserver_lock);
+    g_string_append_c(js->held, token);
+    g_mutex_unlock(&s_jobserver_lock);
+}
 
-    GQueue* indent_blocks(GQueue* blocks) {
-        return g_queue_map(blocks, Block*, b,
-                b->kind == Narrative ? b                                                                                                    :
-                b->kind == Code      ?
-                    union_new(Block, Code, .code =
-                        indent(options->code_symbols->Indented.indentation, b->Code.code))    :
-                    g_assert_no_match;);
+// Gives back the last token taken, or with all as many as fit in a write, taking them from held in one step. With none
+// held it does nothing, as at exit a worker can give back its own first. Returns how many it gave back.
+static
+gsize jobserver_give(Jobserver* js, bool all) {
+    char tokens[64];
+    g_mutex_lock(&s_jobserver_lock);
+    gsize n = MIN(all ? js->held->len : MIN(js->held->len, 1), sizeof(tokens));
+    memcpy(tokens, js->held->str + js->held->len - n, n);
+    g_string_truncate(js->held, js->held->len - n);
+    g_mutex_unlock(&s_jobserver_lock);
+#ifdef G_OS_UNIX
+    for(gsize done = 0; done < n;) {
+        ssize_t w = write(js->write, tokens + done, n - done);
+        if(w > 0)               done += w;
+        else if(errno != EINTR) break;
     }
+#endif
+    return n;
+}
 
-    GQueue* surround_blocks(GQueue* blocks) {
-        return g_queue_map(blocks, Block*, b,
-                b->kind == Narrative ?
-                    union_new(Block, Narrative, .narrative =
-                        g_strjoin("", NL, g_strstrip(b->Narrative.narrative), NL, NULL))   :
-                b->kind == Code      ?
-                    union_new(Block, Code, .code = g_strjoin("",
-                                                 NL,
-                                                 options->code_symbols->Surrounded.start_code,
-                                                 NL,
-                                                 g_strstrip(b->Code.code),
-                                                 NL,
-                                                 options->code_symbols->Surrounded.end_code,
-                                                 NL,
-                                                 NULL))    :
-                                       g_assert_no_match;);
+static
+int processors() { return s_jobserver ? 1 : g_get_num_processors(); }
+
+static
+void parallel_jobs(int n, bool (*more)(void), void (*body)(int)) {
+    g_assert(n > 0);
+
+#ifdef G_OS_UNIX
+    Jobserver* js       = s_jobserver;
+    int wake[2];
+    if(!js || n == 1 || js->read < 0 || pipe(wake)) {
+        parallel_for(js ? 1 : n, body);
+        return;
+    }
 
+    GThread** workers   = g_new0(GThread*, n);
+    gpointer run(gpointer i) {
+        body(GPOINTER_TO_INT(i));
+        jobserver_give(js, false);
+        return NULL;
+    }
+    gpointer acquire(G_GNUC_UNUSED gpointer unused) {
+        struct pollfd fds[] = {{.fd = js->read, .events = POLLIN}, {.fd = wake[0], .events = POLLIN}};
+        for(int started = 1; started < n && more();) {
+            if(poll(fds, 2, -1) < 0 || fds[1].revents) break;
+            // Another process can be faster to take it
+            char token;
+            if(read(js->read, &token, 1) != 1) continue;
+            jobserver_take(js, token);
+            if(!more()) {
+                jobserver_give(js, false);
+                break;
+            }
+            workers[started] = g_thread_new("clite-job", run, GINT_TO_POINTER(started));
+            ++started;
+        }
+        return NULL;
     }
 
-    return  options->code_symbols->kind == Indented     ?   indent_blocks(blocks)   :
-            options->code_symbols->kind == Surrounded   ?   surround_blocks(blocks) :
-                                                            g_assert_no_match;
+    GThread* helper     = g_thread_new("clite-jobserver", acquire, NULL);
+    body(0);
+    while(write(wake[1], "", 1) < 0 && errno == EINTR);
+    g_thread_join(helper);
+    for(int i = 1; i < n; ++i) if(workers[i]) g_thread_join(workers[i]);
+
+    close(wake[0]);
+    close(wake[1]);
+    g_free(workers);
+#else
+    G_GNUC_UNUSED bool (*unused)(void) = more;
+    parallel_for(s_jobserver ? 1 : n, body);
+#endif
 }
 
-char* stringify(GQueue* blocks) {
-    GString* res = g_string_sized_new(2048);
-    g_queue_foreach(blocks, g_func(Block*, b,
-        g_string_append(res, extract(b));
-    ), NULL);
-    return g_strchug(res->str);
+static
+void find_delimiters(Options* options, char* source, gsize len, gsize begin, gsize end, GArray* found) {
+    int pattern;
+    for(const char* p = source + begin; (p = scan(options, p, source + end, source + len, &pattern)); ++p)
+        g_array_append_val(found, ((Delimiter) {.pos    = p - source,
+                                                .kind   = PATTERN_KIND(pattern),
+                                                .pair   = PATTERN_PAIR(pattern)}));
 }
 
-void deb(GQueue* q);
+static
+TokenStream* tokenize_parallel(Options* options, char* source, gsize len, int segments) {
+    g_assert(options);
+    g_assert(source);
+    g_assert(segments > 0);
+
+    gsize seg_len   = len / segments + 1;
+
+    // 1. Candidates
+    GArray** found = g_new(GArray*, segments);
+    void find(int i) {
+        gsize begin = MIN(len, i * seg_len), end = MIN(len, begin + seg_len);
+        found[i]    = g_array_new(false, false, sizeof(Delimiter));
+        find_delimiters(options, source, len, begin, end, found[i]);
+    }
+    parallel_for(segments, find);
+
+    // 2. Resolution
+    GArray* accepted = g_array_new(false, false, sizeof(Delimiter));
+    gsize cursor = 0;
+    int open     = -1;
+    for(int i = 0; i < segments; ++i) {
+        for(guint j = 0; j < found[i]->len; ++j) {
+            Delimiter d = g_array_index(found[i], Delimiter, j);
+            if(d.pos < cursor || !accept_delimiter(options, &open, d.kind, d.pair)) continue;
+            g_array_append_val(accepted, d);
+            cursor = d.pos + delimiter_length(options, d.kind, d.pair);
+        }
+        g_array_free(found[i], true);
+    }
+    g_free(found);
+    if(open >= 0 && is_line_pair(options, open))
+        g_array_append_val(accepted, ((Delimiter) {.pos = len, .kind = CloseComment, .pair = open}));
+
+    // 3. Tokens
+    TokenStream* res = token_stream_new(source, len);
+    gsize from       = 0;
+    for(guint k = 0; k < accepted->len; ++k) {
+        Delimiter d = g_array_index(accepted, Delimiter, k);
+        gsize size  = d.pos < len ? delimiter_length(options, d.kind, d.pair) : 0;
+        if(d.pos > from) token_stream_push(res, Text, 0, from, d.pos - from);
+        token_stream_push(res, d.kind, d.pair, d.pos, size);
+        from        = d.pos + size;
+    }
+    if(len > from) token_stream_push(res, Text, 0, from, len - from);
+
+    g_array_free(accepted, true);
+    return res;
+}
 
 static
-char* translate(Options* options, char* source) {
+TokenStream* tokenize(Options* options, char* source) {
     g_assert(options);
     g_assert(source);
 
-    GQueue* blocks  = blockize(options, source);
-    blocks          = process_phases(options, blocks);
-    return stringify(blocks);
+    gsize len = strlen(source);
+    return tokenize_parallel(options, source, len, len < PARALLEL_TOKENIZE_MIN_SIZE ? 1 : processors());
 }
 
 /**
-Parsing the command line
-========================
+Parser
+======
 
-In glib there is a command line parser that accept options in unix-like format and automatically produces professional
-`--help` messages and such. We shoudl really have something like this in .NET. Pheraps we do and I'm not aware of it?
+This again has a similar structure to the F# version, just longer. It is very long because it contains 3 (nested) functions which
+are on the verbose side in C.
+
+The creation of a `error` macro is unfortunate. I just don't know how to adapt `g_assert_e` so that it works for not pointer returning functions.
+
+I also need a simple function `report_error` to exit gracefully giving a message to the user. I didn't found such thing in glib (?)
 **/
 
-typedef struct CmdOptions { char* input_file; char* output_file; Options* options;} CmdOptions;
+#define report_error_z(...) G_STMT_START { g_print(__VA_ARGS__); exit(1); } G_STMT_END                                                            \
 
-static
-CmdOptions* parse_command_line(int argc, char* argv[]);
+/**
+Exiting is fine for the command line, but not when clite is embedded in another process. So errors in the source go
+through `fail`. If the caller put a `Failure` in the options, `fail` stores the line and the message there and jumps
+back to the caller, otherwise it behaves like `report_error`. The caller owns the `Failure`, so there is no global state.
+A line of zero means that the error is not about a particular line, and a column of zero that it is not known.
 
-static char *no = NULL, *nc = NULL, *l = NULL, *co = NULL, *cc = NULL, *ou = NULL;
-static char** in_file;
+The errors about a token of a stream say where the token is, and show its line.
+**/
 
-static int ind = 0;
-static bool tests = false;
+struct Failure { jmp_buf jump; int line; int column; char* message; };
+
+// Takes message
+static G_GNUC_NORETURN
+void fail_with(Failure* failure, int line, int column, char* message) {
+    if(!failure) report_error("%s", message);
+
+    failure->line       = line;
+    failure->column     = column;
+    failure->message    = message;
+    longjmp(failure->jump, 1);
+}
+
+static G_GNUC_NORETURN G_GNUC_PRINTF(4, 5)
+void fail_at(Failure* failure, int line, int column, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    char* message = g_strdup_vprintf(format, args);
+    va_end(args);
+    fail_with(failure, line, column, message);
+}
+
+#define fail(options, line, ...)    fail_at((options)->failure, (line), 0, __VA_ARGS__)
+#define fail_e(options, line, ...)  ({ fail(options, line, __VA_ARGS__); NULL; })
+
+// what is followed by the position of the token, then by hint and the line of the token
+static G_GNUC_NORETURN
+void fail_token(Options* options, TokenStream* tokens, gsize i, const char* what, const char* hint) {
+    Position p      = token_position(tokens, i);
+    char* shown     = excerpt(tokens->lines, p);
+    Failure* f      = options->failure;
+    char* message   = g_strdup_printf("%s at line %i, column %i%s\n%s", what, p.line, p.column, hint, shown);
+    g_free(shown);
+    fail_with(f, p.line, p.column, message);
+}
+
+#define fail_token_e(...)           ({ fail_token(__VA_ARGS__); NULL; })
+
+/**
+A chunk is the range `[first, last)` of the tokens of the stream that make a block. For a narrative chunk the range
+leaves out its delimiters. The functions that walk the stream take the index of the next token and return the index
+where they stopped, instead of popping tokens from a queue.
+**/
+
+union_decl(Chunk, NarrativeChunk, CodeChunk)
+    union_type(NarrativeChunk,  gsize first; gsize last; int pair)
+    union_type(CodeChunk,       gsize first; gsize last)
+union_end(Chunk);
+
+// The chunks are pushed on a queue of the caller, so that it can free them when the parsing fails
+static
+GQueue* parse(Options* options, TokenStream* tokens, GQueue* chunks) {
+    g_assert(options);
+    g_assert(tokens);
+
+    gsize n         = tokens->len;
+    guint8* kinds   = tokens->kinds;
+
+    #define error(line, ...) \
+        ({ fail(options, line, __VA_ARGS__); (gsize) 0; })
+    #define error_at(i, what) \
+        ({ fail_token(options, tokens, i, what, ""); (gsize) 0; })
+
+    // The index of the close narrative comment of the one opened at open. One never closed is reported where it opens.
+    gsize parse_narrative(gsize open, gsize i) {
+        return  i == n                  ?
+                    error_at(open, "You haven't closed your last narrative comment")        :
+                kinds[i] == OpenComment ?
+                    error_at(i, "Don't open narrative comments inside narrative comments")  :
+                kinds[i] == CloseComment? i                                                 :
+                kinds[i] == Text        ? parse_narrative(open, i + 1)                      :
+                                          error(0, "Should never get here");
+    };
+
+    // The index of the open narrative comment after the code, or the end
+    gsize parse_code(gsize i) {
+        return  i == n                  ? i                     :
+                kinds[i] == OpenComment ? i                     :
+                kinds[i] == CloseComment? parse_code(i + 1)     :
+                kinds[i] == Text        ? parse_code(i + 1)     :
+                                          error(0, "Should never get here");
+    };
+    #undef error
+    #undef error_at
+
+    GQueue* parse_rec(GQueue* acc, gsize i) {
+        return  i == n                  ? acc                                           :
+                kinds[i] == OpenComment ? ({
+                                           gsize close = parse_narrative(i, i + 1);
+                                           Chunk* ch = union_new(
+                                                Chunk, NarrativeChunk, .first = i + 1, .last = close,
+                                                .pair = tokens->pairs[i]);
+                                           GQueue* newQ = g_queue_push_back(acc, ch);
+                                           parse_rec(newQ, close + 1);
+                                           })                                            :
+                kinds[i] == CloseComment?
+                    fail_token_e(options, tokens, i,
+                        "Don't insert a close narrative comment at the start of your program", "") :
+                kinds[i] == Text        ?
+                                        ({
+                                           gsize end = parse_code(i + 1);
+                                           parse_rec(g_queue_push_back
+                                            (acc,
+                                             union_new(Chunk, CodeChunk, .first = i, .last = end)),
+                                             end);
+                                          })                                                               :
+                                          g_assert_no_match;
+    }
+
+    return parse_rec(chunks, 0);
+}
+
+/**
+`parse` stops at the first error, which is what a translation needs, but fixing a batch of files one error at the time
+costs a run for each one. `diagnose` walks the tokens with the same rules and records all the errors instead, picking
+up again at the next open narrative comment: a stray close is taken as code, an open inside a narrative starts a new
+one. A narrative that is never closed is reported where it opens. A stream has no errors here just if `parse` succeeds
+on it.
+**/
+
+#ifndef CLITE_LIBRARY
+typedef struct Diagnostic { char* file; int line; int column; char* message; char* excerpt; } Diagnostic;
+
+static
+guint diagnose(TokenStream* tokens, const char* file, GArray* diagnostics) {
+    g_assert(tokens);
+    g_assert(diagnostics);
+
+    guint found     = 0;
+    void add(gsize i, const char* message) {
+        Position p      = token_position(tokens, i);
+        Diagnostic d    = {.file = g_strdup(file), .line = p.line, .column = p.column, .message = g_strdup(message),
+                           .excerpt = excerpt(tokens->lines, p)};
+        g_array_append_val(diagnostics, d);
+        ++found;
+    }
+
+    enum { AtTop, InNarrative, InCode } state = AtTop;
+    gsize open = 0;
+    for(gsize i = 0; i < tokens->len; ++i) {
+        int kind = tokens->kinds[i];
+        if(state == InNarrative && kind == OpenComment)
+            add(i, "Don't open narrative comments inside narrative comments");
+        if(state == AtTop && kind == CloseComment)
+            add(i, "Don't insert a close narrative comment at the start of your program");
+
+        state   = kind == OpenComment                           ? InNarrative   :
+                  kind == CloseComment && state == InNarrative  ? AtTop         :
+                  state == AtTop                                ? InCode        :
+                                                                  state;
+        open    = kind == OpenComment ? i : open;
+    }
+    if(state == InNarrative) add(open, "You haven't closed your last narrative comment");
+    return found;
+}
+
+static
+void free_diagnostic(Diagnostic* d) {
+    g_free(d->file);
+    g_free(d->message);
+    g_free(d->excerpt);
+}
+
+static
+gint compare_diagnostics(gconstpointer a, gconstpointer b) {
+    const Diagnostic *x = a, *y = b;
+    int files = strcmp(x->file, y->file);
+    return files ? files : x->line != y->line ? x->line - y->line : x->column - y->column;
+}
+#endif
+
+/**
+Blocks in a vector
+==================
+
+A queue of blocks costs two allocations for each block, plus one for its text, and a phase that changes just the text
+of a block builds a new one. So the phases that work on a whole document keep the blocks in a `Blocks` vector: the
+blocks are stored one after the other in slots of 64 bytes, each with room for a short text, so that the many small
+blocks of a document don't allocate anything. A longer text is pointed to by its slot, which owns it. The phases
+rewrite the slots in place, freeing the texts they replace, and return the same vector.
+
+A short text points inside its slot, so when a slot moves, or the vector grows, the text is pointed to again.
+**/
+
+#define BLOCK_INLINE_SIZE (64 - sizeof(Block) - sizeof(bool))
+
+typedef struct BlockSlot { Block block; bool small; char text[BLOCK_INLINE_SIZE]; } BlockSlot;
+
+struct Blocks { BlockSlot* slots; guint len; guint room; };
+
+static inline
+char** block_text(Block* b) { return b->kind == Code ? &b->Code.code : &b->Narrative.narrative; }
+
+static inline
+Block* blocks_at(Blocks* blocks, guint i) { return &blocks->slots[i].block; }
+
+static inline
+void slot_point(BlockSlot* s) { if(s->small) *block_text(&s->block) = s->text; }
+
+static
+Blocks* blocks_new(guint room) {
+    Blocks* blocks  = g_new(Blocks, 1);
+    blocks->room    = MAX(room, 16);
+    blocks->len     = 0;
+    blocks->slots   = g_new(BlockSlot, blocks->room);
+    return blocks;
+}
+
+static
+void blocks_free(Blocks* blocks) {
+    for(guint i = 0; i < blocks->len; ++i)
+        if(!blocks->slots[i].small) g_free(*block_text(blocks_at(blocks, i)));
+    g_free(blocks->slots);
+    g_free(blocks);
+}
+
+// Sets the text of a block, taking it if own is true, and frees the text it replaces
+static
+void blocks_set(Blocks* blocks, guint i, char* text, gsize len, bool own) {
+    BlockSlot* s    = &blocks->slots[i];
+    char** field    = block_text(&s->block);
+    if(text == *field) return;
+
+    char* old       = s->small ? NULL : *field;
+    s->small        = len < BLOCK_INLINE_SIZE;
+    if(s->small) {
+        memmove(s->text, text, len);
+        s->text[len] = '\0';
+        if(own) g_free(text);
+    }
+    *field          = s->small ? s->text : own ? text : g_strndup(text, len);
+    g_free(old);
+}
+
+static
+void blocks_push(Blocks* blocks, int kind, int pair, char* text, gsize len, bool own) {
+    if(blocks->len == blocks->room) {
+        blocks->room    = 2 * blocks->room;
+        blocks->slots   = g_renew(BlockSlot, blocks->slots, blocks->room);
+        for(guint i = 0; i < blocks->len; ++i) slot_point(&blocks->slots[i]);
+    }
+    BlockSlot* s    = &blocks->slots[blocks->len++];
+    s->block        = kind == Code ? (Block) {.kind = Code, .Code = {.code = s->text}}
+                                   : (Block) {.kind = Narrative, .Narrative = {.narrative = s->text, .pair = pair}};
+    s->small        = true;
+    s->text[0]      = '\0';
+    blocks_set(blocks, blocks->len - 1, text, len, own);
+}
+
+static inline
+void blocks_move(Blocks* blocks, guint to, guint from) {
+    if(to == from) return;
+    blocks->slots[to] = blocks->slots[from];
+    slot_point(&blocks->slots[to]);
+}
+
+#ifndef CLITE_LIBRARY
+static
+Blocks* blocks_copy(Blocks* blocks) {
+    Blocks* res = blocks_new(blocks->len);
+    memcpy(res->slots, blocks->slots, blocks->len * sizeof(BlockSlot));
+    res->len    = blocks->len;
+    for(guint i = 0; i < res->len; ++i) {
+        BlockSlot* s = &res->slots[i];
+        if(s->small) slot_point(s);
+        else         *block_text(&s->block) = g_strdup(*block_text(&s->block));
+    }
+    return res;
+}
+#endif
+
+/**
+Flattener
+=========
+
+This follows the usual practice of representing fold as foreach statments (and maps to). Pheraps I shall build
+better abstractions for them at some point. I also introduce a little macro to simplify writing of GFunc lambdas, given how pervasive
+they are.
+
+Again, note how heavy ternary operated this is ...
+**/
+
+#define g_func_z(type, name, ...) lambda(void,                                              \
+                                        (void* private_it, G_GNUC_UNUSED void* private_no){ \
+                                       type name = private_it;                              \
+                                       __VA_ARGS__                                          \
+                                })
+
+static
+Blocks* flatten(Options* options, TokenStream* tokens, GQueue* chunks) {
+    const char* text(gsize i) { return tokens->source + tokens->offsets[i]; }
+
+    GString* append_narrative(GString* res, gsize i) {
+        return  tokens->kinds[i] == OpenComment ||
+                tokens->kinds[i] == CloseComment    ?
+                    fail_token_e(options, tokens, i, "Cannot nest narrative comments", "")      :
+                tokens->kinds[i] == Text            ? g_string_append_len(res, text(i), tokens->lengths[i]) :
+                                                      g_assert_no_match;
+    }
+    GString* append_code(GString* res, gsize i) {
+        return  tokens->kinds[i] == OpenComment     ?
+                fail_token_e(options, tokens, i,
+                    "Open narrative comment cannot be in code",
+                    ". Pheraps you have an open comment "
+                    "in a code string before this comment tag?")                            :
+                tokens->kinds[i] == CloseComment    ?
+                    g_string_append(res, pattern_string(options, 2 * tokens->pairs[i] + 1))   :
+                tokens->kinds[i] == Text            ? g_string_append_len(res, text(i), tokens->lengths[i]) :
+                                                      g_assert_no_match;
+    }
+    // A short block is built in a scratch buffer and copied in its slot, a long one in a buffer that the slot takes
+    GString* scratch = g_string_sized_new(BLOCK_INLINE_SIZE);
+    GString* buffer(gsize first, gsize last) {
+        gsize span = first < last ? tokens->offsets[last - 1] + tokens->lengths[last - 1] - tokens->offsets[first] : 0;
+        return span < BLOCK_INLINE_SIZE ? g_string_truncate(scratch, 0) : g_string_sized_new(span);
+    }
+    void push(Blocks* res, int kind, int pair, GString* text) {
+        gsize len   = text->len;
+        bool own    = text != scratch;
+        blocks_push(res, kind, pair, own ? g_string_free(text, false) : text->str, len, own);
+    }
+    void flatten_chunk(Blocks* res, Chunk* ch) {
+        if(ch->kind == NarrativeChunk) {
+            gsize first = ch->NarrativeChunk.first, last = ch->NarrativeChunk.last;
+            GString* text = buffer(first, last);
+            for(gsize i = first; i < last; ++i) append_narrative(text, i);
+            push(res, Narrative, ch->NarrativeChunk.pair, text);
+        } else {
+            gsize first = ch->CodeChunk.first, last = ch->CodeChunk.last;
+            GString* text = buffer(first, last);
+            for(gsize i = first; i < last; ++i) append_code(text, i);
+            push(res, Code, 0, text);
+        }
+    }
+
+    Blocks* res = blocks_new(g_queue_get_length(chunks));
+    g_queue_foreach(chunks, g_func(Chunk*, ch, flatten_chunk(res, ch);), NULL);
+    g_string_free(scratch, true);
+    return res;
+}
+
+/**
+Now we can tie everything together to build blockize, which is our parse tree.
+**/
+
+// Frees tokens
+static
+Blocks* blockize_tokens(Options* options, TokenStream* tokens) {
+    Blocks* blocks      = flatten(options, tokens, parse(options, tokens, g_queue_new()));
+    token_stream_free(tokens);
+    return blocks;
+}
+
+static
+Blocks* blockize(Options* options, char* source) { return blockize_tokens(options, tokenize(options, source)); }
+
+/**
+Define the phases
+=================
+
+In C you can easily forward declare function, so you don't have to come up with some clever escabotage like we had to do in F#.
+**/
+
+static
+Blocks* remove_empty_blocks(Options*, Blocks*);
+static
+Blocks* merge_blocks(Options*, Blocks*);
+static
+Blocks* add_code_tags(Options*, Blocks*);
+
+static
+Blocks* process_phases(Options* options, Blocks* blocks) {
+
+    blocks          = remove_empty_blocks(options, blocks);
+    blocks          = merge_blocks(options, blocks);
+    blocks          = add_code_tags(options, blocks);
+    return blocks;
+}
+
+static
+char* extract(Block* b) {
+    return  b->kind == Code         ? b->Code.code          :
+            b->kind == Narrative    ? b->Narrative.narrative:
+                                      g_assert_no_match;
+}
+
+/**
+There must be a higher level way to write this utility function ...
+**/
+
+static
+bool is_str_all_spaces(const char* str) {
+    g_assert(str);
+    while(*str != '\0') {
+        if(!g_ascii_isspace(*str))
+            return false;
+        str++;
+    }
+    return true;
+}
+
+/**
+Both phases compact the vector in place, moving each block it keeps down to the next free slot. A run of blocks of the
+same kind is joined in a scratch buffer, which becomes the text of the first slot of the run, and as in the F# version
+a merged narrative forgets its pair.
+**/
+
+static
+Blocks* remove_empty_blocks(G_GNUC_UNUSED Options* options, Blocks* blocks) {
+    guint to = 0;
+    for(guint i = 0; i < blocks->len; ++i)
+        if(is_str_all_spaces(extract(blocks_at(blocks, i))))    blocks_set(blocks, i, "", 0, false);
+        else                                                    blocks_move(blocks, to++, i);
+    blocks->len = to;
+    return blocks;
+}
+
+static
+Blocks* merge_blocks(G_GNUC_UNUSED Options*options, Blocks* blocks) {
+    GString* merged = g_string_sized_new(256);
+    guint to        = 0;
+    for(guint i = 0, j; i < blocks->len; i = j) {
+        int kind = blocks_at(blocks, i)->kind;
+        for(j = i + 1; j < blocks->len && blocks_at(blocks, j)->kind == kind; ++j);
+
+        if(j > i + 1) {
+            g_string_truncate(merged, 0);
+            for(guint k = i; k < j; ++k) {
+                if(k > i) g_string_append(merged, NL);
+                g_string_append(merged, extract(blocks_at(blocks, k)));
+                if(k > i) blocks_set(blocks, k, "", 0, false);
+            }
+            if(kind == Narrative) blocks_at(blocks, i)->Narrative.pair = 0;
+            blocks_set(blocks, i, merged->str, merged->len, merged->len >= BLOCK_INLINE_SIZE);
+            if(merged->len >= BLOCK_INLINE_SIZE) {
+                g_string_free(merged, false);
+                merged = g_string_sized_new(256);
+            }
+        }
+        blocks_move(blocks, to++, i);
+    }
+    blocks->len = to;
+    g_string_free(merged, true);
+    return blocks;
+}
+
+/**
+This really should be in glib ...
+**/
+
+inline static
+gint g_asprintf_z(gchar** string, gchar const *format, ...) {
+	va_list argp;
+	va_start(argp, format);
+	gint bytes = g_vasprintf(string, format, argp);
+	va_end(argp);
+    return bytes;
+}
+
+static
+char* indent(int n, char* s) {
+    g_assert(s);
+
+    char* ind       = g_strnfill(n, ' ');
+    char* tmp;
+    g_asprintf(&tmp, "%s%s", ind, s);
+
+    char* withNl;
+    g_asprintf(&withNl, "\n%s", ind);
+
+    return g_strjoinv(withNl, g_strsplit(tmp, NL, -1));
+}
+
+/**
+HTML output
+===========
+
+The usual pipeline writes markdown and then starts pandoc to parse it again into HTML. For thousands of files, starting
+pandoc and re-parsing is most of the time, so clite can write HTML5 itself. It is just another way to tag the blocks:
+code is escaped and put in the same `pre` and `code` elements with the `sourceCode` classes that pandoc uses, so
+style.css still applies. Narrative is markdown, rendered as described below.
+
+A pandoc title block (the `%` lines at the start of this file) becomes the header of the page and its title.
+The document starts and ends with the rest of the page, which links style.css or has it inline.
+
+Every byte of code has to be checked for the four chars that HTML wants escaped, and code is most of the output.
+Going a char at the time, as `html_escape_scalar` does, is slow, so `html_escape` looks at 32 bytes at the time
+with SSE2 (or AVX2, if the compiler may use it). Comparing `c | 2` with `>` finds both `<` and `>`, and comparing `c | 4`
+with `&` finds both `&` and `"`, so two comparisons are enough. Each special char found costs a `ctz` on the mask,
+and the clean bytes between them are copied in bulk. The tests keep a scalar version as the reference the other is
+tested and measured against (`clite -t -m perf` in the source directory, on pre.c).
+**/
+
+static inline
+const char* html_entity(char c) {
+    return  c == '&'    ? "&amp;"   :
+            c == '<'    ? "&lt;"    :
+            c == '>'    ? "&gt;"    :
+            c == '"'    ? "&quot;"  :
+                          NULL;
+}
+
+#if !defined(__AVX2__) && defined(__SSE2__)
+static inline
+guint32 html_special_mask16(__m128i v) {
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(_mm_or_si128(v, _mm_set1_epi8(2)), _mm_set1_epi8('>')),
+                             _mm_cmpeq_epi8(_mm_or_si128(v, _mm_set1_epi8(4)), _mm_set1_epi8('&')));
+    return (guint32) _mm_movemask_epi8(m);
+}
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+// A bit set for each special char in the 32 bytes at p
+static inline
+guint32 html_special_mask(const char* p) {
+#ifdef __AVX2__
+    __m256i v = _mm256_loadu_si256((const __m256i*) p);
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_or_si256(v, _mm256_set1_epi8(2)), _mm256_set1_epi8('>')),
+                                _mm256_cmpeq_epi8(_mm256_or_si256(v, _mm256_set1_epi8(4)), _mm256_set1_epi8('&')));
+    return (guint32) _mm256_movemask_epi8(m);
+#else
+    return  html_special_mask16(_mm_loadu_si128((const __m128i*) p)) |
+            html_special_mask16(_mm_loadu_si128((const __m128i*) (p + 16))) << 16;
+#endif
+}
+#endif
+
+static
+GString* html_escape(GString* out, const char* s, gsize len) {
+    const char* end = s + len;
+    const char* run = s;
+
+    void escape(const char* p) {
+        g_string_append_len(out, run, p - run);
+        g_string_append(out, html_entity(*p));
+        run = p + 1;
+    }
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    for(; s + 32 <= end; s += 32)
+        for(guint32 mask = html_special_mask(s); mask; mask &= mask - 1) escape(s + __builtin_ctz(mask));
+#endif
+    for(; s < end; ++s) if(html_entity(*s)) escape(s);
+
+    return g_string_append_len(out, run, end - run);
+}
+
+static
+GString* html_escape_z(GString* out, const char* s) { return html_escape(out, s, strlen(s)); }
+
+/**
+Syntax highlighting
+===================
+
+pandoc highlights the code, which is slow for big files and needs pandoc to be there, so the HTML output does it
+too. The languages are described by their entries in `s_lang_params_table`: their keywords and types, and if lines
+starting with `#` are for the preprocessor. Their comments are the doc comments with a char less. The tokens are put in spans with the same classes that pandoc uses, so the same CSS works.
+
+When the options are created, the description becomes a `Highlighter`: a class for each byte, which drives a small
+state machine, and a hash table of the words, where a word is found by its first and last char and its length. The
+bytes that aren't in a token are escaped in bulk.
+**/
+
+#define HIGHLIGHT_SLOTS 512
+
+enum { ClsOther, ClsSpace, ClsNewline, ClsIdent, ClsDigit, ClsString, ClsChar, ClsComment, ClsHash };
+enum { WordNone, WordKeyword, WordType };
+
+typedef struct Highlighter {
+    char        line_comment[10];
+    char        block_open[10];
+    char        block_close[10];
+    guint8      cls[256];
+    struct { const char* word; guint8 len; guint8 kind; } slots[HIGHLIGHT_SLOTS];
+} Highlighter;
+
+static inline
+guint word_hash(const char* w, gsize len) {
+    return ((guchar) w[0] * 31u + (guchar) w[len - 1] * 7u + len) % HIGHLIGHT_SLOTS;
+}
+
+static
+Highlighter* highlighter_new(LangSymbols* syntax) {
+    if(!syntax) return NULL;
+
+    Highlighter* h  = g_new0(Highlighter, 1);
+    g_strlcpy(h->line_comment, syntax->line, strlen(syntax->line));
+    g_strlcpy(h->block_open, syntax->start, strlen(syntax->start));
+    g_strlcpy(h->block_close, syntax->end + 1, sizeof(h->block_close));
+
+    for(int c = 0; c < 256; ++c)
+        h->cls[c] = g_ascii_isalpha(c) || c == '_'  ? ClsIdent     :
+                    g_ascii_isdigit(c)              ? ClsDigit     :
+                    c == '\n'                       ? ClsNewline   :
+                    c == ' ' || c == '\t' || c == '\r'? ClsSpace     :
+                    c == '"'                        ? ClsString    :
+                    c == '\''                       ? ClsChar      :
+                                                      ClsOther;
+    h->cls[(guchar) h->line_comment[0]]         = ClsComment;
+    h->cls[(guchar) h->block_open[0]]           = ClsComment;
+    if(syntax->preprocessor) h->cls['#']        = ClsHash;
+
+    void add_words(const char* words, guint8 kind) {
+        for(const char* w = words; *w; ) {
+            gsize len   = strcspn(w, " ");
+            guint i     = word_hash(w, len);
+            while(h->slots[i].word) i = (i + 1) % HIGHLIGHT_SLOTS;
+            h->slots[i].word = w, h->slots[i].len = len, h->slots[i].kind = kind;
+            w += len + (w[len] == ' ');
+        }
+    }
+    add_words(syntax->keywords, WordKeyword);
+    add_words(syntax->types, WordType);
+    return h;
+}
+
+static inline
+int word_kind(Highlighter* h, const char* w, gsize len) {
+    if(len > 255) return WordNone;
+    for(guint i = word_hash(w, len); h->slots[i].word; i = (i + 1) % HIGHLIGHT_SLOTS)
+        if(h->slots[i].len == len && !memcmp(h->slots[i].word, w, len)) return h->slots[i].kind;
+    return WordNone;
+}
+
+static
+GString* highlight(Highlighter* h, GString* out, const char* code, gsize len) {
+    const char* end     = code + len;
+    const char* run     = code;
+    const char* p       = code;
+    bool line_start     = true;
+
+    #define is_ident(c) ((guint8) (h->cls[(guchar) (c)] - ClsIdent) <= ClsDigit - ClsIdent)
+    bool at(const char* s)  { return (gsize) (end - p) >= strlen(s) && !memcmp(p, s, strlen(s)); }
+    const char* line_end()  { const char* nl = memchr(p, '\n', end - p); return nl ? nl : end; }
+
+    // All the classes have two chars. Words and numbers have nothing to escape.
+    void span_as(const char* cls, const char* to, bool escape) {
+        char tag[] = "<span class=\"..\">";
+        tag[13] = cls[0], tag[14] = cls[1];
+
+        if(p > run) html_escape(out, run, p - run);
+        g_string_append_len(out, tag, sizeof(tag) - 1);
+        if(escape)  html_escape(out, p, to - p);
+        else        g_string_append_len(out, p, to - p);
+        g_string_append_len(out, "</span>", 7);
+        p = run = to;
+        line_start = false;
+    }
+    void span(const char* cls, const char* to) { span_as(cls, to, true); }
+    const char* quoted(char quote, const char* limit) {
+        const char* q = p + 1;
+        while(q < limit && *q != quote) q += *q == '\\' && q + 1 < limit ? 2 : 1;
+        return q < limit ? q + 1 : NULL;
+    }
+
+    while(p < end)
+        switch(h->cls[(guchar) *p]) {
+            case ClsIdent: {
+                const char* q = p + 1;
+                while(q < end && is_ident(*q)) ++q;
+                int kind = word_kind(h, p, q - p);
+                if(kind)    span_as(kind == WordKeyword ? "kw" : "dt", q, false);
+                else        p = q, line_start = false;
+                break;
+            }
+            case ClsDigit: {
+                const char* q   = p + 1;
+                bool fl         = false;
+                bool hex        = *p == '0' && q < end && (*q == 'x' || *q == 'X');
+                while(q < end && (is_ident(*q) || *q == '.' ||
+                                  ((*q == '+' || *q == '-') && !hex && (q[-1] == 'e' || q[-1] == 'E')))) {
+                    fl = fl || *q == '.' || (!hex && (*q == 'e' || *q == 'E'));
+                    ++q;
+                }
+                span_as(fl ? "fl" : "dv", q, false);
+                break;
+            }
+            case ClsString: {
+                const char* q = quoted('"', end);
+                span("st", q ? q : end);
+                break;
+            }
+            case ClsChar: {
+                const char* q = quoted('\'', MIN(end, p + 8));
+                if(q && !memchr(p, '\n', q - p))   span("ch", q);
+                else                                ++p, line_start = false;
+                break;
+            }
+            case ClsComment: {
+                const char* close = NULL;
+                if(at(h->line_comment))     span("co", line_end());
+                else if(at(h->block_open)) {
+                    close = g_strstr_len(p + strlen(h->block_open), end - p - strlen(h->block_open), h->block_close);
+                    span("co", close ? close + strlen(h->block_close) : end);
+                } else
+                    ++p, line_start = false;
+                break;
+            }
+            case ClsHash: {
+                if(!line_start) { ++p; break; }
+                const char* q = line_end();
+                while(q < end && q > p && q[-1] == '\\') {
+                    const char* nl = memchr(q + 1, '\n', end - q - 1);
+                    q = nl ? nl : end;
+                }
+                span("ot", q);
+                break;
+            }
+            case ClsNewline:    line_start = true;  ++p; break;
+            case ClsSpace:
+                for(++p; p < end && h->cls[(guchar) *p] == ClsSpace; ++p);
+                break;
+            default:
+                line_start = false;
+                for(++p; p < end && h->cls[(guchar) *p] <= ClsSpace; ++p);
+                break;
+        }
+
+    #undef is_ident
+    return html_escape(out, run, end - run);
+}
+
+// The colors of the pygments style of pandoc
+static
+const char* s_highlight_css =
+    "code > span.kw { color: #007020; font-weight: bold; }\n"
+    "code > span.dt { color: #902000; }\n"
+    "code > span.dv { color: #40a070; }\n"
+    "code > span.fl { color: #40a070; }\n"
+    "code > span.ch { color: #4070a0; }\n"
+    "code > span.st { color: #4070a0; }\n"
+    "code > span.co { color: #60a0b0; font-style: italic; }\n"
+    "code > span.ot { color: #007020; }\n";
+
+/**
+Rendering the narrative
+=======================
+
+Splitting the narrative in paragraphs isn't enough for the headings, lists and links that it has, as in this file.
+`render_markdown` renders the part of CommonMark that literate programs use: ATX (`#`) and setext (underlined)
+headings, bullet and ordered lists, fenced code, rules and paragraphs. Each line is classified by its first chars and
+the lines are never looked at again, apart from the paragraph that a setext underline turns into a heading. As pandoc
+does, headings get an id made from their text, so the links to them still work.
+
+Inside a paragraph most bytes are just text. `inline_special_mask` finds the few chars that can start some markup
+(`` ` ``, `*`, `_`, `[`, `!`, `<` and `\`) in 16 bytes at the time, and the text between them is escaped in bulk.
+Emphasis, code and links are matched by looking forward for what closes them; when nothing does, the char is just
+text and the scan goes on after it, so it never goes back. A `_` inside a word, as in `g_queue_map`, isn't emphasis.
+**/
+
+static inline
+bool is_inline_special(char c) { return c && strchr("`*_[!<\\", c); }
+
+#ifdef __SSE2__
+// A bit set for each char in the 16 bytes at p that can start inline markup
+static inline
+guint32 inline_special_mask(const char* p) {
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    #define eq(c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_or_si128(eq('`'), eq('*')), _mm_or_si128(eq('_'), eq('['))),
+                             _mm_or_si128(_mm_or_si128(eq('!'), eq('<')), eq('\\')));
+    #undef eq
+    return (guint32) _mm_movemask_epi8(m);
+}
+#endif
+
+static
+const char* next_inline_special(const char* p, const char* end) {
+#ifdef __SSE2__
+    for(; p + 16 <= end; p += 16) {
+        guint32 mask = inline_special_mask(p);
+        if(mask) return p + __builtin_ctz(mask);
+    }
+#endif
+    while(p < end && !is_inline_special(*p)) ++p;
+    return p;
+}
+
+static inline
+int run_length(const char* p, const char* end) {
+    const char* q = p;
+    while(q < end && *q == *p) ++q;
+    return q - p;
+}
+
+// The first run of exactly n c in [p, end) that can close a code span (or emphasis, when it has to be flanking)
+static
+const char* find_run(const char* p, const char* end, char c, int n, bool flanking) {
+    for(const char* q = p; q < end && (q = memchr(q, c, end - q)); ) {
+        int len         = run_length(q, end);
+        bool closes     = !flanking || (q > p && !g_ascii_isspace(q[-1]) &&
+                                        (c != '_' || q + len == end || !g_ascii_isalnum(q[len])));
+        if(len == n && closes) return q;
+        q += len;
+    }
+    return NULL;
+}
+
+// The close that matches the open at p, skipping nested pairs and escaped chars
+static
+const char* find_matching(const char* p, const char* end, char open, char close) {
+    int depth = 0;
+    for(; p < end; ++p)
+        if(*p == '\\' && p + 1 < end)           ++p;
+        else if(*p == open)                     ++depth;
+        else if(*p == close && --depth == 0)    return p;
+    return NULL;
+}
+
+/**
+The renderer doesn't write HTML itself, it tells a `MarkupFunc` what it finds, so that the same parsing can
+write other formats too. The function gets the kind of markup, if it is the opening or the closing of it, and a number
+and a string that depend on the kind: the level and the id of a heading, the url of a link, the text to write.
+**/
+
+typedef enum Markup {
+    MkText, MkCode, MkEmph, MkStrong, MkLink, MkImage, MkAutolink,
+    MkPara, MkHeader, MkBulletList, MkOrderedList, MkItem, MkCodeBlock, MkCodeLine, MkRule
+} Markup;
+
+typedef GString* (*MarkupFunc)(GString* out, Markup m, bool close, int n, const char* s, gsize len);
+
+static
+GString* html_markup(GString* out, Markup m, bool close, int n, const char* s, gsize len) {
+    const char* tags[][2] = {
+        [MkEmph]        = {"<em>",      "</em>"},
+        [MkStrong]      = {"<strong>",  "</strong>"},
+        [MkBulletList]  = {"<ul>\n",    "</ul>\n"},
+        [MkItem]        = {"<li>",      "</li>\n"},
+    };
+
+    switch(m) {
+        case MkText:        return html_escape(out, s, len);
+        case MkCode:        return g_string_append(html_escape(g_string_append(out, "<code>"), s, len), "</code>");
+        case MkEmph:
+        case MkStrong:
+        case MkBulletList:
+        case MkItem:        return g_string_append(out, tags[m][close]);
+        case MkLink:        return close ? g_string_append(out, "</a>")
+                                         : g_string_append(html_escape(g_string_append(out, "<a href=\""), s, len), "\">");
+        case MkImage:       return close ? g_string_append(out, "\" />")
+                                         : g_string_append(html_escape(g_string_append(out, "<img src=\""), s, len), "\" alt=\"");
+        case MkAutolink:
+            g_string_append(out, n ? "<a href=\"mailto:" : "<a href=\"");
+            html_escape(out, s, len);
+            g_string_append(out, "\">");
+            return g_string_append(html_escape(out, s, len), "</a>");
+        // n is set for the paragraphs of list items, which are written without tags
+        case MkPara:        return n ? out : g_string_append(out, close ? "</p>\n" : "<p>");
+        case MkHeader:
+            if(close)       g_string_append_printf(out, "</h%i>\n", n);
+            else            g_string_append_printf(out, "<h%i id=\"%.*s\">", n, (int) len, s);
+            return out;
+        case MkOrderedList:
+            if(close)       g_string_append(out, "</ol>\n");
+            else if(n != 1) g_string_append_printf(out, "<ol start=\"%i\">\n", n);
+            else            g_string_append(out, "<ol>\n");
+            return out;
+        case MkCodeBlock:
+            if(close)       return g_string_append(out, "</code></pre>\n");
+            if(!len)        return g_string_append(out, "<pre><code>");
+            return g_string_append(html_escape(g_string_append(out, "<pre class=\""), s, len), "\"><code>");
+        case MkCodeLine:    return g_string_append_c(html_escape(out, s, len), '\n');
+        case MkRule:        return g_string_append(out, "<hr />\n");
+    }
+    return out;
+}
+
+static
+GString* render_inline(GString* out, MarkupFunc markup, const char* p, const char* end) {
+    const char* start   = p;
+    const char* run     = p;
+
+    // Writes the text up to q and goes on at next
+    void text_to(const char* q, const char* next) {
+        if(q > run) markup(out, MkText, false, 0, run, q - run);
+        run = p = next;
+    }
+
+    while((p = next_inline_special(p, end)) < end) {
+        const char* q   = p;
+        int n           = run_length(q, end);
+        switch(*q) {
+            case '\\':
+                if(q + 1 < end && g_ascii_ispunct(q[1]))    { text_to(q, q + 1); ++p; }
+                else                                        ++p;
+                break;
+            case '`': {
+                const char* c = find_run(q + n, end, '`', n, false);
+                if(!c) { p += n; break; }
+                const char* s = q + n;
+                const char* e = c;
+                if(e - s > 1 && *s == ' ' && e[-1] == ' ') { ++s; --e; }
+                text_to(q, c + n);
+                markup(out, MkCode, false, 0, s, e - s);
+                break;
+            }
+            case '*':
+            case '_': {
+                bool opens      = n <= 3 && q + n < end && !g_ascii_isspace(q[n]) &&
+                                  (*q == '*' || q == start || !g_ascii_isalnum(q[-1]));
+                const char* c   = opens ? find_run(q + n, end, *q, n, true) : NULL;
+                if(!c) { p += n; break; }
+                text_to(q, c + n);
+                if(n > 1)   markup(out, MkStrong, false, 0, NULL, 0);
+                if(n != 2)  markup(out, MkEmph, false, 0, NULL, 0);
+                render_inline(out, markup, q + n, c);
+                if(n != 2)  markup(out, MkEmph, true, 0, NULL, 0);
+                if(n > 1)   markup(out, MkStrong, true, 0, NULL, 0);
+                break;
+            }
+            case '!':
+            case '[': {
+                Markup kind     = *q == '!' ? MkImage : MkLink;
+                const char* b   = q + (kind == MkImage);
+                const char* c   = b < end && *b == '[' ? find_matching(b, end, '[', ']') : NULL;
+                const char* e   = c && c + 1 < end && c[1] == '(' ? find_matching(c + 1, end, '(', ')') : NULL;
+                if(!e) { ++p; break; }
+
+                // The destination, without the title and the angle brackets
+                const char* u   = c + 2;
+                while(u < e && *u == ' ') ++u;
+                const char* ue  = u;
+                while(ue < e && *ue != ' ') ++ue;
+                if(ue - u > 1 && *u == '<' && ue[-1] == '>') { ++u; --ue; }
+
+                text_to(q, e + 1);
+                markup(out, kind, false, 0, u, ue - u);
+                if(kind == MkImage) markup(out, MkText, false, 0, b + 1, c - b - 1);
+                else                render_inline(out, markup, b + 1, c);
+                markup(out, kind, true, 0, u, ue - u);
+                break;
+            }
+            case '<': {
+                const char* c   = memchr(q, '>', end - q);
+                bool link       = c && !memchr(q, ' ', c - q) && (memchr(q, ':', c - q) || memchr(q, '@', c - q));
+                if(!link) { ++p; break; }
+                text_to(q, c + 1);
+                markup(out, MkAutolink, false, !memchr(q, ':', c - q), q + 1, c - q - 1);
+                break;
+            }
+        }
+    }
+    text_to(end, end);
+    return out;
+}
+
+// The id pandoc gives to a heading: lowercase alphanumerics, '_', '-' and '.', with spaces as '-', from the first letter
+static
+char* heading_id(const char* s, gsize len) {
+    GString* id = g_string_sized_new(len);
+    for(const char* end = s + len; s < end; ++s) {
+        guchar c = *s;
+        if(!id->len && !g_ascii_isalpha(c) && c < 0x80)         continue;
+        if(g_ascii_isalnum(c) || c >= 0x80 || strchr("_-.", c)) g_string_append_c(id, g_ascii_tolower(c));
+        else if(g_ascii_isspace(c))                             g_string_append_c(id, '-');
+    }
+    if(!id->len) g_string_append(id, "section");
+    return g_string_free(id, false);
+}
+
+// The level of the ATX heading on the line, or 0
+static
+int atx_level(const char* s, const char* e) {
+    int n = run_length(s, e);
+    return *s == '#' && n <= 6 && (s + n == e || s[n] == ' ' || s[n] == '\t') ? n : 0;
+}
+
+// The length of the ``` or ~~~ that opens a fenced code block on the line, or 0
+static
+int fence_length(const char* s, const char* e) {
+    int n = run_length(s, e);
+    return (*s == '`' || *s == '~') && n >= 3 && (*s == '~' || !memchr(s + n, '`', e - s - n)) ? n : 0;
+}
+
+// 1 for a line of '=', 2 for a line of '-', or 0
+static
+int setext_level(const char* s, const char* e) {
+    return (*s == '=' || *s == '-') && run_length(s, e) == e - s ? (*s == '=' ? 1 : 2) : 0;
+}
+
+static
+bool is_rule(const char* s, const char* e) {
+    int n = 0;
+    if(!strchr("-*_", *s)) return false;
+    for(const char* p = s; p < e; ++p)
+        if(*p == *s)                        ++n;
+        else if(*p != ' ' && *p != '\t')    return false;
+    return n >= 3;
+}
+
+// 'u' or 'o' if the line starts a list item, with the item's text in *text and its number in *number
+static
+char list_marker(const char* s, const char* e, const char** text, int* number) {
+    const char* m = s;
+    while(m < e && g_ascii_isdigit(*m) && m - s < 9) ++m;
+
+    char kind   = m == s && strchr("-*+", *s)           ? (++m, 'u') :
+                  m > s && m < e && strchr(".)", *m)    ? (++m, 'o') :
+                                                          0;
+    if(!kind || (m < e && *m != ' ' && *m != '\t')) return 0;
+
+    *number = kind == 'o' ? atoi(s) : 0;
+    while(m < e && (*m == ' ' || *m == '\t')) ++m;
+    *text   = m;
+    return kind;
+}
+
+/**
+The headings of a document are found by the same function that renders them, which adds them to an array when it
+is given one. Without a `MarkupFunc` it writes nothing and just finds them. The id of a heading depends on the
+headings before it in the whole document, so it is written as if it were the first one with its text, and the
+heading keeps where its id ends in the output, `at`, to add a suffix there later.
+**/
+
+typedef struct Heading { int level; char* id; char* text; gsize at; } Heading;
+
+// The chars an id can have, none of which is written after the id in the opening of a heading
+static inline
+bool is_id_char(char c) { return g_ascii_isalnum(c) || (guchar) c >= 0x80 || strchr("_-.", c); }
+
+static
+GString* render_markdown(GString* out, MarkupFunc writer, const char* text, GArray* headings) {
+    GString* markup(GString* out, Markup m, bool close, int n, const char* s, gsize len) {
+        return writer ? writer(out, m, close, n, s, len) : out;
+    }
+
+    GString* para   = g_string_new("");
+    char list       = 0;
+    bool blank      = false;
+    bool fenced     = false;
+    char* fence     = NULL;
+    int fence_lines = 0;
+
+    void end_paragraph() {
+        if(!para->len) return;
+        if(writer) {
+            markup(out, MkPara, false, list != 0, NULL, 0);
+            render_inline(out, writer, para->str, para->str + para->len - 1);
+            markup(out, MkPara, true, list != 0, NULL, 0);
+        }
+        g_string_truncate(para, 0);
+    }
+    void end_item()     { end_paragraph(); markup(out, MkItem, true, 0, NULL, 0); }
+    void end_list()     {
+        if(!list) return;
+        end_item();
+        markup(out, list == 'u' ? MkBulletList : MkOrderedList, true, 0, NULL, 0);
+        list = 0;
+    }
+    void end_blocks()   { if(list) end_list(); else end_paragraph(); }
+    void heading(int level, const char* s, gsize len) {
+        char* id    = heading_id(s, len);
+        gsize at    = 0;
+        if(writer) {
+            gsize before = out->len;
+            markup(out, MkHeader, false, level, id, strlen(id));
+            for(at = out->len; at > before && !is_id_char(out->str[at - 1]); --at);
+            render_inline(out, writer, s, s + len);
+            markup(out, MkHeader, true, level, id, strlen(id));
+        }
+        if(headings)    g_array_append_val(headings, ((Heading) {level, id, g_strndup(s, len), at}));
+        else            g_free(id);
+    }
+
+    for(const char* l = text; *l; ) {
+        const char* nl      = strchr(l, '\n');
+        const char* e       = nl ? nl : l + strlen(l);
+        const char* next    = nl ? nl + 1 : e;
+        while(e > l && g_ascii_isspace(e[-1])) --e;
+
+        const char* s       = l;
+        int indent          = 0;
+        for(; s < e && (*s == ' ' || *s == '\t'); ++s) indent += *s == '\t' ? 4 - indent % 4 : 1;
+        bool block          = indent < 4 || !para->len;
+        const char* item;
+        int level, number;
+        char kind;
+
+        if(fenced) {
+            if(!strncmp(s, fence, strlen(fence)) && run_length(s, e) == e - s) {
+                markup(out, MkCodeBlock, true, 0, NULL, 0);
+                g_free(fence);
+                fenced = false;
+            } else
+                markup(out, MkCodeLine, false, fence_lines++, l, e - l);
+        }
+        else if(s == e) {
+            if(list)    blank = true;
+            else        end_paragraph();
+        }
+        else if(block && (level = fence_length(s, e))) {
+            end_blocks();
+            fence               = g_strndup(s, level);
+            fenced              = true;
+            fence_lines         = 0;
+            const char* lang    = s + level;
+            while(lang < e && *lang == ' ') ++lang;
+            markup(out, MkCodeBlock, false, 0, lang, e - lang);
+        }
+        else if(block && para->len && !list && (level = setext_level(s, e))) {
+            heading(level, para->str, para->len - 1);
+            g_string_truncate(para, 0);
+        }
+        else if(block && is_rule(s, e)) {
+            end_blocks();
+            markup(out, MkRule, false, 0, NULL, 0);
+        }
+        else if(block && (level = atx_level(s, e))) {
+            end_blocks();
+            const char* h   = s + level;
+            const char* he  = e;
+            while(he > h && he[-1] == '#') --he;
+            if(he < e && he > h && he[-1] != ' ' && he[-1] != '\t') he = e;
+            while(h < he && g_ascii_isspace(*h)) ++h;
+            while(he > h && g_ascii_isspace(he[-1])) --he;
+            heading(level, h, he - h);
+        }
+        else if(block && (kind = list_marker(s, e, &item, &number))) {
+            if(list == kind)    end_item();
+            else {
+                end_blocks();
+                markup(out, kind == 'u' ? MkBulletList : MkOrderedList, false, number, NULL, 0);
+                list = kind;
+            }
+            markup(out, MkItem, false, 0, NULL, 0);
+            g_string_append_c(g_string_append_len(para, item, e - item), '\n');
+        }
+        else {
+            if(list && blank && !indent) end_list();
+            g_string_append_c(g_string_append_len(para, s, e - s), '\n');
+        }
+        if(s != e) blank = false;
+        l = next;
+    }
+    end_blocks();
+    if(fenced) {
+        markup(out, MkCodeBlock, true, 0, NULL, 0);
+        g_free(fence);
+    }
+    g_string_free(para, true);
+    return out;
+}
+
+// Returns the lines of the title block, if the narrative starts with one
+static
+char** title_block(const char* narrative) {
+    narrative += strspn(narrative, " \t\r\n");
+    if(*narrative != '%') return NULL;
+
+    GPtrArray* lines = g_ptr_array_new();
+    while(*narrative == '%') {
+        const char* nl = strchr(narrative, '\n');
+        gsize len      = nl ? (gsize) (nl - narrative) : strlen(narrative);
+        g_ptr_array_add(lines, g_strstrip(g_strndup(narrative + 1, len)));
+        narrative     += nl ? len + 1 : len;
+    }
+    g_ptr_array_add(lines, NULL);
+    return (char**) g_ptr_array_free(lines, false);
+}
+
+// The narrative after the title block
+static
+const char* after_title_block(const char* narrative) {
+    const char* p = narrative + strspn(narrative, " \t\r\n");
+    if(*p != '%') return narrative;
+    while(*p == '%') p = strchr(p, '\n') ? strchr(p, '\n') + 1 : "";
+    return p;
+}
+
+static
+char* html_narrative(const char* narrative, GArray* headings) {
+    GString* res    = g_string_sized_new(strlen(narrative) + 64);
+    char** title    = title_block(narrative);
+
+    if(title) {
+        char* tags[]    = {"h1 class=\"title\"", "h2 class=\"author\"", "h3 class=\"date\""};
+        g_string_append(res, "<header>\n");
+        for(int i = 0; i < 3 && title[i]; ++i) {
+            g_string_append_printf(res, "<%s>", tags[i]);
+            html_escape_z(res, title[i]);
+            g_string_append_printf(res, "</%.2s>\n", tags[i]);
+        }
+        g_string_append(res, "</header>\n");
+
+        g_strfreev(title);
+    }
+
+    return g_string_free(render_markdown(res, html_markup, after_title_block(narrative), headings), false);
+}
+
+static
+char* html_code(Options* options, const char* code) {
+    const char* lang    = options->code_symbols->Html.language;
+    GString* res        = g_string_sized_new(strlen(code) + 128);
+
+    g_string_append_printf(res, "<pre class=\"sourceCode %s\"><code class=\"sourceCode %s\">", lang, lang);
+    if(options->code_symbols->Html.highlighter)
+        highlight(options->code_symbols->Html.highlighter, res, code, strlen(code));
+    else
+        html_escape_z(res, code);
+    g_string_append(res, "</code></pre>\n");
+    return g_string_free(res, false);
+}
+
+/**
+Pandoc JSON output
+==================
+
+A PDF still needs pandoc, but pandoc doesn't need to parse markdown again to find where the code is. With `-J` clite
+writes the AST that pandoc reads with `-f json`: code blocks become `CodeBlock` nodes with the language as their class,
+and the narrative goes through the same renderer as the HTML output, with `json_markup` writing the nodes, so that the
+LaTeX writer (which skips raw markdown) still gets it. The title block becomes the metadata of the document.
+
+Each node is written followed by a comma, and a list drops the comma after its last node when it is closed, so that
+nothing has to know which node is the first or the last one. The blocks are tagged one at the time, in parallel or
+while streaming, so the list of the blocks of the document is ended by an empty `RawBlock`, which the writers skip.
+Strings are escaped 16 bytes at the time, as code is most of the output.
+
+pandoc refuses an AST with a different major API version, `PANDOC_API_VERSION` is the one of pandoc 3.
+**/
+
+#define PANDOC_API_VERSION "[1,23,1]"
+
+static inline
+bool is_json_special(char c) { return c == '"' || c == '\\' || (guchar) c < 0x20; }
+
+static
+GString* json_escape_char(GString* out, char c) {
+    switch(c) {
+        case '"':   return g_string_append(out, "\\\"");
+        case '\\':  return g_string_append(out, "\\\\");
+        case '\n':  return g_string_append(out, "\\n");
+        case '\r':  return g_string_append(out, "\\r");
+        case '\t':  return g_string_append(out, "\\t");
+        default:    g_string_append_printf(out, "\\u%04x", (guchar) c); return out;
+    }
+}
+
+#ifdef __SSE2__
+// A bit set for each '"', '\' and control char in the 16 bytes at p
+static inline
+guint32 json_special_mask(const char* p) {
+    __m128i v       = _mm_loadu_si128((const __m128i*) p);
+    __m128i control = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x1F)), _mm_set1_epi8(0x1F));
+    __m128i m       = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                                _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))), control);
+    return (guint32) _mm_movemask_epi8(m);
+}
+#endif
+
+static
+GString* json_escape(GString* out, const char* s, gsize len) {
+    const char* end = s + len;
+    const char* run = s;
+
+    void escape(const char* p) {
+        g_string_append_len(out, run, p - run);
+        json_escape_char(out, *p);
+        run = p + 1;
+    }
+
+#ifdef __SSE2__
+    for(; s + 16 <= end; s += 16)
+        for(guint32 mask = json_special_mask(s); mask; mask &= mask - 1) escape(s + __builtin_ctz(mask));
+#endif
+    for(; s < end; ++s) if(is_json_special(*s)) escape(s);
+
+    return g_string_append_len(out, run, end - run);
+}
+
+static
+GString* json_string(GString* out, const char* s, gsize len) {
+    return g_string_append_c(json_escape(g_string_append_c(out, '"'), s, len), '"');
+}
+
+// Closes a list dropping the comma after its last node, then closes the node that has the list
+static
+GString* json_close(GString* out, const char* close) {
+    if(out->len && out->str[out->len - 1] == ',') g_string_truncate(out, out->len - 1);
+    return g_string_append_c(g_string_append(out, close), ',');
+}
+
+// Words are Str nodes, and the spaces between them Space, or SoftBreak when there is a new line
+static
+GString* json_inlines(GString* out, const char* s, gsize len) {
+    for(const char* end = s + len, *e; s < end; s = e) {
+        bool space  = g_ascii_isspace(*s);
+        bool nl     = false;
+        for(e = s; e < end && g_ascii_isspace(*e) == space; ++e) nl |= *e == '\n';
+
+        if(space)   g_string_append(out, nl ? "{\"t\":\"SoftBreak\"}," : "{\"t\":\"Space\"},");
+        else        g_string_append(json_string(g_string_append(out, "{\"t\":\"Str\",\"c\":"), s, e - s), "},");
+    }
+    return out;
+}
+
+static
+GString* json_markup(GString* out, Markup m, bool close, int n, const char* s, gsize len) {
+    const char* nodes[][2] = {
+        [MkEmph]        = {"{\"t\":\"Emph\",\"c\":[",         "]}"},
+        [MkStrong]      = {"{\"t\":\"Strong\",\"c\":[",       "]}"},
+        [MkBulletList]  = {"{\"t\":\"BulletList\",\"c\":[",   "]}"},
+        [MkItem]        = {"[",                               "]"},
+    };
+
+    switch(m) {
+        case MkText:        return json_inlines(out, s, len);
+        case MkCode:
+            g_string_append(out, "{\"t\":\"Code\",\"c\":[[\"\",[],[]],");
+            return g_string_append(json_string(out, s, len), "]},");
+        case MkEmph:
+        case MkStrong:
+        case MkBulletList:
+        case MkItem:        return close ? json_close(out, nodes[m][1]) : g_string_append(out, nodes[m][0]);
+        case MkLink:
+        case MkImage:
+            if(!close) return g_string_append(out, m == MkLink ? "{\"t\":\"Link\",\"c\":[[\"\",[],[]],["
+                                                               : "{\"t\":\"Image\",\"c\":[[\"\",[],[]],[");
+            json_close(out, "]");
+            return g_string_append(json_string(g_string_append_c(out, '['), s, len), ",\"\"]]},");
+        case MkAutolink:
+            g_string_append_printf(out, "{\"t\":\"Link\",\"c\":[[\"\",[\"%s\"],[]],", n ? "email" : "uri");
+            json_close(json_inlines(g_string_append_c(out, '['), s, len), "]");
+            g_string_append(out, n ? "[\"mailto:" : "[\"");
+            return g_string_append(json_escape(out, s, len), "\",\"\"]]},");
+        // n is set for the paragraphs of list items, which are Plain as in the tight lists of pandoc
+        case MkPara:        return close ? json_close(out, "]}")
+                                         : g_string_append(out, n ? "{\"t\":\"Plain\",\"c\":[" : "{\"t\":\"Para\",\"c\":[");
+        case MkHeader:
+            if(close) return json_close(out, "]]}");
+            g_string_append_printf(out, "{\"t\":\"Header\",\"c\":[%i,[", n);
+            return g_string_append(json_string(out, s, len), ",[],[]],[");
+        case MkOrderedList:
+            if(close) return json_close(out, "]]}");
+            g_string_append_printf(out, "{\"t\":\"OrderedList\",\"c\":[[%i,{\"t\":\"Decimal\"},{\"t\":\"Period\"}],[", n);
+            return out;
+        case MkCodeBlock:
+            if(close) return g_string_append(out, "\"]},");
+            g_string_append(out, "{\"t\":\"CodeBlock\",\"c\":[[\"\",[");
+            if(len) json_string(out, s, len);
+            return g_string_append(out, "],[]],\"");
+        // n is the number of the line in the block
+        case MkCodeLine:    return json_escape(n ? g_string_append(out, "\\n") : out, s, len);
+        case MkRule:        return g_string_append(out, "{\"t\":\"HorizontalRule\"},");
+    }
+    return out;
+}
+
+static
+char* json_narrative(const char* narrative, GArray* headings) {
+    GString* res = render_markdown(g_string_sized_new(strlen(narrative) * 2 + 64), json_markup,
+                                   after_title_block(narrative), headings);
+    if(res->len) g_string_append_c(res, '\n');
+    return g_string_free(res, false);
+}
+
+static
+char* json_code(Options* options, const char* code) {
+    const char* lang    = options->code_symbols->Json.language;
+    GString* res        = g_string_sized_new(strlen(code) + 64);
+
+    g_string_append(res, "{\"t\":\"CodeBlock\",\"c\":[[\"\",[");
+    if(*lang) json_string(res, lang, strlen(lang));
+    g_string_append(res, "],[]],");
+    json_string(res, code, strlen(code));
+    return g_string_free(g_string_append(res, "]},\n"), false);
+}
+
+static
+char* json_document_start(Block* first) {
+    char** title    = first && first->kind == Narrative ? title_block(first->Narrative.narrative) : NULL;
+    GString* res    = g_string_new("{\"pandoc-api-version\":" PANDOC_API_VERSION ",\"meta\":{");
+
+    const char* keys[] = {"title", "author", "date"};
+    for(int i = 0; i < 3 && title && title[i]; ++i) {
+        if(!*title[i]) continue;
+        g_string_append_printf(res, "\"%s\":", keys[i]);
+        if(i == 1) g_string_append(res, "{\"t\":\"MetaList\",\"c\":[");
+        g_string_append(res, "{\"t\":\"MetaInlines\",\"c\":[");
+        json_close(json_inlines(res, title[i], strlen(title[i])), "]}");
+        if(i == 1) json_close(res, "]}");
+    }
+    g_strfreev(title);
+
+    return g_string_free(g_string_append(json_close(res, "}"), "\"blocks\":[\n"), false);
+}
+
+static
+char* document_start(Options* options, Block* first) {
+    if(options->code_symbols->kind == Json) return json_document_start(first);
+    if(options->code_symbols->kind != Html) return g_strdup("");
+
+    char** title    = first && first->kind == Narrative ? title_block(first->Narrative.narrative) : NULL;
+    GString* res    = g_string_new("<!DOCTYPE html>\n<html>\n<head>\n"
+                                   "  <meta charset=\"utf-8\">\n"
+                                   "  <meta name=\"generator\" content=\"clite\">\n");
+    if(title && title[0] && title[1]) {
+        g_string_append(res, "  <meta name=\"author\" content=\"");
+        html_escape_z(res, title[1]);
+        g_string_append(res, "\">\n");
+    }
+    g_string_append(res, "  <title>");
+    if(title && title[0]) html_escape_z(res, title[0]);
+    g_string_append(res, "</title>\n");
+    g_strfreev(title);
+
+    if(options->code_symbols->Html.highlighter)
+        g_string_append_printf(res, "  <style type=\"text/css\">\n%s  </style>\n", s_highlight_css);
+
+    char* href = options->code_symbols->Html.css_href;
+    char* css  = options->code_symbols->Html.css_text;
+    if(css)         g_string_append_printf(res, "  <style type=\"text/css\">\n%s\n  </style>\n", css);
+    else if(href) {
+        g_string_append(res, "  <link rel=\"stylesheet\" href=\"");
+        html_escape_z(res, href);
+        g_string_append(res, "\">\n");
+    }
+    g_string_append(res, "</head>\n<body>\n");
+    return g_string_free(res, false);
+}
+
+static
+char* document_end(Options* options) {
+    return g_strdup(options->code_symbols->kind == Html ? "</body>\n</html>\n"                          :
+                    options->code_symbols->kind == Json ? "{\"t\":\"RawBlock\",\"c\":[\"markdown\",\"\"]}]}\n" :
+                                                          "");
+}
+
+/**
+Table of contents
+=================
+
+With `--toc` the document starts with a table of contents, after its title, as pandoc does. Each narrative block
+keeps the headings it finds while it is tagged, so the markdown is parsed once. The blocks are tagged all at the same
+time, so a block can't know the headings before it, and each heading gets an id that no heading before it has
+afterwards: pandoc adds `-1`, `-2` and so on to the ids that would repeat, and so does `number_headings`, adding the
+suffix where the id ends in the tagged block. The ids depend only on the text of the headings before, so they stay
+the same when the rest of the document changes.
+
+The table is a list written with the `MarkupFunc` of the output, with the same nesting of the headings.
+For markdown outputs `markdown_markup` writes the markup back as markdown, pandoc then gives the headings the same
+ids. The index of several files (`--index`) is a table of contents too, with the files as the top entries.
+**/
+
+// The headings of the tagged blocks, in order. written tells if the ids are in the text of the blocks.
+static
+GArray* number_headings(Blocks* blocks, bool written) {
+    GArray* headings    = g_array_new(false, false, sizeof(Heading));
+    GHashTable* used    = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for(guint k = 0; k < blocks->len; ++k) {
+        Block* b        = blocks_at(blocks, k);
+        GArray* found   = b->kind == Narrative ? b->Narrative.headings : NULL;
+        if(!found) continue;
+
+        GString* text   = NULL;
+        gsize moved     = 0;
+        for(guint i = 0; i < found->len; ++i) {
+            Heading* h  = &g_array_index(found, Heading, i);
+            char* id    = g_strdup(h->id);
+            int suffix  = 0;
+            while(g_hash_table_contains(used, id)) {
+                g_free(id);
+                id = g_strdup_printf("%s-%i", h->id, ++suffix);
+            }
+            if(suffix && written) {
+                text    = text ? text : g_string_new(extract(b));
+                g_string_insert(text, h->at + moved, id + strlen(h->id));
+                moved  += strlen(id) - strlen(h->id);
+            }
+            g_free(h->id);
+            h->id = id;
+            g_hash_table_insert(used, id, id);
+        }
+        if(text) blocks_set(blocks, k, text->str, text->len, false);
+        if(text) g_string_free(text, true);
+
+        g_array_append_vals(headings, found->data, found->len);
+        g_array_free(found, true);
+        b->Narrative.headings = NULL;
+    }
+    g_hash_table_destroy(used);
+    return headings;
+}
+
+static
+void free_headings(GArray* headings) {
+    for(guint i = 0; headings && i < headings->len; ++i) {
+        g_free(g_array_index(headings, Heading, i).id);
+        g_free(g_array_index(headings, Heading, i).text);
+    }
+    if(headings) g_array_free(headings, true);
+}
+
+// n is the depth of the list for items, and set for the paragraphs of items, the only ones it writes
+static
+GString* markdown_markup(GString* out, Markup m, bool close, int n, const char* s, gsize len) {
+    switch(m) {
+        case MkText:        return g_string_append_len(out, s, len);
+        case MkCode:        return g_string_append_c(g_string_append_len(g_string_append_c(out, '`'), s, len), '`');
+        case MkEmph:        return g_string_append_c(out, '*');
+        case MkStrong:      return g_string_append(out, "**");
+        case MkLink:
+        case MkImage:
+            if(!close) return g_string_append(out, m == MkLink ? "[" : "![");
+            return g_string_append_c(g_string_append_len(g_string_append(out, "]("), s, len), ')');
+        case MkAutolink:    return g_string_append_c(g_string_append_len(g_string_append_c(out, '<'), s, len), '>');
+        case MkItem:
+            if(!close) for(int i = 0; i < n; ++i) g_string_append(out, "    ");
+            return close ? out : g_string_append(out, "- ");
+        case MkPara:        return n && close ? g_string_append_c(out, '\n') : out;
+        default:            return out;
+    }
+}
+
+static
+MarkupFunc options_markup(Options* options) {
+    return  options->code_symbols->kind == Html ? html_markup :
+            options->code_symbols->kind == Json ? json_markup :
+                                                  markdown_markup;
+}
+
+typedef struct TocEntry { int level; const char* text; char* href; } TocEntry;
+
+// A list of links nested as the levels of the entries
+static
+GString* write_toc(GString* out, MarkupFunc markup, TocEntry* entries, guint n) {
+    int levels[8];
+    int depth = 0;
+
+    void close_list() {
+        markup(out, MkItem, true, depth - 1, NULL, 0);
+        markup(out, MkBulletList, true, depth - 1, NULL, 0);
+        --depth;
+    }
+
+    for(guint i = 0; i < n; ++i) {
+        int level = entries[i].level;
+        while(depth && levels[depth - 1] > level) close_list();
+
+        if(depth && levels[depth - 1] == level)
+            markup(out, MkItem, true, depth - 1, NULL, 0);
+        else {
+            markup(out, MkBulletList, false, depth, NULL, 0);
+            levels[depth++] = level;
+        }
+
+        const char* href = entries[i].href;
+        markup(out, MkItem, false, depth - 1, NULL, 0);
+        markup(out, MkPara, false, 1, NULL, 0);
+        markup(out, MkLink, false, 0, href, strlen(href));
+        render_inline(out, markup, entries[i].text, entries[i].text + strlen(entries[i].text));
+        markup(out, MkLink, true, 0, href, strlen(href));
+        markup(out, MkPara, true, 1, NULL, 0);
+    }
+    while(depth) close_list();
+    return out;
+}
+
+// The table of contents as a block of the output, links are prefix#id
+static
+char* toc_block(Options* options, TocEntry* entries, guint n) {
+    GString* res = g_string_new(options->code_symbols->kind == Html ? "<nav id=\"TOC\">\n" : "");
+    write_toc(res, options_markup(options), entries, n);
+    g_string_append(res, options->code_symbols->kind == Html ? "</nav>\n" : "\n");
+    return g_string_free(res, false);
+}
+
+static
+TocEntry* toc_entries(GArray* headings, const char* prefix, TocEntry* entries) {
+    for(guint i = 0; i < headings->len; ++i) {
+        Heading* h  = &g_array_index(headings, Heading, i);
+        entries[i]  = (TocEntry) {.level = h->level, .text = h->text,
+                                  .href = g_strconcat(prefix, "#", h->id, NULL)};
+    }
+    return entries;
+}
+
+// Adds the table of contents after the title, at the start of the output for JSON as the title is in the metadata
+static
+char* add_toc(Options* options, char* body, GArray* headings) {
+    if(!headings->len) return body;
+
+    TocEntry* entries   = toc_entries(headings, "", g_new(TocEntry, headings->len));
+    char* toc           = toc_block(options, entries, headings->len);
+    for(guint i = 0; i < headings->len; ++i) g_free(entries[i].href);
+    g_free(entries);
+
+    CodeSymbols* cs     = options->code_symbols;
+    const char* header  = cs->kind == Html && g_str_has_prefix(body, "<header>") ? strstr(body, "</header>\n") : NULL;
+    gsize title         = cs->kind == Json  ? 0                                             :
+                          cs->kind == Html  ? (header ? (gsize) (header - body) + 10 : 0)   :
+                                              (gsize) (after_title_block(body) - body);
+
+    bool markdown       = cs->kind == Indented || cs->kind == Surrounded;
+    char* res           = g_strdup_printf("%.*s%s%s%s", (int) title, body, title && markdown ? "\n" : "",
+                                          toc, body + title);
+    g_free(toc);
+    return res;
+}
+
+#ifndef CLITE_LIBRARY
+// The names in the absolute path, with . and .. taken away
+static
+char** path_names(const char* path) {
+    char* cwd   = g_get_current_dir();
+    char* full  = g_path_is_absolute(path) ? g_strdup(path) : g_build_filename(cwd, path, NULL);
+    char** res  = g_strsplit(full, G_DIR_SEPARATOR_S, -1);
+    guint n     = 0;
+    for(char** p = res; *p; ++p)
+        if(!strcmp(*p, ".."))               { g_free(*p); if(n) g_free(res[--n]); }
+        else if(!**p || !strcmp(*p, "."))   g_free(*p);
+        else                                res[n++] = *p;
+    res[n]      = NULL;
+
+    g_free(full);
+    g_free(cwd);
+    return res;
+}
+
+// The link to path from the directory dir, going up with .. when path isn't inside it
+static
+char* relative_path(const char* dir, const char* path) {
+    char** from     = path_names(dir);
+    char** to       = path_names(path);
+    guint common    = 0;
+    while(from[common] && to[common] && !strcmp(from[common], to[common])) ++common;
+
+    GString* res    = g_string_new("");
+    for(guint i = common; from[i]; ++i) g_string_append(res, "../");
+    for(guint i = common; to[i]; ++i)   g_string_append(g_string_append(res, i > common ? "/" : ""), to[i]);
+    g_strfreev(from);
+    g_strfreev(to);
+    return g_string_free(res, false);
+}
+
+// The index of several outputs, the links are relative to the index file
+static
+char* index_document(Options* options, char** inputs, char** outputs, GArray** headings, guint n,
+                     const char* index_file) {
+    guint count = n;
+    for(guint i = 0; i < n; ++i) count += headings[i]->len;
+
+    char* dir           = g_path_get_dirname(index_file);
+    TocEntry* entries   = g_new(TocEntry, count);
+    guint k             = 0;
+    for(guint i = 0; i < n; ++i) {
+        char* href      = relative_path(dir, outputs[i]);
+        entries[k++]    = (TocEntry) {.level = 0, .text = inputs[i], .href = href};
+        toc_entries(headings[i], href, entries + k);
+        k              += headings[i]->len;
+    }
+
+    char* res       = g_strconcat(document_start(options, NULL), toc_block(options, entries, count),
+                                  document_end(options), NULL);
+
+    for(guint i = 0; i < count; ++i) g_free(entries[i].href);
+    g_free(entries);
+    g_free(dir);
+    return res;
+}
+#endif
+
+/**
+And finally I ended up defining map. See if you like how the usage looks in the function below.
+**/
+
+#define g_queue_map_z(q, type, name, ...) ({                                \
+        GQueue* private_res = g_queue_new();                                \
+        g_queue_foreach(q, g_func(type, name,                               \
+            name = __VA_ARGS__;                                             \
+            g_queue_push_tail(private_res, name);                           \
+            ), NULL);                                                       \
+        private_res;                                                        \
+                                      })
+
+static
+Block* tag_block(Options* options, Block* b) {
+    GArray* found = options->headings && b->kind == Narrative ? g_array_new(false, false, sizeof(Heading)) : NULL;
+
+    Block* indent_block(Block* b) {
+        return  b->kind == Narrative ? b                                                            :
+                b->kind == Code      ?
+                    union_new(Block, Code, .code =
+                        indent(options->code_symbols->Indented.indentation, b->Code.code))    :
+                    g_assert_no_match;
+    }
+
+    Block* surround_block(Block* b) {
+        return  b->kind == Narrative ?
+                    union_new(Block, Narrative, .narrative =
+                        g_strjoin("", NL, g_strstrip(b->Narrative.narrative), NL, NULL))   :
+                b->kind == Code      ?
+                    union_new(Block, Code, .code = g_strjoin("",
+                                                 NL,
+                                                 options->code_symbols->Surrounded.start_code,
+                                                 NL,
+                                                 g_strstrip(b->Code.code),
+                                                 NL,
+                                                 options->code_symbols->Surrounded.end_code,
+                                                 NL,
+                                                 NULL))    :
+                                       g_assert_no_match;
+    }
+
+    Block* html_block(Block* b) {
+        return  b->kind == Narrative ?
+                    union_new(Block, Narrative, .narrative = html_narrative(b->Narrative.narrative, found))  :
+                b->kind == Code      ?
+                    union_new(Block, Code, .code = html_code(options, g_strstrip(b->Code.code)))    :
+                                       g_assert_no_match;
+    }
+
+    Block* json_block(Block* b) {
+        return  b->kind == Narrative ?
+                    union_new(Block, Narrative, .narrative = json_narrative(b->Narrative.narrative, found))  :
+                b->kind == Code      ?
+                    union_new(Block, Code, .code = json_code(options, g_strstrip(b->Code.code)))    :
+                                       g_assert_no_match;
+    }
+
+    // A markdown output doesn't render the narrative, so its headings are just found, before it is stripped
+    bool rendered   = options->code_symbols->kind == Html || options->code_symbols->kind == Json;
+    if(found && !rendered) render_markdown(NULL, NULL, after_title_block(b->Narrative.narrative), found);
+
+    Block* res      = options->code_symbols->kind == Indented     ?   indent_block(b)     :
+                      options->code_symbols->kind == Surrounded   ?   surround_block(b)   :
+                      options->code_symbols->kind == Html         ?   html_block(b)       :
+                      options->code_symbols->kind == Json         ?   json_block(b)       :
+                                                                      g_assert_no_match;
+    if(found) res->Narrative.headings = found;
+    return res;
+}
+
+/**
+Caching the tagged blocks
+=========================
+
+An editor, or a build, that translates a file again after an edit finds most of its blocks as they were. With a
+`RenderCache` in the options a tagged block is kept under a hash of its text, of its kind and of the options that
+change how it is tagged, and a block that is found there is copied instead of being tagged again. The text of the
+block is kept with it and compared too, so two blocks with the same hash can't get the same output. A cache can be
+shared by many options, as they are part of the key, and by many threads, as a mutex guards it.
+
+The memory is bounded with two generations: the new entries go in the current one, and when it grows to half the
+maximum size it becomes the old one and the old one is dropped. An entry found in the old generation is moved
+back to the current one, so the blocks that keep being used stay. Narrative blocks with the ids of a table of
+contents depend on the rest of the document, so they aren't cached.
+**/
+
+// stored is set once the entry is in the cache file too
+typedef struct CacheEntry { guint64 hash; char* source; char* tagged; bool stored; } CacheEntry;
+
+typedef struct DiskCache DiskCache;
+
+struct RenderCache {
+    GMutex      lock;
+    GHashTable* current;
+    GHashTable* old;
+    gsize       current_size;
+    gsize       max_size;
+    guint64     hits;
+    guint64     misses;
+    DiskCache*  disk;
+    guint64     disk_hits;
+};
+
+static
+CacheEntry* disk_lookup(DiskCache* disk, guint64 hash, const char* source);
+
+static
+void disk_close(DiskCache* disk);
+
+// 8 bytes at the time, the entries are checked anyway
+static inline
+guint64 hash_bytes(guint64 h, const char* p, gsize len) {
+    const guint64 m = 0x9E3779B97F4A7C15ull;
+    h = (h ^ len) * m;
+    for(; len >= 8; p += 8, len -= 8) {
+        guint64 v;
+        memcpy(&v, p, 8);
+        h = (h ^ v) * m;
+        h ^= h >> 29;
+    }
+    guint64 v = 0;
+    memcpy(&v, p, len);
+    h = (h ^ v) * m;
+    return h ^ (h >> 32);
+}
+
+static inline
+guint64 hash_str(guint64 h, const char* s) { return hash_bytes(h, s ? s : "", s ? strlen(s) : 0); }
+
+// A hash of what, in the options, changes the tagged blocks
+static
+guint64 options_fingerprint(Options* options) {
+    CodeSymbols* cs = options->code_symbols;
+    guint64 h       = hash_bytes(0, (const char*) &cs->kind, sizeof(cs->kind));
+    switch(cs->kind) {
+        case Indented:      return hash_bytes(h, (const char*) &cs->Indented.indentation, sizeof(int));
+        case Surrounded:    return hash_str(hash_str(h, cs->Surrounded.start_code), cs->Surrounded.end_code);
+        case Html:          return hash_str(h + (cs->Html.highlighter != NULL), cs->Html.language);
+        case Json:          return hash_str(h, cs->Json.language);
+    }
+    return h;
+}
+
+static
+void free_cache_entry(gpointer p) {
+    CacheEntry* e = p;
+    g_free(e->source);
+    g_free(e->tagged);
+    g_free(e);
+}
+
+static
+GHashTable* cache_table() { return g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, free_cache_entry); }
+
+static
+RenderCache* cache_new(gsize max_size) {
+    RenderCache* cache  = g_new0(RenderCache, 1);
+    g_mutex_init(&cache->lock);
+    cache->current      = cache_table();
+    cache->old          = cache_table();
+    cache->max_size     = max_size;
+    return cache;
+}
+
+static
+void cache_free(RenderCache* cache) {
+    if(!cache) return;
+    if(cache->disk) disk_close(cache->disk);
+    g_hash_table_destroy(cache->current);
+    g_hash_table_destroy(cache->old);
+    g_mutex_clear(&cache->lock);
+    g_free(cache);
+}
+
+static
+void cache_add_locked(RenderCache* cache, CacheEntry* e) {
+    g_hash_table_replace(cache->current, &e->hash, e);
+    cache->current_size += sizeof(CacheEntry) + strlen(e->source) + strlen(e->tagged) + 2;
+    if(cache->current_size > cache->max_size / 2) {
+        g_hash_table_destroy(cache->old);
+        cache->old          = cache->current;
+        cache->current      = cache_table();
+        cache->current_size = 0;
+    }
+}
+
+// A copy of what source was tagged to, or NULL
+static
+char* cache_lookup(RenderCache* cache, guint64 hash, const char* source) {
+    g_mutex_lock(&cache->lock);
+    CacheEntry* e = g_hash_table_lookup(cache->current, &hash);
+    if(!e && (e = g_hash_table_lookup(cache->old, &hash))) {
+        g_hash_table_steal(cache->old, &hash);
+        cache_add_locked(cache, e);
+    }
+    if(!e && cache->disk && (e = disk_lookup(cache->disk, hash, source))) {
+        cache_add_locked(cache, e);
+        ++cache->disk_hits;
+    }
+    char* res = e && !strcmp(e->source, source) ? g_strdup(e->tagged) : NULL;
+    if(res) ++cache->hits;
+    else    ++cache->misses;
+    g_mutex_unlock(&cache->lock);
+    return res;
+}
+
+static
+void cache_insert(RenderCache* cache, guint64 hash, char* source, char* tagged) {
+    CacheEntry* e = g_new(CacheEntry, 1);
+    *e = (CacheEntry) {.hash = hash, .source = source, .tagged = tagged, .stored = false};
+
+    g_mutex_lock(&cache->lock);
+    cache_add_locked(cache, e);
+    g_mutex_unlock(&cache->lock);
+}
+
+static
+Block* add_code_tag(Options* options, Block* b) {
+    RenderCache* cache  = options->cache;
+    bool rendered       = b->kind == Code || options->code_symbols->kind != Indented;
+    if(!cache || !rendered || (b->kind == Narrative && options->headings)) return tag_block(options, b);
+
+    char* source        = extract(b);
+    guint64 hash        = hash_str(options_fingerprint(options) + b->kind, source);
+    char* hit           = cache_lookup(cache, hash, source);
+    if(hit) return  b->kind == Code ? union_new(Block, Code, .code = hit)
+                                    : union_new(Block, Narrative, .narrative = hit);
+
+    // Tagging strips the block in place
+    char* key           = g_strdup(source);
+    Block* tagged       = tag_block(options, b);
+    cache_insert(cache, hash, key, g_strdup(extract(tagged)));
+    return tagged;
+}
+
+/**
+Keeping the cache on disk
+=========================
+
+The cache in memory is gone when clite exits, so a build that starts from scratch, as the ones of a CI agent, tags
+all the blocks again. With `--cache FILE` the entries are kept in a file from one run to the next. The file is a
+header, an index with a fixed number of slots, each with the hash of an entry and where the entry is, and then the
+entries, one after the other, only ever appended. At the start the file is mapped in memory, and an entry missing
+from the cache in memory is looked for there. At the end the new entries are appended and the index points to them.
+
+More clite processes can use the same file: they take a shared lock to read the header and map the file, and an
+exclusive one to change it. What is before the end written in the header never changes, so a mapping stays right
+while other processes append. Each entry has its hash and a checksum of its text, checked before it is used, so a
+slot written by a process that died before its entries were all there is a miss, and not garbage. The header has a
+hash of the version of the file format and of the version of clite too, as another version can tag the blocks
+differently. A build of the same version keeps the file, so a rebuild of clite doesn't empty the cache.
+
+When the file would grow past its maximum size it is compacted: the entries used by this run, and as many others as
+fit in half the room for the entries, are written to a new file, which is renamed over the old one. A process that was waiting for
+the lock of the old file sees that it was replaced and opens the new one. Without mmap and flock the file is read
+whole at the start, and written whole the same way at the end.
+**/
+
+#define DISK_CACHE_MAGIC    "CLITEC01"
+#define DISK_CACHE_FORMAT   "1"     // of the entries and of what is hashed in them
+#define DISK_CACHE_SLOTS    (1 << 15)
+#define DISK_CACHE_PROBES   8
+
+typedef struct DiskHeader   { char magic[8]; guint64 build; guint64 slots; guint64 end; } DiskHeader;
+typedef struct DiskSlot     { guint64 hash; guint64 offset; } DiskSlot;
+
+// Followed by the source and the tagged text, each ending with a \0, up to a multiple of 8 bytes
+typedef struct DiskEntry    { guint64 hash; guint64 check; guint32 source_size; guint32 tagged_size; } DiskEntry;
+
+#define DISK_DATA_START     (sizeof(DiskHeader) + DISK_CACHE_SLOTS * sizeof(DiskSlot))
+
+struct DiskCache {
+    char*       path;
+    gsize       max_size;
+    const char* base;       // the file as it was at the start
+    gsize       size;
+    gsize       end;        // of the entries that can be used
+};
+
+static
+guint64 disk_build() { return hash_str(0, DISK_CACHE_FORMAT " " CLITE_VERSION); }
+
+static
+bool disk_valid(const char* base, gsize size) {
+    const DiskHeader* h = (const DiskHeader*) base;
+    return  base && size >= DISK_DATA_START && !memcmp(h->magic, DISK_CACHE_MAGIC, 8) && h->build == disk_build()
+            && h->slots == DISK_CACHE_SLOTS && h->end >= DISK_DATA_START && h->end <= size;
+}
+
+static inline
+DiskSlot* disk_slots(const char* base) { return (DiskSlot*) (base + sizeof(DiskHeader)); }
+
+// The slot with hash, or the one to put it in: the first free one, or the first one it could go in when all are taken
+static
+DiskSlot* disk_slot(const char* base, guint64 hash) {
+    DiskSlot* slots = disk_slots(base);
+    for(guint i = 0; i < DISK_CACHE_PROBES; ++i) {
+        DiskSlot* s = &slots[(hash + i) & (DISK_CACHE_SLOTS - 1)];
+        if(!s->offset || s->hash == hash) return s;
+    }
+    return &slots[hash & (DISK_CACHE_SLOTS - 1)];
+}
+
+// The entry with hash that the slot points to, if it is all before end and undamaged
+static
+const DiskEntry* disk_entry(const char* base, gsize end, const DiskSlot* s, guint64 hash) {
+    guint64 offset      = s->offset;
+    if(s->hash != hash || offset < DISK_DATA_START || offset % 8 || offset + sizeof(DiskEntry) > end) return NULL;
+
+    const DiskEntry* e  = (const DiskEntry*) (base + offset);
+    const char* text    = (const char*) (e + 1);
+    gsize size          = (gsize) e->source_size + e->tagged_size + 2;
+    return  e->hash == hash && size <= end - offset - sizeof(DiskEntry) && !text[e->source_size] && !text[size - 1]
+            && e->check == hash_bytes(hash, text, size) ? e : NULL;
+}
+
+static
+CacheEntry* disk_lookup(DiskCache* disk, guint64 hash, const char* source) {
+    if(!disk->end) return NULL;
+
+    const DiskEntry* e  = disk_entry(disk->base, disk->end, disk_slot(disk->base, hash), hash);
+    const char* text    = e ? (const char*) (e + 1) : NULL;
+    if(!e || strcmp(text, source)) return NULL;
+
+    CacheEntry* res     = g_new(CacheEntry, 1);
+    *res = (CacheEntry) {.hash = hash, .source = g_strdup(text), .tagged = g_strdup(text + e->source_size + 1),
+                         .stored = true};
+    return res;
+}
+
+// Appends the entry to data, which is the file from start on, and returns its offset in the file
+static
+guint64 disk_write_entry(GString* data, gsize start, guint64 hash, const char* source, const char* tagged) {
+    gsize at            = data->len;
+    DiskEntry e         = {.hash = hash, .source_size = strlen(source), .tagged_size = strlen(tagged)};
+    g_string_append_len(data, (const char*) &e, sizeof(e));
+    g_string_append_len(data, source, e.source_size + 1);
+    g_string_append_len(data, tagged, e.tagged_size + 1);
+    e.check             = hash_bytes(hash, data->str + at + sizeof(e), e.source_size + e.tagged_size + 2);
+    memcpy(data->str + at, &e, sizeof(e));
+    while(data->len % 8) g_string_append_c(data, '\0');
+    return start + at;
+}
+
+/**
+A whole new file has the entries in memory first, so the ones of this run are kept, and then the ones in the old
+file (`base`), as long as they fit in `budget` bytes.
+**/
+
+static
+GString* disk_image(RenderCache* cache, const char* base, gsize end, gsize budget) {
+    GString* image      = g_string_sized_new(DISK_DATA_START + MIN(budget, 1 << 20));
+    g_string_set_size(image, DISK_DATA_START);
+    memset(image->str, 0, DISK_DATA_START);
+
+    void add(guint64 hash, const char* source, const char* tagged) {
+        DiskSlot* s     = disk_slot(image->str, hash);
+        if((s->offset && s->hash == hash)
+           || image->len - DISK_DATA_START + sizeof(DiskEntry) + strlen(source) + strlen(tagged) + 2 > budget) return;
+
+        guint64 offset  = disk_write_entry(image, 0, hash, source, tagged);
+        *disk_slot(image->str, hash) = (DiskSlot) {.hash = hash, .offset = offset};
+    }
+
+    GHashTable* tables[] = {cache->current, cache->old};
+    for(guint i = 0; i < G_N_ELEMENTS(tables); ++i) {
+        GHashTableIter it;
+        gpointer key, value;
+        g_hash_table_iter_init(&it, tables[i]);
+        while(g_hash_table_iter_next(&it, &key, &value)) {
+            CacheEntry* e = value;
+            add(e->hash, e->source, e->tagged);
+        }
+    }
+    for(guint i = 0; base && i < DISK_CACHE_SLOTS; ++i) {
+        DiskSlot s          = disk_slots(base)[i];
+        const DiskEntry* e  = disk_entry(base, end, &s, s.hash);
+        if(e) add(e->hash, (const char*) (e + 1), (const char*) (e + 1) + e->source_size + 1);
+    }
+
+    DiskHeader h = {.build = disk_build(), .slots = DISK_CACHE_SLOTS, .end = image->len};
+    memcpy(h.magic, DISK_CACHE_MAGIC, 8);
+    memcpy(image->str, &h, sizeof(h));
+    return image;
+}
+
+static
+void disk_stored(RenderCache* cache) {
+    GHashTable* tables[] = {cache->current, cache->old};
+    for(guint i = 0; i < G_N_ELEMENTS(tables); ++i) {
+        GHashTableIter it;
+        gpointer key, value;
+        g_hash_table_iter_init(&it, tables[i]);
+        while(g_hash_table_iter_next(&it, &key, &value)) ((CacheEntry*) value)->stored = true;
+    }
+}
+
+// A missing or damaged file is an empty cache, it gets written again when saving
+static
+DiskCache* disk_open(const char* path, gsize max_size) {
+    DiskCache* disk     = g_new0(DiskCache, 1);
+    disk->path          = g_strdup(path);
+    disk->max_size      = MAX(max_size, 2 * DISK_DATA_START);
+
+#ifdef G_OS_UNIX
+    int fd              = open(path, O_RDONLY);
+    struct stat st;
+    if(fd >= 0 && !flock(fd, LOCK_SH) && !fstat(fd, &st) && st.st_size > 0) {
+        void* map       = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(map != MAP_FAILED) {
+            disk->base  = map;
+            disk->size  = st.st_size;
+            disk->end   = disk_valid(disk->base, disk->size) ? ((const DiskHeader*) map)->end : 0;
+        }
+    }
+    // The lock is given back before any block is rendered: the mapping stays right without it, as what is before
+    // end never changes, and saving takes the exclusive lock again
+    if(fd >= 0) flock(fd, LOCK_UN);
+    if(fd >= 0) close(fd);
+#else
+    char* text          = NULL;
+    if(g_file_get_contents(path, &text, &disk->size, NULL)) {
+        disk->base      = text;
+        disk->end       = disk_valid(disk->base, disk->size) ? ((const DiskHeader*) text)->end : 0;
+    }
+#endif
+    return disk;
+}
+
+static
+void disk_close(DiskCache* disk) {
+#ifdef G_OS_UNIX
+    if(disk->base) munmap((void*) disk->base, disk->size);
+#else
+    g_free((char*) disk->base);
+#endif
+    g_free(disk->path);
+    g_free(disk);
+}
+
+static
+bool disk_fail(char** error, const char* path) {
+    *error = g_strdup_printf("Cannot write the cache %s: %s", path, g_strerror(errno));
+    return false;
+}
+
+static
+bool disk_rewrite(RenderCache* cache, const char* base, gsize end, gsize budget, char** error) {
+    GString* image      = disk_image(cache, base, end, budget);
+    GError* gerror      = NULL;
+    bool done           = g_file_set_contents(cache->disk->path, image->str, image->len, &gerror);
+    g_string_free(image, true);
+    if(!done) {
+        *error = g_strdup(gerror->message);
+        g_error_free(gerror);
+    }
+    return done;
+}
+
+/**
+Saving appends the entries that aren't in the file yet, under the exclusive lock, or compacts the file when they
+don't fit. The entries go before the slots that point to them, and the slots before the new end in the header.
+**/
+
+static
+bool cache_save(RenderCache* cache, char** error) {
+    DiskCache* disk     = cache->disk;
+    g_assert(disk && error);
+
+    g_mutex_lock(&cache->lock);
+    bool done           = false;
+
+#ifdef G_OS_UNIX
+    int fd              = -1;
+    struct stat st, at_path;
+    for(;;) {
+        fd = open(disk->path, O_RDWR | O_CREAT, 0666);
+        if(fd < 0 || flock(fd, LOCK_EX) || fstat(fd, &st)) goto fail;
+        // A compaction may have replaced the file while waiting for the lock
+        if(!stat(disk->path, &at_path) && at_path.st_ino == st.st_ino && at_path.st_dev == st.st_dev) break;
+        close(fd);
+    }
+
+    gsize size          = st.st_size;
+    char* map           = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : NULL;
+    if(map == MAP_FAILED) goto fail;
+    bool valid          = disk_valid(map, size);
+    gsize end           = valid ? ((DiskHeader*) map)->end : 0;
+    gsize room          = disk->max_size - DISK_DATA_START;
+
+    GString* data       = g_string_new(NULL);
+    GArray* slots       = g_array_new(false, false, sizeof(DiskSlot));
+    GHashTable* tables[] = {cache->current, cache->old};
+    for(guint i = 0; valid && i < G_N_ELEMENTS(tables); ++i) {
+        GHashTableIter it;
+        gpointer key, value;
+        g_hash_table_iter_init(&it, tables[i]);
+        while(g_hash_table_iter_next(&it, &key, &value)) {
+            CacheEntry* e = value;
+            // Another process may have just added it
+            if(e->stored || disk_entry(map, end, disk_slot(map, e->hash), e->hash)) continue;
+
+            DiskSlot s = {.hash = e->hash, .offset = disk_write_entry(data, end, e->hash, e->source, e->tagged)};
+            g_array_append_val(slots, s);
+        }
+    }
+
+    if(!valid || end + data->len > disk->max_size)
+        done = disk_rewrite(cache, valid ? map : NULL, end, valid ? room / 2 : room, error);
+    else if(!data->len)
+        done = true;
+    else if(pwrite(fd, data->str, data->len, end) == (ssize_t) data->len) {
+        for(guint i = 0; i < slots->len; ++i) {
+            DiskSlot s = g_array_index(slots, DiskSlot, i);
+            *disk_slot(map, s.hash) = s;
+        }
+        __atomic_store_n(&((DiskHeader*) map)->end, end + data->len, __ATOMIC_RELEASE);
+        done = true;
+    }
+    else disk_fail(error, disk->path);
+
+    g_string_free(data, true);
+    g_array_free(slots, true);
+    if(map) munmap(map, size);
+    close(fd);
+    if(done) disk_stored(cache);
+    g_mutex_unlock(&cache->lock);
+    return done;
+
+fail:
+    disk_fail(error, disk->path);
+    if(fd >= 0) close(fd);
+#else
+    char* base          = NULL;
+    gsize size          = 0;
+    bool valid          = g_file_get_contents(disk->path, &base, &size, NULL) && disk_valid(base, size);
+    done                = disk_rewrite(cache, valid ? base : NULL, valid ? ((DiskHeader*) base)->end : 0,
+                                       disk->max_size - DISK_DATA_START, error);
+    g_free(base);
+    if(done) disk_stored(cache);
+#endif
+    g_mutex_unlock(&cache->lock);
+    return done;
+}
+
+static
+RenderCache* cache_open(const char* path, gsize max_size) {
+    RenderCache* cache  = cache_new(max_size);
+    cache->disk         = disk_open(path, max_size);
+    return cache;
+}
+
+/**
+Highlighting and rendering HTML (or the JSON AST) costs more than the rest of the phases, and each block is done on
+its own, so for big HTML outputs the blocks are tagged by all the cores. A worker takes the next block left when it
+is done with one, as the blocks can have very different sizes.
+**/
+
+#define PARALLEL_TAGS_MIN_SIZE (1 << 18)
+
+// The text of the tagged block replaces the one of the slot, which is also where tagging stripped it
+static
+Blocks* add_code_tags(Options* options, Blocks* blocks) {
+    guint n     = blocks->len;
+    gsize size  = 0;
+    if(options->code_symbols->kind == Html || options->code_symbols->kind == Json)
+        for(guint i = 0; i < n; ++i) size += strlen(extract(blocks_at(blocks, i)));
+
+    void tag_slot(guint i) {
+        Block* b        = blocks_at(blocks, i);
+        Block* tagged   = add_code_tag(options, b);
+        if(tagged == b) return;
+        blocks_set(blocks, i, extract(tagged), strlen(extract(tagged)), true);
+        if(b->kind == Narrative) b->Narrative.headings = tagged->Narrative.headings;
+        g_free(tagged);
+    }
+
+    if(n < 2 || size < PARALLEL_TAGS_MIN_SIZE) {
+        for(guint i = 0; i < n; ++i) tag_slot(i);
+        return blocks;
+    }
+
+    guint next = 0;
+    void tag(G_GNUC_UNUSED int worker) {
+        for(guint i; (i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < n;) tag_slot(i);
+    }
+    bool more() { return __atomic_load_n(&next, __ATOMIC_RELAXED) < n; }
+    parallel_jobs(MIN(n, (guint) g_get_num_processors()), more, tag);
+    return blocks;
+}
+
+static
+char* concat_blocks(Blocks* blocks) {
+    gsize size = 0;
+    for(guint i = 0; i < blocks->len; ++i) size += strlen(extract(blocks_at(blocks, i)));
+
+    GString* res = g_string_sized_new(size);
+    for(guint i = 0; i < blocks->len; ++i) g_string_append(res, extract(blocks_at(blocks, i)));
+    return g_string_free(res, false);
+}
+
+char* stringify(Blocks* blocks) {
+    return g_strchug(concat_blocks(blocks));
+}
+
+void deb(GQueue* q);
+
+// Tags merged blocks, also returning their headings in *headings if it isn't NULL
+static
+char* render_document(Options* options, Blocks* blocks, GArray** headings) {
+    Options with    = *options;
+    with.headings   = options->toc || headings;
+
+    char* start     = document_start(&with, blocks->len ? blocks_at(blocks, 0) : NULL);
+    add_code_tags(&with, blocks);
+    int kind        = options->code_symbols->kind;
+    GArray* found   = with.headings ? number_headings(blocks, kind == Html || kind == Json) : NULL;
+    char* body      = stringify(blocks);
+    if(options->toc) body = add_toc(&with, body, found);
+
+    if(headings)    *headings = found;
+    else            free_headings(found);
+    return g_strconcat(start, body, document_end(&with), NULL);
+}
+
+// Frees tokens
+static
+char* translate_tokens(Options* options, TokenStream* tokens, GArray** headings) {
+    g_assert(options);
+    g_assert(tokens);
+
+    Blocks* blocks  = remove_empty_blocks(options, blockize_tokens(options, tokens));
+    blocks          = merge_blocks(options, blocks);
+    char* res       = render_document(options, blocks, headings);
+    blocks_free(blocks);
+    return res;
+}
+
+static
+char* translate_document(Options* options, char* source, GArray** headings) {
+    g_assert(source);
+    return translate_tokens(options, tokenize(options, source), headings);
+}
+
+static
+char* translate(Options* options, char* source) { return translate_document(options, source, NULL); }
+
+/**
+Sometimes the same source is needed with different code symbols, as indented for one tool and fenced for another.
+Tokenizing, parsing and merging the blocks don't depend on the code symbols, so `translate_targets` does them once,
+from the tokens of the first options, and then tags the blocks for all the targets at the same time. Each target works on its own
+copy of the blocks, as tagging rewrites them in place.
+**/
+
+static
+Block* copy_block(Block* b) {
+    return  b->kind == Code         ? union_new(Block, Code, .code = g_strdup(b->Code.code))                    :
+            b->kind == Narrative    ? union_new(Block, Narrative, .narrative = g_strdup(b->Narrative.narrative),
+                                                .pair = b->Narrative.pair)                                      :
+                                      g_assert_no_match;
+}
+
+// A queue of blocks of their own, for the code that shares blocks between versions of a document
+static
+GQueue* blocks_queue(Blocks* blocks) {
+    GQueue* q = g_queue_new();
+    for(guint i = 0; i < blocks->len; ++i) g_queue_push_tail(q, copy_block(blocks_at(blocks, i)));
+    return q;
+}
+
+#ifndef CLITE_LIBRARY
+static
+char** translate_targets(Options** options, int n, TokenStream* tokens) {
+    g_assert(options);
+    g_assert(n > 0);
+    g_assert(tokens);
+
+    Blocks* blocks  = remove_empty_blocks(options[0], blockize_tokens(options[0], tokens));
+    blocks          = merge_blocks(options[0], blocks);
+    char** res      = g_new0(char*, n + 1);
+
+    void render(int i) {
+        Blocks* copy    = blocks_copy(blocks);
+        res[i]          = render_document(options[i], copy, NULL);
+        blocks_free(copy);
+    }
+    parallel_for(n, render);
+    blocks_free(blocks);
+    return res;
+}
+#endif
+
+/**
+Pipelining the phases
+=====================
+
+For big streaming inputs it is a shame to read the whole file, then tokenize it, then parse it and so on, using one
+core at the time. The phases are naturally a pipeline, so I run them on three threads:
+
+1. the tokenizer reads the input in chunks and pushes tokens,
+2. the parser pops tokens and pushes flattened blocks,
+3. the calling thread pops blocks, runs the phases on them and writes the result.
+
+Errors are reported when they are found, so part of the output may already be written by then.
+
+Each phase is written as a function that receives one item at the time and passes what it produces to an `emit`
+function, so they can be chained on threads or called one after the other.
+
+The threads talk through a single-producer single-consumer ring buffer. There are no locks on the way of the items:
+the producer owns `tail` and the consumer owns `head`. `NULL` marks the end of the stream. A side that has to wait
+yields a few times, which is enough when the other one is just behind, and then sleeps on a condition until the other
+one moves. So a stage that stalls, as a parser waiting on a slow input, doesn't keep a core busy, which under `make -j`
+would be a job that make doesn't know about. The side that moves takes the lock only when the other one sleeps.
+
+A 20 GB file must translate in a few MB, so what is in flight is bounded in bytes, not just in items. Each item is
+pushed with its size, and the producer waits when the ring is full or when the items in it add up to `RING_BYTES`,
+unless the ring is empty, so that a block bigger than that still goes through, alone. Then what is in memory at any
+time is a chunk of the input, the block the parser is building, the block the last phase keeps pending to merge it
+with the next one, and at most `RING_BYTES` in each ring. A block is the unit of the phases, so it can't be split,
+but nothing else grows with the input.
+**/
+
+#define RING_SIZE           1024
+#define RING_BYTES          (4 * STREAM_CHUNK_SIZE)
+#define RING_SPINS          64
+#define STREAM_CHUNK_SIZE   (64 * 1024)
+
+#ifndef CLITE_LIBRARY
+typedef struct Ring {
+    gpointer    slots[RING_SIZE];
+    gsize       sizes[RING_SIZE];
+    gsize       bytes __attribute__((aligned(64)));     // added before tail moves, taken away after head does
+    guint       head  __attribute__((aligned(64)));
+    guint       tail  __attribute__((aligned(64)));
+    int         sleeping __attribute__((aligned(64)));  // a side waits on changed, just one can be blocked at a time
+    GMutex      lock;
+    GCond       changed;
+} Ring;
+
+static
+Ring* ring_new() {
+    Ring* r = g_new0(Ring, 1);
+    g_mutex_init(&r->lock);
+    g_cond_init(&r->changed);
+    return r;
+}
+
+static
+void ring_free(Ring* r) {
+    g_mutex_clear(&r->lock);
+    g_cond_clear(&r->changed);
+    g_free(r);
+}
+
+// Whether the push at tail of an item of size has to wait, or with pushing false the pop at head
+static inline
+bool ring_blocked(Ring* r, bool pushing, guint at, gsize size) {
+    if(!pushing) return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == at;
+
+    guint used = at - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    return used == RING_SIZE || (used && __atomic_load_n(&r->bytes, __ATOMIC_RELAXED) + size > RING_BYTES);
+}
+
+// Returns when the push or the pop can go on
+static
+void ring_wait(Ring* r, bool pushing, guint at, gsize size) {
+    for(int i = 0; i < RING_SPINS; ++i) {
+        if(!ring_blocked(r, pushing, at, size)) return;
+        g_thread_yield();
+    }
+
+    g_mutex_lock(&r->lock);
+    for(;;) {
+        __atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(!ring_blocked(r, pushing, at, size)) break;
+        g_cond_wait(&r->changed, &r->lock);
+    }
+    __atomic_store_n(&r->sleeping, 0, __ATOMIC_SEQ_CST);
+    g_mutex_unlock(&r->lock);
+}
+
+// After moving head or tail. The fences order the move before the check of sleeping, and sleeping before the check
+// of the sleeper, so one of the two sees the other. The first move after the sleeper went to sleep wakes it, the next
+// ones don't take the lock until it sleeps again.
+static
+void ring_wake(Ring* r) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!__atomic_load_n(&r->sleeping, __ATOMIC_RELAXED) || !__atomic_exchange_n(&r->sleeping, 0, __ATOMIC_SEQ_CST))
+        return;
+
+    g_mutex_lock(&r->lock);
+    g_cond_broadcast(&r->changed);
+    g_mutex_unlock(&r->lock);
+}
+
+static
+void ring_push(Ring* r, gpointer item, gsize size) {
+    guint tail = r->tail;
+    ring_wait(r, true, tail, size);
+
+    r->slots[tail % RING_SIZE] = item;
+    r->sizes[tail % RING_SIZE] = size;
+    __atomic_add_fetch(&r->bytes, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    ring_wake(r);
+}
+
+static
+gpointer ring_pop(Ring* r) {
+    guint head = r->head;
+    ring_wait(r, false, head, 0);
+
+    gpointer item = r->slots[head % RING_SIZE];
+    gsize size    = r->sizes[head % RING_SIZE];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&r->bytes, size, __ATOMIC_RELAXED);
+    ring_wake(r);
+    return item;
+}
+#endif
+
+typedef gsize (*ReadFunc)(char* buf, gsize size, gpointer reader);
+typedef void  (*WriteFunc)(const char* buf, gsize size, gpointer writer);
+
+/**
+The streaming tokenizer keeps the last few bytes of a chunk when a delimiter could start there and end in the next one.
+The text is emitted at each delimiter and at the end of each chunk, so a long run of text comes as more tokens of at
+most a chunk each, instead of being gathered first. The parser appends them all to the block it is building, so the
+blocks are the same as the ones from `tokenize`.
+**/
+
+#ifndef CLITE_LIBRARY
+static
+void tokenize_stream(Options* options, ReadFunc read, gpointer reader, void (*emit)(Token*)) {
+    g_assert(options);
+
+    gsize keep      = max_delimiter_length(options) - 1;
+
+    GString* buf    = g_string_sized_new(STREAM_CHUNK_SIZE + keep);
+    int line        = 1;
+    int open        = -1;
+
+    void emit_text(char* from, char* to) {
+        if(from >= to) return;
+        line += count_newlines(from, to - from);
+        emit(union_new(Token, Text, .text = g_strndup(from, to - from)));
+    }
+
+    for(bool eof = false; !eof;) {
+        gsize old = buf->len;
+        g_string_set_size(buf, old + STREAM_CHUNK_SIZE);
+        gsize n = read(buf->str + old, STREAM_CHUNK_SIZE, reader);
+        g_string_set_size(buf, old + n);
+        eof = n == 0;
+
+        gsize stop  = eof ? buf->len : buf->len > keep ? buf->len - keep : 0;
+        gsize i     = 0, run = 0;
+        int pattern;
+        while(i < stop) {
+            const char* src = scan(options, buf->str + i, buf->str + stop, buf->str + buf->len, &pattern);
+            if(!src) { i = stop; break; }
+
+            int kind = PATTERN_KIND(pattern), pair = PATTERN_PAIR(pattern);
+            if(!accept_delimiter(options, &open, kind, pair)) { i = src - buf->str + 1; continue; }
+
+            emit_text(buf->str + run, (char*) src);
+            emit(kind == OpenComment ? union_new(Token, OpenComment, .line = line, .pair = pair)
+                                     : union_new(Token, CloseComment, .line = line, .pair = pair));
+            if(kind == CloseComment && is_line_pair(options, pair)) ++line;
+            i    = src - buf->str + delimiter_length(options, kind, pair);
+            run  = i;
+        }
+        emit_text(buf->str + run, buf->str + i);
+        g_string_erase(buf, 0, MAX(run, i));
+    }
+    if(open >= 0 && is_line_pair(options, open)) emit(union_new(Token, CloseComment, .line = line, .pair = open));
+    g_string_free(buf, true);
+}
+#endif
+
+/**
+Parsing and flattening a stream is a little state machine that gives the same blocks, and the same errors, as
+`parse` followed by `flatten`, but for their column and excerpt: the chunks of the input that are gone can't be read
+again, so the tokenizer keeps a running count of the lines instead. A `NULL` token means the input is over. The block being built is handed over as it is,
+without a copy, giving back the room the buffer kept to grow when it is big.
+**/
+
+#ifndef CLITE_LIBRARY
+static
+void free_token(Token* tok) {
+    if(tok->kind == Text) g_free(tok->Text.text);
+    g_free(tok);
+}
+#endif
+
+// line is the one of the open narrative comment of the block
+typedef struct BlockBuilder { enum { AtTop, InNarrative, InCode } state; GString* acc; int pair; int line; } BlockBuilder;
+
+#ifndef CLITE_LIBRARY
+static
+void flatten_token(Options* options, BlockBuilder* bb, Token* tok, void (*emit)(Block*)) {
+    g_assert(options);
+    g_assert(bb);
+
+    void emit_acc() {
+        gsize len   = bb->acc->len;
+        char* s     = g_string_free(bb->acc, false);
+        if(len > STREAM_CHUNK_SIZE) s = g_realloc(s, len + 1);
+        bb->acc     = g_string_sized_new(256);
+        emit(bb->state == InNarrative ? union_new(Block, Narrative, .narrative = s, .pair = bb->pair)
+                                      : union_new(Block, Code, .code = s));
+        bb->state   = AtTop;
+    }
+
+    if(!bb->acc) bb->acc = g_string_sized_new(256);
+
+    if(!tok) {
+        if(bb->state == InNarrative)
+            fail(options, bb->line, "You haven't closed your last narrative comment at line %i", bb->line);
+        if(bb->state == InCode) emit_acc();
+        g_string_free(bb->acc, true);
+        bb->acc = NULL;
+        return;
+    }
+
+    if(bb->state == InCode && tok->kind == OpenComment) emit_acc();
+
+    switch(bb->state) {
+        case AtTop:
+            if(tok->kind == CloseComment)
+                fail(options, tok->CloseComment.line,
+                     "Don't insert a close narrative comment at the start of your program at line %i",
+                     tok->CloseComment.line);
+            bb->state = tok->kind == OpenComment ? InNarrative : InCode;
+            if(tok->kind == OpenComment)    bb->pair = tok->OpenComment.pair;
+            if(tok->kind == OpenComment)    bb->line = tok->OpenComment.line;
+            if(tok->kind == Text)           g_string_append(bb->acc, tok->Text.text);
+            break;
+        case InNarrative:
+            if(tok->kind == OpenComment)
+                fail(options, tok->OpenComment.line,
+                     "Don't open narrative comments inside narrative comments at line %i",
+                     tok->OpenComment.line);
+            if(tok->kind == CloseComment)   emit_acc();
+            else                            g_string_append(bb->acc, tok->Text.text);
+            break;
+        case InCode:
+            g_string_append(bb->acc, tok->kind == CloseComment ? pattern_string(options, 2 * tok->CloseComment.pair + 1)
+                                                               : tok->Text.text);
+            break;
+    }
+
+    free_token(tok);
+}
+#endif
+
+/**
+The phases work on a block at the time too. Empty blocks are dropped and a block is kept pending until the next one
+shows up, so that blocks of the same kind can be merged as in `merge_blocks`. The pending block grows in place, keeping
+its length and its room, so that a long run of blocks merged together costs as much as copying them once. Leading
+spaces of the output are skipped
+to behave like the `g_strchug` in `stringify`. The start of the document is written before the first block, and
+its end after the last one.
+**/
+
+static
+void free_block(Block* b) {
+    g_free(extract(b));
+    g_free(b);
+}
+
+typedef struct PhaseState { Block* pending; gsize length; gsize room; bool started; bool opened; } PhaseState;
+
+static
+void phase_block(Options* options, PhaseState* ps, Block* b, WriteFunc write, gpointer writer) {
+    g_assert(options);
+    g_assert(ps);
+
+    void write_str(char* s) {
+        if(*s) write(s, strlen(s), writer);
+        g_free(s);
+    }
+    void open_document(Block* first) {
+        if(!ps->opened) write_str(document_start(options, first));
+        ps->opened = true;
+    }
+    void output(Block* b) {
+        open_document(b);
+        Block* tagged   = add_code_tag(options, b);
+        char* s         = extract(tagged);
+        if(!ps->started) s = g_strchug(s);
+        if(*s) {
+            write(s, strlen(s), writer);
+            ps->started = true;
+        }
+        if(tagged != b) free_block(tagged);
+        free_block(b);
+    }
+
+    if(b && is_str_all_spaces(extract(b))) {
+        free_block(b);
+        return;
+    }
+
+    if(ps->pending && b && ps->pending->kind == b->kind) {
+        char* text      = extract(b);
+        gsize nl        = strlen(NL), size = strlen(text);
+        gsize need      = ps->length + nl + size + 1;
+        char* merged    = extract(ps->pending);
+        if(need > ps->room) {
+            ps->room    = MAX(need, 2 * ps->room);
+            merged      = g_realloc(merged, ps->room);
+        }
+        memcpy(merged + ps->length, NL, nl);
+        memcpy(merged + ps->length + nl, text, size + 1);
+        ps->length      = need - 1;
+        if(b->kind == Code) ps->pending->Code.code = merged;
+        else                ps->pending->Narrative.narrative = merged;
+        free_block(b);
+        return;
+    }
+
+    if(ps->pending) output(ps->pending);
+    ps->pending = b;
+    ps->length  = b ? strlen(extract(b)) : 0;
+    ps->room    = ps->length + 1;
+
+    if(!b) {
+        open_document(NULL);
+        write_str(document_end(options));
+    }
+}
+
+#ifndef CLITE_LIBRARY
+static
+void translate_pipelined(Options* options, ReadFunc read, gpointer reader, WriteFunc write, gpointer writer) {
+    g_assert(options);
+
+    Ring* tokens = ring_new();
+    Ring* blocks = ring_new();
+
+    gpointer tokenizer(G_GNUC_UNUSED gpointer data) {
+        void push(Token* tok) {
+            ring_push(tokens, tok, sizeof(Token) + (tok->kind == Text ? strlen(tok->Text.text) : 0));
+        }
+        tokenize_stream(options, read, reader, push);
+        ring_push(tokens, NULL, 0);
+        return NULL;
+    }
+    gpointer parser(G_GNUC_UNUSED gpointer data) {
+        void push(Block* b) { ring_push(blocks, b, sizeof(Block) + strlen(extract(b))); }
+        BlockBuilder bb = { .state = AtTop };
+        Token* tok;
+        do {
+            tok = ring_pop(tokens);
+            flatten_token(options, &bb, tok, push);
+        } while(tok);
+        ring_push(blocks, NULL, 0);
+        return NULL;
+    }
+
+    GThread* t1 = g_thread_new("clite-tokenizer", tokenizer, NULL);
+    GThread* t2 = g_thread_new("clite-parser", parser, NULL);
+
+    PhaseState ps = { .pending = NULL };
+    Block* b;
+    do {
+        b = ring_pop(blocks);
+        phase_block(options, &ps, b, write, writer);
+    } while(b);
+
+    g_thread_join(t1);
+    g_thread_join(t2);
+    ring_free(tokens);
+    ring_free(blocks);
+}
+#endif
+
+/**
+Encodings
+=========
+
+Some windows programs (i.e. notepad, VS, ...) add a 3 bytes prelude to their utf-8 files, C doesn't know
+anything about it, so you need to strip it. On this topic, I suspect the program works on UTF-8 files
+that contain non-ASCII chars, even if when I wrote it I didn't know anything about localization.
+
+It should work because I'm just splitting the file when I see a certain ASCII string and in UTF-8 ASCII chars
+cannot appear anywhere else than in their ASCII position.
+
+Visual Studio also saves files in UTF-16, and other tools in UTF-32, with a prelude telling which one, and in which
+byte order. Those are transcoded to UTF-8 before tokenizing, as everything else works on bytes. Source code is mostly
+ASCII, so 16 bytes of code units that are all ASCII are packed to their chars at once with SSE2, and the rest is
+converted one code unit at the time. Code units that aren't valid, as a lone surrogate, become U+FFFD. A UTF-8 input
+is neither copied nor looked at past its prelude, so it doesn't pay for any of this.
+**/
+
+typedef enum Encoding { EncodingUtf8, EncodingUtf16LE, EncodingUtf16BE, EncodingUtf32LE, EncodingUtf32BE } Encoding;
+
+#define UNIT_SIZE(e)    ((e) == EncodingUtf8 ? 1 : (e) <= EncodingUtf16BE ? 2 : 4)
+
+// The encoding of the prelude at the start of the n bytes at b and its length, UTF-8 and 0 if there is none
+static
+gsize find_bom(const guchar* b, gsize n, Encoding* encoding) {
+    // UTF-32LE first, as its prelude starts with the one of UTF-16LE
+    static const struct { guchar bytes[4]; gsize len; Encoding encoding; } boms[] = {
+        {{0xFF, 0xFE, 0x00, 0x00}, 4, EncodingUtf32LE}, {{0x00, 0x00, 0xFE, 0xFF}, 4, EncodingUtf32BE},
+        {{0xEF, 0xBB, 0xBF},       3, EncodingUtf8},    {{0xFF, 0xFE},             2, EncodingUtf16LE},
+        {{0xFE, 0xFF},             2, EncodingUtf16BE}
+    };
+    for(gsize i = 0; i < G_N_ELEMENTS(boms); ++i)
+        if(n >= boms[i].len && !memcmp(b, boms[i].bytes, boms[i].len)) {
+            *encoding = boms[i].encoding;
+            return boms[i].len;
+        }
+    *encoding = EncodingUtf8;
+    return 0;
+}
+
+static inline
+guint32 code_unit(const guchar* p, Encoding e) {
+    return  e == EncodingUtf16LE ? (guint32) p[0] | p[1] << 8                                       :
+            e == EncodingUtf16BE ? (guint32) p[0] << 8 | p[1]                                       :
+            e == EncodingUtf32LE ? (guint32) p[0] | p[1] << 8 | p[2] << 16 | (guint32) p[3] << 24   :
+                                   (guint32) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+#ifdef __SSE2__
+// Writes the chars of the code units in the 16 bytes at p if they all are ASCII
+static inline
+bool ascii_units(const guchar* p, Encoding e, char* out) {
+    __m128i v       = _mm_loadu_si128((const __m128i*) p);
+    __m128i high    = e == EncodingUtf16LE ? _mm_set1_epi16((short) 0xFF80)       :
+                      e == EncodingUtf16BE ? _mm_set1_epi16((short) 0x80FF)       :
+                      e == EncodingUtf32LE ? _mm_set1_epi32((int) 0xFFFFFF80)     :
+                                             _mm_set1_epi32((int) 0x80FFFFFF);
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, high), _mm_setzero_si128())) != 0xFFFF) return false;
+
+    v = e == EncodingUtf16BE ? _mm_srli_epi16(v, 8) : e == EncodingUtf32BE ? _mm_srli_epi32(v, 24) : v;
+    if(UNIT_SIZE(e) == 4) v = _mm_packs_epi32(v, v);
+    v = _mm_packus_epi16(v, v);
+    if(UNIT_SIZE(e) == 2) _mm_storel_epi64((__m128i*) out, v);
+    else {
+        gint32 chars = _mm_cvtsi128_si32(v);
+        memcpy(out, &chars, sizeof(chars));
+    }
+    return true;
+}
+#endif
+
+/**
+`transcode` converts the code units of the n bytes at in to UTF-8 in out, which has room for `n / 2 * 3 + 4` bytes,
+and returns how many it wrote. It stops before a code unit, or a surrogate pair, that is cut at the end, so that it
+can go on with the next bytes of a stream, unless it is the last part of the input.
+**/
+
+static
+gsize transcode(const guchar* in, gsize n, Encoding e, char* out, gsize* used, bool last) {
+    gsize unit  = UNIT_SIZE(e);
+    gsize i     = 0, o = 0;
+    bool cut    = false;
+
+    // The next char, or false if it continues after the end
+    bool next_char() {
+        guint32 c   = code_unit(in + i, e);
+        gsize size  = unit;
+        if(unit == 2 && c >= 0xD800 && c < 0xDC00) {
+            if(i + 4 > n && !last) return false;
+            guint32 low = i + 4 <= n ? code_unit(in + i + 2, e) : 0;
+            bool pair   = low >= 0xDC00 && low < 0xE000;
+            c           = pair ? 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00) : 0xFFFD;
+            size        = pair ? 4 : 2;
+        }
+        else if((c >= 0xD800 && c < 0xE000) || c > 0x10FFFF) c = 0xFFFD;
+        o += g_unichar_to_utf8(c, out + o);
+        i += size;
+        return true;
+    }
+
+    while(!cut && i + unit <= n) {
+#ifdef __SSE2__
+        if(i + 16 <= n && ascii_units(in + i, e, out + o)) {
+            i += 16;
+            o += 16 / unit;
+            continue;
+        }
+#endif
+        // Not all ASCII, one at the time up to the next 16 bytes
+        for(gsize end = MIN(i + 16, n); !cut && i + unit <= end;) cut = !next_char();
+    }
+    if(last && i < n) {
+        o += g_unichar_to_utf8(0xFFFD, out + o);
+        i  = n;
+    }
+    *used = i;
+    return o;
+}
+
+// The size bytes at source, followed by a '\0', as UTF-8 without a prelude. The result replaces source.
+static
+char* to_utf8(char* source, gsize size) {
+    Encoding e;
+    gsize bom   = find_bom((const guchar*) source, size, &e);
+    if(e == EncodingUtf8) {
+        if(bom) memmove(source, source + bom, size - bom + 1);
+        return source;
+    }
+
+    gsize used;
+    char* res   = g_malloc((size - bom) / 2 * 3 + 5);
+    gsize len   = transcode((const guchar*) source + bom, size - bom, e, res, &used, true);
+    res[len]    = '\0';
+    g_free(source);
+    return g_realloc(res, len + 1);
+}
+
+/**
+A stream in UTF-16 or UTF-32 is read through a `Transcoder`, which reads from the real reader just as much as fits
+in the buffer of the caller once transcoded, and keeps a code unit cut at the end for the next read.
+**/
+
+#ifndef CLITE_LIBRARY
+typedef struct Transcoder {
+    ReadFunc    read;
+    gpointer    reader;
+    Encoding    encoding;
+    guchar*     in;
+    gsize       len;    // cut at the end of the last read
+    gsize       room;
+    bool        eof;
+} Transcoder;
+
+static
+gsize read_transcoded(char* buf, gsize size, gpointer reader) {
+    Transcoder* t   = reader;
+    g_assert(size >= 16);
+
+    gsize room      = (size - 4) / 3 * 2;
+    if(t->room < room) t->in = g_realloc(t->in, t->room = room);
+
+    gsize res       = 0;
+    while(!res && (!t->eof || t->len)) {
+        gsize n     = t->eof ? 0 : t->read((char*) t->in + t->len, room - t->len, t->reader);
+        t->eof      = !n;
+        t->len     += n;
+
+        gsize used;
+        res         = transcode(t->in, t->len, t->encoding, buf, &used, t->eof);
+        memmove(t->in, t->in + used, t->len - used);
+        t->len     -= used;
+    }
+    return res;
+}
+#endif
+
+/**
+Incremental translation
+=======================
+
+A live-preview editor calls us at every keystroke, but an edit changes just a few blocks. A `Document` keeps the
+blocks from `blockize`, and `document_edit` re-tokenizes only the region around an edit.
+
+The blocks carry enough to rebuild the source: a code block is the source itself and a narrative block is its text
+between the narrative delimiters. A block boundary is a safe place to restart the tokenizer, as the parser there is
+always outside any block. So the region starts at the boundary before the edit, keeping a delimiter length of
+unchanged text so that a delimiter can't be created across it.
+
+The region ends at an old block boundary after the edit where the new tokens happen to have a boundary too, and
+where the parser is in a state that joins well with the old block that follows. The region includes one more delimiter
+length, so that tokens close to the end aren't cut. If there is no such boundary the region grows.
+
+The blocks of a `Document` are its parse tree, with where each one starts in the source. Its output is kept as where
+each run of blocks starts in the body of the output. A run is a group of blocks of the same kind, with the empty ones
+after them, so what the phases merge together, and each run is rendered on its own. After an edit just the runs from
+the one before the edited blocks to the one after them are rendered again, and their output replaces the old one,
+whose place and length are the offsets of those runs. Then the offsets after the edit are moved, without measuring
+or rendering those blocks again.
+
+The body of the output is chugged, so when the change is among the spaces at its start, the runs after it are
+rendered too up to the first one that isn't empty. Only then the first block of the document can change, and with
+it the start of an HTML or JSON document. A table of contents depends on the whole document, so with one every edit
+renders it all again.
+**/
+
+typedef struct Edit { gsize offset; gsize deleted; char* inserted; } Edit;
+
+// The bytes [output_offset, output_offset + output_deleted) of the old output are replaced by output_inserted
+typedef struct Retranslation { gsize output_offset; gsize output_deleted; char* output_inserted; } Retranslation;
+
+typedef struct Document {
+    GArray* blocks;     // of Block*, owned
+    GArray* source;     // where each block starts in the source, then the length of the source
+    GArray* output;     // the length of the body before each block, a run counted at its first one, then in all
+    gsize   chugged;    // the spaces at the start of the body, which aren't in the output
+    char*   start;      // of the document
+    gsize   length;     // of the whole output
+} Document;
+
+#define DOC_BLOCKS(doc)     ((Block**) (doc)->blocks->data)
+#define DOC_SOURCE(doc)     ((gsize*) (doc)->source->data)
+#define DOC_OUTPUT(doc)     ((gsize*) (doc)->output->data)
+
+static
+gsize block_source_length(Options* options, Block* b) {
+    return  strlen(extract(b)) +
+            (b->kind == Narrative ? strlen(pattern_string(options, 2 * b->Narrative.pair)) +
+                                    strlen(pattern_string(options, 2 * b->Narrative.pair + 1)) : 0);
+}
+
+static
+GString* append_block_source(Options* options, GString* src, Block* b) {
+    return  b->kind == Code         ? g_string_append(src, b->Code.code)                            :
+            b->kind == Narrative    ? g_string_append(g_string_append(g_string_append(src,
+                                                pattern_string(options, 2 * b->Narrative.pair)),
+                                                b->Narrative.narrative),
+                                                pattern_string(options, 2 * b->Narrative.pair + 1)) :
+                                      g_assert_no_match;
+}
+
+// The phases change the blocks in place, so they work on a copy
+static
+Blocks* copy_blocks(Block** blocks, guint from, guint to) {
+    Blocks* v = blocks_new(to - from);
+    for(guint i = from; i < to; ++i) {
+        Block* b = blocks[i];
+        blocks_push(v, b->kind, b->kind == Narrative ? b->Narrative.pair : 0, extract(b), strlen(extract(b)), false);
+    }
+    return v;
+}
+
+// The start of the run from the one before i, which the edited blocks from i could join. The empty blocks before it
+// are in the run before, as when rendering from the start.
+static
+guint run_start(Block** bs, guint i) {
+    while(i > 0 && is_str_all_spaces(extract(bs[i - 1]))) --i;
+    if(i == 0) return 0;
+    int kind = bs[i - 1]->kind;
+    while(i > 0 && (bs[i - 1]->kind == kind || is_str_all_spaces(extract(bs[i - 1])))) --i;
+    while(i > 0 && is_str_all_spaces(extract(bs[i]))) ++i;
+    return i;
+}
+
+// The end of the run of i, with the empty blocks after it
+static
+guint run_end(Block** bs, guint i, guint count) {
+    while(i < count && is_str_all_spaces(extract(bs[i]))) ++i;
+    if(i == count) return count;
+    int kind = bs[i]->kind;
+    while(i < count && (bs[i]->kind == kind || is_str_all_spaces(extract(bs[i])))) ++i;
+    return i;
+}
+
+// Renders the runs in [from, to) one at the time, with the length of each in lengths[its first block - from]
+static
+GString* render_runs(Options* options, Block** bs, guint from, guint to, gsize* lengths) {
+    GString* res = g_string_new("");
+    for(guint i = from, j; i < to; i = j) {
+        j           = run_end(bs, i, to);
+        Blocks* v   = process_phases(options, copy_blocks(bs, i, j));
+        gsize len   = res->len;
+        for(guint k = 0; k < v->len; ++k) g_string_append(res, extract(blocks_at(v, k)));
+        blocks_free(v);
+        for(guint k = i; k < j; ++k) lengths[k - from] = k == i ? res->len - len : 0;
+    }
+    return res;
+}
+
+// The start of the document, from its first run that isn't empty
+static
+char* runs_start(Options* options, Block** bs, guint from, guint to) {
+    while(from < to && is_str_all_spaces(extract(bs[from]))) ++from;
+    Blocks* v   = merge_blocks(options, remove_empty_blocks(options, copy_blocks(bs, from, run_end(bs, from, to))));
+    char* res   = document_start(options, v->len ? blocks_at(v, 0) : NULL);
+    blocks_free(v);
+    return res;
+}
+
+static
+gsize leading_spaces(const char* s, gsize len) {
+    gsize i = 0;
+    while(i < len && g_ascii_isspace(s[i])) ++i;
+    return i;
+}
+
+static
+void document_free(Document* doc) {
+    if(!doc) return;
+    for(guint i = 0; i < doc->blocks->len; ++i) free_block(DOC_BLOCKS(doc)[i]);
+    g_array_free(doc->blocks, true);
+    g_array_free(doc->source, true);
+    g_array_free(doc->output, true);
+    g_free(doc->start);
+    g_free(doc);
+}
+
+// The document of source, with its translation in *output
+static
+Document* document_new(Options* options, char* source, char** output) {
+    Blocks* parsed  = blockize(options, source);
+    guint n         = parsed->len;
+    Document* doc   = g_new0(Document, 1);
+    doc->blocks     = g_array_sized_new(false, false, sizeof(Block*), n);
+    doc->source     = g_array_sized_new(false, false, sizeof(gsize), n + 1);
+    doc->output     = g_array_sized_new(false, false, sizeof(gsize), n + 1);
+    g_array_set_size(doc->blocks, n);
+    g_array_set_size(doc->source, n + 1);
+    g_array_set_size(doc->output, n + 1);
+
+    Block** bs      = DOC_BLOCKS(doc);
+    gsize* src      = DOC_SOURCE(doc);
+    gsize* out      = DOC_OUTPUT(doc);
+    src[0]          = 0;
+    for(guint i = 0; i < n; ++i) {
+        bs[i]       = copy_block(blocks_at(parsed, i));
+        src[i + 1]  = src[i] + block_source_length(options, bs[i]);
+    }
+    blocks_free(parsed);
+
+    GString* body   = render_runs(options, bs, 0, n, out);
+    for(guint i = n; i > 0; --i) out[i] = out[i - 1];
+    out[0]          = 0;
+    for(guint i = 0; i < n; ++i) out[i + 1] += out[i];
+
+    doc->chugged    = leading_spaces(body->str, body->len);
+    doc->start      = runs_start(options, bs, 0, n);
+    *output         = options->toc  ? translate(options, source)
+                                    : g_strconcat(doc->start, body->str + doc->chugged, document_end(options), NULL);
+    doc->length     = strlen(*output);
+    g_string_free(body, true);
+    return doc;
+}
+
+// The source of the blocks [from, to)
+static
+GString* blocks_source(Options* options, Document* doc, guint from, guint to) {
+    GString* res = g_string_sized_new(DOC_SOURCE(doc)[to] - DOC_SOURCE(doc)[from]);
+    for(guint i = from; i < to; ++i) append_block_source(options, res, DOC_BLOCKS(doc)[i]);
+    return res;
+}
+
+// Applies the edit to the document. If the edited source doesn't parse, the document is left as it was and the
+// result is NULL, with the error in the Failure of the options.
+static
+Retranslation* document_edit(Options* options, Document* doc, Edit* edit) {
+    g_assert(options);
+    g_assert(doc);
+    g_assert(edit);
+    g_assert(edit->inserted);
+
+    guint n         = doc->blocks->len;
+    Block** old     = DOC_BLOCKS(doc);
+    gsize* off      = DOC_SOURCE(doc);
+    gsize* out      = DOC_OUTPUT(doc);
+
+    gsize margin    = max_delimiter_length(options);
+    gsize start     = edit->offset;
+    gsize end       = edit->offset + edit->deleted;
+    gssize delta    = (gssize) strlen(edit->inserted) - (gssize) edit->deleted;
+    g_assert(end <= off[n]);
+
+    // The last block starting before the margin, and the first one starting after the edit
+    guint lo = 0, hi = n;
+    while(lo + 1 < hi) {
+        guint m = (lo + hi) / 2;
+        if(off[m] <= (start > margin ? start - margin : 0)) lo = m;
+        else                                                hi = m;
+    }
+    guint first = lo;
+    guint last  = first + 1;
+    while(last < n && off[last] < end + margin) ++last;
+    last = MIN(last, n);
+
+    // What a region that doesn't parse leaves behind; without a Failure the error exits instead
+    GString* volatile region        = NULL;
+    TokenStream* volatile tokens    = NULL;
+    GQueue* volatile chunks         = NULL;
+    void free_region() {
+        if(chunks) g_queue_free_full(chunks, g_free);
+        token_stream_free(tokens);
+        if(region) g_string_free(region, true);
+        chunks  = NULL;
+        tokens  = NULL;
+        region  = NULL;
+    }
+    Failure exits;
+    Failure* failure    = options->failure ? options->failure : &exits;
+    if(setjmp(failure->jump)) {
+        free_region();
+        return NULL;
+    }
+
+    GQueue* mid     = NULL;
+    guint resume    = n;
+    GQueue* blockize_queue(char* source) {
+        tokens          = tokenize(options, source);
+        chunks          = g_queue_new();
+        parse(options, tokens, chunks);
+        Blocks* blocks  = flatten(options, tokens, chunks);
+        GQueue* res     = blocks_queue(blocks);
+        blocks_free(blocks);
+        return res;
+    }
+
+    while(!mid) {
+        region          = blocks_source(options, doc, first, last);
+        g_string_erase(region, start - off[first], edit->deleted);
+        g_string_insert_len(region, start - off[first], edit->inserted, -1);
+
+        // Walks the new tokens looking for a boundary that is also an old one after the edit
+        int state   = AtTop;
+        gsize pos   = 0;
+        guint m     = first + 1;
+        bool found  = false;
+        while(m < last && off[m] < end) ++m;
+
+        bool resyncs(int kind) {
+            bool boundary = state == AtTop || (state == InCode && kind == OpenComment);
+            while(m < last && off[m] + delta - off[first] < pos) ++m;
+
+            return  boundary && m < last && off[m] + delta - off[first] == pos &&
+                    pos + margin <= region->len && (state == AtTop || old[m]->kind == Narrative);
+        }
+
+        tokens      = tokenize(options, region->str);
+        for(gsize i = 0; i < tokens->len; ++i) {
+            int kind = tokens->kinds[i];
+            if((found = resyncs(kind))) break;
+
+            pos     = tokens->offsets[i] + tokens->lengths[i];
+            state   = kind == OpenComment                       ? InNarrative   :
+                      kind == CloseComment && state != InCode   ? AtTop         :
+                      kind == Text && state == AtTop            ? InCode        :
+                                                                  state;
+        }
+        token_stream_free(tokens);
+        tokens      = NULL;
+        found       = found || resyncs(-1);
+
+        if(found) {
+            g_string_truncate(region, pos);
+            mid     = blockize_queue(region->str);
+            resume  = m;
+        } else if(last == n) {
+            mid     = blockize_queue(region->str);
+            resume  = n;
+        } else
+            last    = MIN(n, last + (last - first));
+        free_region();
+    }
+
+    // The new blocks of the runs to render again: [from, first) and [resume, old_to) are old ones
+    guint from      = run_start(old, first);
+    guint old_to    = run_end(old, resume, n);
+    guint count     = g_queue_get_length(mid);
+    GPtrArray* win  = g_ptr_array_new();
+    for(guint i = from; i < first; ++i) g_ptr_array_add(win, old[i]);
+    for(GList* l = mid->head; l; l = l->next) g_ptr_array_add(win, l->data);
+    for(guint i = resume; i < old_to; ++i) g_ptr_array_add(win, old[i]);
+
+    gsize* lengths  = g_new(gsize, win->len + n - old_to);
+    GString* body   = render_runs(options, (Block**) win->pdata, 0, win->len, lengths);
+
+    // Among the spaces at the start of the body, up to the first run that isn't empty
+    bool leading    = out[from] <= doc->chugged;
+    while(leading && old_to < n && (leading_spaces(body->str, body->len) == body->len || out[old_to] < doc->chugged)) {
+        guint to    = run_end(old, old_to, n);
+        guint at    = win->len;
+        for(guint i = old_to; i < to; ++i) g_ptr_array_add(win, old[i]);
+        GString* more = render_runs(options, (Block**) win->pdata, at, win->len, lengths + at);
+        g_string_append_len(body, more->str, more->len);
+        g_string_free(more, true);
+        old_to      = to;
+    }
+
+    Retranslation* res  = g_new(Retranslation, 1);
+    gsize start_len     = strlen(doc->start);
+    gsize body_from     = out[from], body_to = out[old_to];
+    gsize spaces        = leading_spaces(body->str, body->len);
+    char* new_start     = leading ? runs_start(options, (Block**) win->pdata, 0, win->len) : NULL;
+    gsize chugged       = leading ? body_from + spaces : doc->chugged;
+
+    res->output_offset  = leading ? start_len : start_len + body_from - doc->chugged;
+    res->output_deleted = leading ? (body_to > doc->chugged ? body_to - doc->chugged : 0) : body_to - body_from;
+    res->output_inserted= g_strdup(body->str + (leading ? spaces : 0));
+    if(new_start && strcmp(new_start, doc->start)) {
+        char* body_only         = res->output_inserted;
+        res->output_deleted    += res->output_offset;
+        res->output_offset      = 0;
+        res->output_inserted    = g_strconcat(new_start, body_only, NULL);
+        g_free(body_only);
+    }
+
+    // The new blocks, with where they start in the source, and the runs with where they start in the body
+    gsize* src_mid      = g_new(gsize, count);
+    guint k             = 0;
+    for(GList* l = mid->head; l; l = l->next, ++k)
+        src_mid[k]      = (k ? src_mid[k - 1] + block_source_length(options, ((Block**) win->pdata)[first - from + k - 1])
+                             : off[first]);
+    gsize* out_win      = g_new(gsize, win->len);
+    for(guint i = 0; i < win->len; ++i) out_win[i] = (i ? out_win[i - 1] + lengths[i - 1] : body_from);
+    gssize out_delta    = (gssize) (body_from + body->len) - (gssize) body_to;
+
+    for(guint i = first; i < resume; ++i) free_block(old[i]);
+    g_array_remove_range(doc->blocks, first, resume - first);
+    g_array_insert_vals(doc->blocks, first, (Block**) win->pdata + (first - from), count);
+
+    g_array_remove_range(doc->source, first, resume - first);
+    g_array_insert_vals(doc->source, first, src_mid, count);
+    for(guint i = first + count; i < doc->source->len; ++i) DOC_SOURCE(doc)[i] += delta;
+
+    g_array_remove_range(doc->output, from, old_to - from);
+    g_array_insert_vals(doc->output, from, out_win, win->len);
+    for(guint i = from + win->len; i < doc->output->len; ++i) DOC_OUTPUT(doc)[i] += out_delta;
+
+    doc->chugged        = chugged;
+    if(new_start) {
+        g_free(doc->start);
+        doc->start      = new_start;
+    }
+
+    // A table of contents depends on all the document
+    if(options->toc) {
+        GString* src            = blocks_source(options, doc, 0, doc->blocks->len);
+        res->output_offset      = 0;
+        res->output_deleted     = doc->length;
+        g_free(res->output_inserted);
+        res->output_inserted    = translate(options, src->str);
+        g_string_free(src, true);
+    }
+    doc->length         = doc->length - res->output_deleted + strlen(res->output_inserted);
+
+    g_queue_free(mid);
+    g_ptr_array_free(win, true);
+    g_string_free(body, true);
+    g_free(lengths);
+    g_free(src_mid);
+    g_free(out_win);
+    return res;
+}
+
+/**
+Parsing the command line
+========================
+
+In glib there is a command line parser that accept options in unix-like format and automatically produces professional
+`--help` messages and such. We shoudl really have something like this in .NET. Pheraps we do and I'm not aware of it?
+**/
+
+#ifndef CLITE_LIBRARY
+
+// symbols is NULL when the narrative delimiters are given with -p and -c
+typedef struct Target { char* output_file; Options* options; LangSymbols* symbols; } Target;
+
+// A glob with a / matches the path from the root of the tree, otherwise the name
+typedef struct Glob { GPatternSpec* spec; bool path; } Glob;
+
+typedef struct TranslatedFile { char* input; char* output; GArray* headings; } TranslatedFile;
+
+typedef struct CmdOptions {
+    char**  input_files;
+    char**  output_files;   // of the main target, one for each input
+    GArray* targets;        // with -r, one for each language, without output files
+    bool    stream;
+    char*   index_file;
+    RenderCache* cache;     // kept in a file across runs
+    char*   tree;           // -r
+    char*   output_dir;
+    Glob*   includes;       // --include, ended by a NULL spec
+    Glob*   excludes;
+    GArray* translated;     // what -r or a batch translated, as TranslatedFile
+    bool    dependencies;   // -MD
+    char*   dependency_file;
+    GArray* diagnostics;    // with -k, the errors of all the inputs
+    GMutex  diagnostics_lock;
+    char*   diagnostics_file;
+} CmdOptions;
+
+static
+CmdOptions* parse_command_line(int argc, char* argv[]);
+
+static
+Options* options_new(const char*, const char*, const char*, int, const char*, const char*, Format, char**);
+
+static
+char* read_input(const char* file);
+
+static
+void write_output(const char* file, const char* text);
+
+static
+Glob* patterns(char** globs);
+
+static
+bool matches(Glob* globs, const char* path, const char* name);
+
+static
+void translate_tree(CmdOptions* opt);
+
+static
+void translate_batch(CmdOptions* opt);
+
+static
+void write_dependencies(CmdOptions* opt);
+
+static
+void append_rule(GString* out, Options* options, const char* output, char** inputs, guint n);
+
+static
+Jobserver* jobserver_from(const char* makeflags);
+
+static
+void jobserver_release(void);
+
+static char *no = NULL, *nc = NULL, *l = NULL, *co = NULL, *cc = NULL, *ou = NULL;
+static char** in_file;
+static char** target_specs;
+static char* tree = NULL;
+static gboolean dependencies = false;
+static char* dependency_file = NULL;
+static char** include_globs = NULL;
+static char** exclude_globs = NULL;
+
+static int ind = 0;
+static bool tests = false;
+static gboolean stream = false;
+static gboolean line_docs = false;
+static gboolean html = false, json = false, inline_css = false;
+static char* css = NULL;
+static gboolean toc = false;
+static char* index_file = NULL;
+static char* cache_file = NULL;
+static int cache_size = 256;
+static gboolean keep_going = false;
+static char* diagnostics_file = NULL;
 
 // this is a bug in gcc, fixed in 2.7.0 not to moan about the final NULL
 #pragma GCC diagnostic push
@@ -619,7 +4408,7 @@ static GOptionEntry entries[] =
   { "language"          , 'l', 0, G_OPTION_ARG_STRING, &l ,
                                 "Language used", "L"  },
   { "output"            , 'o', 0, G_OPTION_ARG_FILENAME, &ou,
-                                "Defaults to the input file name with mkd extension", "FILE" },
+                                "Defaults to the input file name with mkd extension, with -r a directory", "FILE" },
   { "narrative-open"    , 'p', 0, G_OPTION_ARG_STRING, &no,
                                 "String opening a narrative comment",   "NO" },
   { "narrative-close"   , 'c', 0, G_OPTION_ARG_STRING, &nc,
@@ -628,12 +4417,49 @@ static GOptionEntry entries[] =
                                 "String opening a code block",          "CO" },
   { "code-close"        , 'C', 0, G_OPTION_ARG_STRING, &cc,
                                 "String closing a code block",          "CC" },
+  { "line-docs"         , 'd', 0, G_OPTION_ARG_NONE,   &line_docs,
+                                "Line doc comments of the language are narrative too", NULL },
   { "indent"            , 'i', 0, G_OPTION_ARG_INT,    &ind,
                                 "Indent the code by N whitespaces",    "N"  },
+  { "html"              , 'H', 0, G_OPTION_ARG_NONE,   &html,
+                                "Write HTML5 instead of markdown", NULL },
+  { "json"              , 'J', 0, G_OPTION_ARG_NONE,   &json,
+                                "Write the pandoc JSON AST instead of markdown", NULL },
+  { "css"               ,   0, 0, G_OPTION_ARG_FILENAME, &css,
+                                "Stylesheet linked by the HTML output", "FILE" },
+  { "inline-css"        ,   0, 0, G_OPTION_ARG_NONE,   &inline_css,
+                                "Copy the stylesheet inside the HTML output", NULL },
+  { "target"            , 'T', 0, G_OPTION_ARG_STRING_ARRAY, &target_specs,
+                                "Also write FILE, with KIND indent:N, code:CO:CC, html or json", "KIND=FILE" },
+  { "stream"            , 's', 0, G_OPTION_ARG_NONE,   &stream,
+                                "Translate while reading the input, on separate threads", NULL },
   { "run-tests"         , 't', G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE,   &tests,
                                 "Run all the testcases", NULL },
+  { "toc"               ,   0, 0, G_OPTION_ARG_NONE,   &toc,
+                                "Start with a table of contents", NULL },
+  { "index"             ,   0, 0, G_OPTION_ARG_FILENAME, &index_file,
+                                "Write an index of the headings of all the inputs", "FILE" },
+  { "recursive"         , 'r', 0, G_OPTION_ARG_FILENAME, &tree,
+                                "Translate the files in the tree under DIR, each with the language of its extension",
+                                "DIR" },
+  { "include"           ,   0, 0, G_OPTION_ARG_STRING_ARRAY, &include_globs,
+                                "With -r, translate the files matching GLOB", "GLOB" },
+  { "exclude"           ,   0, 0, G_OPTION_ARG_STRING_ARRAY, &exclude_globs,
+                                "With -r, skip the files and directories matching GLOB", "GLOB" },
+  { "MD"                ,   0, 0, G_OPTION_ARG_NONE,   &dependencies,
+                                "Also write the inputs of each output as a make rule, in OUTPUT.d", NULL },
+  { "MF"                ,   0, 0, G_OPTION_ARG_FILENAME, &dependency_file,
+                                "Write all the make rules of -MD in FILE", "FILE" },
+  { "cache"             ,   0, 0, G_OPTION_ARG_FILENAME, &cache_file,
+                                "Keep the tagged blocks in FILE for the next runs", "FILE" },
+  { "cache-size"        ,   0, 0, G_OPTION_ARG_INT,    &cache_size,
+                                "Maximum size of the cache file, in MB (256)", "MB" },
+  { "keep-going"        , 'k', 0, G_OPTION_ARG_NONE,   &keep_going,
+                                "Report all the errors of all the inputs, translating the ones without errors", NULL },
+  { "diagnostics"       ,   0, 0, G_OPTION_ARG_FILENAME, &diagnostics_file,
+                                "With -k, also write the errors in FILE as JSON", "FILE" },
   { G_OPTION_REMAINING  ,   0, 0, G_OPTION_ARG_FILENAME_ARRAY, &in_file,
-                                "Input file to process",   "FILE" },
+                                "Input files to process",   "FILE..." },
   { NULL }
 };
 #pragma GCC diagnostic pop
@@ -652,6 +4478,100 @@ Here is my big ass command parsing function. It could use a bit of refactoring .
 
 void destroy_arena_allocator();
 
+/**
+More outputs of the same input are asked with `-T KIND=FILE`, where KIND is `indent:N`, `code:CO:CC`, `html` or
+`json`. They share the language and the narrative options, and the input is parsed once for all of them.
+**/
+
+static
+Target parse_target(const char* spec) {
+    const char* eq  = strchr(spec, '=');
+    if(!eq || eq == spec || !eq[1]) report_error("A target is KIND=FILE, not %s", spec);
+
+    char* kind      = g_strndup(spec, eq - spec);
+    char** parts    = g_strsplit(kind, ":", 3);
+    guint n         = g_strv_length(parts);
+    char* message   = NULL;
+    Options* options=
+        !strcmp(parts[0], "indent") && n == 2   ?
+            options_new(l, no, nc, atoi(parts[1]), NULL, NULL, FormatMarkdown, &message)    :
+        !strcmp(parts[0], "code") && n == 3     ?
+            options_new(l, no, nc, 0, parts[1], parts[2], FormatMarkdown, &message)         :
+        !strcmp(parts[0], "html") && n == 1     ?
+            options_new(l, no, nc, 0, NULL, NULL, FormatHtml, &message)                     :
+        !strcmp(parts[0], "json") && n == 1     ?
+            options_new(l, no, nc, 0, NULL, NULL, FormatJson, &message)                     :
+            report_error_e("%s is not a target kind, use indent:N, code:CO:CC, html or json", kind);
+    if(!options) report_error("%s", message);
+
+    g_strfreev(parts);
+    g_free(kind);
+    return (Target) {.output_file = g_strdup(eq + 1), .options = options,
+                     .symbols = l ? lang_find_symbols(s_lang_params_table, l) : NULL};
+}
+
+static
+bool is_gz(const char* file) { return g_str_has_suffix(file, ".gz"); }
+
+// The input file without extension, with extension .mkd (assume markdown), .html or .json
+// A compressed input gives a compressed output
+static
+char* default_output(const char* input, Options* options) {
+    int kind          = options->code_symbols->kind;
+    char* out_ext     = kind == Html ? ".html" : kind == Json ? ".json" : ".mkd";
+    char* output      = g_strdup(input);
+    char* gz          = is_gz(output) ? output + strlen(output) - 3 : NULL;
+    if(gz) *gz        = '\0';
+    char* extension   = g_strrstr(output, ".");
+    char* slash       = strrchr(output, '/');
+    if(extension && (!slash || extension > slash)) *extension = '\0';
+    char* res         = g_strjoin("", output, out_ext, gz ? ".gz" : "", NULL);
+    g_free(output);
+    return res;
+}
+
+static
+Glob* patterns(char** globs) {
+    guint n             = globs ? g_strv_length(globs) : 0;
+    Glob* res           = g_new0(Glob, n + 1);
+    for(guint i = 0; i < n; ++i) res[i] = (Glob) {g_pattern_spec_new(globs[i]), strchr(globs[i], '/')};
+    return res;
+}
+
+// The targets of the input files
+static
+void parse_inputs(CmdOptions* opt, Format format) {
+    guint inputs        = g_strv_length(in_file);
+    opt->input_files    = in_file;
+    opt->stream         = stream;
+    opt->index_file     = index_file;
+
+    if(inputs > 1 && (ou || target_specs || stream))    report_error("-o, -T and -s need a single input");
+    if(index_file && (target_specs || stream))          report_error("--index can't be used with -T or -s");
+    if(toc && stream) report_error("-s can't write the table of contents before it reads the whole input");
+
+    char* message       = NULL;
+    // With just -T targets there is no main output
+    if(!target_specs || ind || co || cc || html || json || ou) {
+        Target main     = {.options = options_new(l, no, nc, ind, co, cc, format, &message),
+                           .symbols = l ? lang_find_symbols(s_lang_params_table, l) : NULL};
+        if(!main.options) report_error("%s", message);
+        main.output_file        = ou ? ou : default_output(*in_file, main.options);
+
+        opt->output_files       = g_new0(char*, inputs + 1);
+        for(guint i = 1; i < inputs; ++i) opt->output_files[i] = default_output(in_file[i], main.options);
+        g_array_append_val(opt->targets, main);
+    }
+
+    for(char** spec = target_specs; spec && *spec; ++spec) {
+        Target target = parse_target(*spec);
+        g_array_append_val(opt->targets, target);
+    }
+    if(stream && opt->targets->len > 1) report_error("-s writes a single output, it can't be used with -T");
+    if(!opt->output_files) opt->output_files = g_new0(char*, 2);
+    opt->output_files[0] = g_array_index(opt->targets, Target, 0).output_file;
+}
+
 static
 CmdOptions* parse_command_line(int argc, char* argv[]) {
 
@@ -663,11 +4583,25 @@ CmdOptions* parse_command_line(int argc, char* argv[]) {
     g_option_context_add_main_entries (context, entries, NULL);
     g_option_context_set_summary(context, summary(s_lang_params_table));
 
+    #ifndef NDEBUG
+    // The options after a leading -t, as -m perf, are for g_test_init
+    if(argc > 1 && (!strcmp(argv[1], "-t") || !strcmp(argv[1], "--run-tests"))) {
+        argv[1] = argv[0];
+        exit(run_tests(argc - 1, argv + 1));
+    }
+    #endif
+
+    // -MD and -MF are spelled as in gcc
+    for(int i = 1; i < argc; ++i)
+        if(!strcmp(argv[i], "-MD") || !strncmp(argv[i], "-MF", 3)) {
+            char* arg   = argv[i];
+            argv[i]     = !strcmp(arg, "-MD") ? "--MD" : arg[3] ? g_strconcat("--MF=", arg + 3, NULL) : "--MF";
+        }
+
     if (!g_option_context_parse (context, &argc, &argv, &error))
         report_error("option parsing failed: %s", error->message);
 
-    CmdOptions* opt = g_new(CmdOptions, 1);
-    opt->options = g_new(Options, 1);
+    CmdOptions* opt = g_new0(CmdOptions, 1);
 
     #ifndef NDEBUG
     if(tests) {
@@ -676,57 +4610,893 @@ CmdOptions* parse_command_line(int argc, char* argv[]) {
     }
     #endif
 
-    if(!in_file) report_error("No input file");
-    opt->input_file = *in_file;
+    if(!cache_file && cache_size != 256) report_error("--cache-size needs --cache");
+    opt->dependencies       = dependencies || dependency_file;
+    opt->dependency_file    = dependency_file;
+    if(html && json) report_error("-H and -J can't be used together");
+    if(diagnostics_file && !keep_going) report_error("--diagnostics needs -k");
+    if(keep_going && stream) report_error("-k needs the whole input, it can't be used with -s");
+    opt->diagnostics        = keep_going ? g_array_new(false, false, sizeof(Diagnostic)) : NULL;
+    opt->diagnostics_file   = diagnostics_file;
+    if(!tree && (include_globs || exclude_globs)) report_error("--include and --exclude need -r");
+
+    opt->targets        = g_array_new(false, false, sizeof(Target));
+    char* message       = NULL;
+    Format format       = html ? FormatHtml : json ? FormatJson : FormatMarkdown;
+
+    if(tree) {
+        if(in_file || target_specs || stream)   report_error("-r translates a tree, without input files, -T or -s");
+        if(!l && (no || nc) && !include_globs)  report_error("-r with -p and -c needs --include");
+        opt->tree           = tree;
+        opt->output_dir     = ou;
+        opt->index_file     = index_file;
+        opt->includes       = patterns(include_globs);
+        opt->excludes       = patterns(exclude_globs);
+
+        // -l, or -p and -c, are for all the files, otherwise each language has its target
+        void add(const char* lang, LangSymbols* symbols) {
+            Target target   = {.options = options_new(lang, no, nc, ind, co, cc, format, &message), .symbols = symbols};
+            if(!target.options) report_error("%s", message);
+            g_array_append_val(opt->targets, target);
+        }
+        if(l || no || nc)   add(l, l ? lang_find_symbols(s_lang_params_table, l) : NULL);
+        else                for(LangSymbols** s = s_lang_params_table; *s; ++s) add((*s)->language, *s);
+    }
+    else if(!in_file) report_error("No input file");
+    else parse_inputs(opt, format);
+
+    char* text          = NULL;
+    bool has_html       = false;
+    if(css || inline_css) {
+        if(!css)    report_error("--inline-css needs --css");
+
+        GError* error   = NULL;
+        if(inline_css && !g_file_get_contents(css, &text, NULL, &error)) report_error("%s", error->message);
+    }
+    for(guint i = 0; i < opt->targets->len; ++i) {
+        Target* target   = &g_array_index(opt->targets, Target, i);
+        Options* options = target->options;
+        options->toc     = toc;
+
+        if(options->code_symbols->kind == Html) {
+            has_html = true;
+            options->code_symbols->Html.css_href = css && !inline_css ? g_strdup(css) : NULL;
+            options->code_symbols->Html.css_text = g_strdup(text);
+        }
+        if(line_docs && !target->symbols) report_error("-d needs -l");
+        if(line_docs && !options_add_pair(options, target->symbols->line, NL, &message)) report_error("%s", message);
+    }
+    if((css || inline_css) && !has_html) report_error("--css and --inline-css need an HTML output");
+
+    if(cache_size < 1) report_error("--cache-size must be at least 1 MB");
+    opt->cache          = cache_file ? cache_open(cache_file, (gsize) cache_size << 20) : NULL;
+    for(guint i = 0; i < opt->targets->len; ++i) g_array_index(opt->targets, Target, i).options->cache = opt->cache;
+
+    return opt;
+}
+
+#endif
+
+#ifndef CLITE_LIBRARY
+
+static
+gsize read_file(char* buf, gsize size, gpointer file) {
+    return fread(buf, 1, size, file);
+}
+
+static
+void write_file(const char* buf, gsize size, gpointer file) {
+    if(fwrite(buf, 1, size, file) != size) report_error("Cannot write the output file");
+}
+
+/**
+A file ending in `.gz` is read, or written, through zlib, a buffer at the time, and never uncompressed on disk. When
+there is just one output, and no table of contents, that means translating while reading, as with `-s`, so the input
+isn't in memory all at once either.
+**/
+
+static
+gzFile open_gz(const char* file, const char* mode) {
+    gzFile gz = gzopen(file, mode);
+    if(!gz) report_error("Cannot open %s", file);
+    gzbuffer(gz, 1 << 17);
+    return gz;
+}
+
+static
+gsize read_gz(char* buf, gsize size, gpointer gz) {
+    int n = gzread(gz, buf, (unsigned) MIN(size, (gsize) G_MAXINT));
+    if(n < 0) report_error("Cannot read the compressed input");
+    return n;
+}
+
+static
+void write_gz(const char* buf, gsize size, gpointer gz) {
+    if(size && gzwrite(gz, buf, (unsigned) size) != (int) size) report_error("Cannot write the compressed output");
+}
+
+/**
+When streaming the file is not in memory, and it can be a pipe that can't go back, so the bytes read to look for
+the prelude and that are after it are kept in a `Prelude`. A UTF-8 stream gets them at its first read, while a
+`Transcoder` starts with them as a code unit cut at the end of its last read.
+**/
+
+typedef struct Prelude {
+    ReadFunc    read;
+    gpointer    reader;
+    guchar      rest[4];
+    gsize       len;
+} Prelude;
 
-    // Uses input file without extension, adding extension .mkd (assume markdown)
-    opt->output_file = ou ? ou :  ({
-                                  char* output      = g_strdup(*in_file);
-                                  char* extension   = g_strrstr(output, ".");
-                                  extension ? ({
-                                               *extension = '\0';
-                                               g_strjoin("", output, ".mkd", NULL);
-                                                }) :
-                                               g_strjoin("", output, ".mkd", NULL);
-                                  });
+static
+Encoding read_prelude(Prelude* p) {
+    guchar b[4];
+    gsize n = 0, r;
+    while(n < sizeof(b) && (r = p->read((char*) b + n, sizeof(b) - n, p->reader))) n += r;
+
+    Encoding encoding;
+    gsize bom   = find_bom(b, n, &encoding);
+    p->len      = n - bom;
+    memcpy(p->rest, b + bom, p->len);
+    return encoding;
+}
+
+static
+gsize read_after_prelude(char* buf, gsize size, gpointer reader) {
+    Prelude* p  = reader;
+    if(!p->len) return p->read(buf, size, p->reader);
+
+    gsize n     = MIN(size, p->len);
+    memcpy(buf, p->rest, n);
+    memmove(p->rest, p->rest + n, p->len - n);
+    p->len     -= n;
+    return n;
+}
+
+static
+void close_gz(gzFile gz, const char* file) {
+    if(gzclose(gz) != Z_OK) report_error("Cannot write %s", file);
+}
 
-    if(l) { // user passed a language
-        LangSymbols* lang = lang_find_symbols(s_lang_params_table, l);
-        if(!lang) report_error("%s is not a supported language", l);
+static
+char* read_input(const char* file) {
+    char* source    = NULL;
+    gsize len       = 0;
+    GError* error   = NULL;
+    if(is_gz(file)) {
+        gzFile gz       = open_gz(file, "rb");
+        GString* text   = g_string_new(NULL);
+        gsize n         = 0;
+        do {
+            g_string_set_size(text, text->len + (1 << 17));
+            n           = read_gz(text->str + text->len - (1 << 17), 1 << 17, gz);
+            g_string_set_size(text, text->len - (1 << 17) + n);
+        } while(n);
+        gzclose(gz);
+        len             = text->len;
+        source          = g_string_free(text, false);
+    }
+    else if(!g_file_get_contents(file, &source, &len, &error)) report_error("%s", error->message);
 
-        opt->options->start_narrative  = lang->start;
-        opt->options->end_narrative    = lang->end;
+    return to_utf8(source, len);
+}
+
+static
+void write_output(const char* file, const char* text) {
+    GError* error   = NULL;
+    if(is_gz(file)) {
+        gzFile gz   = open_gz(file, "wb");
+        write_gz(text, strlen(text), gz);
+        close_gz(gz, file);
+    }
+    else if(!g_file_set_contents(file, text, -1, &error)) report_error("%s", error->message);
+}
 
-    } else {
-        if(!no || !nc) report_error("You need to specify either -l, or both -p and -c");
+/**
+make passes its jobserver in `MAKEFLAGS`: as `--jobserver-auth=R,W` (`--jobserver-fds=R,W` before make 4.2), the two
+descriptors of a pipe, or as `--jobserver-auth=fifo:PATH` from make 4.4. Only the commands that make knows to be
+recursive inherit the pipe, so a rule calls clite as `+clite ...`, and for the others the descriptors can be closed or
+be other files, so they are used only if they are pipes. The read end is opened again through /proc, to make
+it nonblocking without changing it for make and the other processes. When MAKEFLAGS names a jobserver that clite
+can't use, it keeps to the token it was started with, and to one worker.
+**/
 
-        opt->options->start_narrative  = no;
-        opt->options->end_narrative    = nc;
+// NULL without a jobserver, read is -1 when there is one that can't be used
+static
+Jobserver* jobserver_from(const char* makeflags) {
+    if(!makeflags) return NULL;
+
+    char** words        = g_strsplit(makeflags, " ", -1);
+    const char* auth    = NULL;
+    for(char** w = words; *w; ++w)
+        if(g_str_has_prefix(*w, "--jobserver-auth=") || g_str_has_prefix(*w, "--jobserver-fds="))
+            auth = strchr(*w, '=') + 1;
+
+    Jobserver* js       = auth ? g_new(Jobserver, 1) : NULL;
+    if(js) *js          = (Jobserver) {.read = -1, .write = -1, .held = g_string_new("")};
+
+#ifdef G_OS_UNIX
+    bool is_fifo(int fd) {
+        struct stat st;
+        return fd >= 0 && !fstat(fd, &st) && S_ISFIFO(st.st_mode);
     }
 
-    if(ind) { // user pass    g_option_context_free();
-        opt->options->code_symbols = union_new(CodeSymbols, Indented, .indentation = ind);
-    } else {
-        if(!co || !cc) report_error("You need to specify either -indent, or both -P and -C");
-        opt->options->code_symbols =
-            union_new(CodeSymbols, Surrounded, .start_code = co, .end_code = cc);
+    int r, w;
+    if(auth && g_str_has_prefix(auth, "fifo:")) {
+        js->read = js->write = open(auth + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if(js->read >= 0 && !is_fifo(js->read)) {
+            close(js->read);
+            js->read = js->write = -1;
+        }
+    }
+    else if(auth && sscanf(auth, "%d,%d", &r, &w) == 2 && is_fifo(r) && is_fifo(w)) {
+        char* path      = g_strdup_printf("/proc/self/fd/%d", r);
+        js->read        = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        js->write       = js->read >= 0 ? w : -1;
+        g_free(path);
     }
+#endif
 
-    return opt;
+    g_strfreev(words);
+    return js;
 }
+
+// At exit, gives back the tokens of the workers that are still running
+static
+void jobserver_release(void) {
+    Jobserver* js = s_jobserver;
+    while(js && js->held && jobserver_give(js, true));
+}
+
+// The outputs are written already, so a cache that can't be saved is just a warning
+static
+void save_cache(RenderCache* cache) {
+    char* message = NULL;
+    if(cache && !cache_save(cache, &message)) g_printerr("%s\n", message);
+}
+
 /**
-Some windows programs (i.e. notepad, VS, ...) add a 3 bytes prelude to their utf-8 files, C doesn't know
-anything about it, so you need to strip it. On this topic, I suspect the program works on UTF-8 files
-that contain non-ASCII chars, even if when I wrote it I didn't know anything about localization.
+With `-k` a run doesn't stop at the first error. Each input is checked first, and one with errors is not translated,
+so that its output isn't written half way. The errors of all the inputs are printed at the end sorted by file, line
+and column, each as `FILE:LINE:COLUMN: error: MESSAGE`, which is what the CI tools know how to read, followed by its
+line. They go to stderr, as the outputs can go to stdout. With `--diagnostics` they are written as a JSON array as
+well. The run fails if there is any. An input with errors has no output, so it isn't in the index, nor in the rules
+of `-MD`. The tokens that are checked are the ones that are translated, so an input is tokenized once.
+**/
 
-It should work because I'm just splitting the file when I see a certain ASCII string and in UTF-8 ASCII chars
-cannot appear anywhere else than in their ASCII position.
+// The tokens of source, or NULL if it has errors, which are added to the ones of the run
+static
+TokenStream* check_input(CmdOptions* opt, Options* options, const char* input, char* source) {
+    TokenStream* tokens = tokenize(options, source);
+    if(!opt->diagnostics) return tokens;
+
+    GArray* found       = g_array_new(false, false, sizeof(Diagnostic));
+    bool ok             = !diagnose(tokens, input, found);
+    if(!ok) {
+        token_stream_free(tokens);
+        tokens          = NULL;
+    }
+
+    g_mutex_lock(&opt->diagnostics_lock);
+    g_array_append_vals(opt->diagnostics, found->data, found->len);
+    g_mutex_unlock(&opt->diagnostics_lock);
+    g_array_free(found, true);
+    return tokens;
+}
+
+// The exit code of the run
+static
+int report_diagnostics(CmdOptions* opt) {
+    GArray* all = opt->diagnostics;
+    if(!all) return 0;
+
+    g_array_sort(all, compare_diagnostics);
+    GString* json   = g_string_new("[");
+    guint files     = 0;
+    for(guint i = 0; i < all->len; ++i) {
+        Diagnostic* d = &g_array_index(all, Diagnostic, i);
+        g_printerr("%s:%i:%i: error: %s\n%s\n", d->file, d->line, d->column, d->message, d->excerpt);
+        files        += !i || strcmp(d->file, g_array_index(all, Diagnostic, i - 1).file);
+
+        g_string_append(json_string(g_string_append(json, i ? ",\n{\"file\":" : "\n{\"file\":"), d->file, strlen(d->file)),
+                        ",\"message\":");
+        g_string_append_printf(json_string(json, d->message, strlen(d->message)), ",\"line\":%i,\"column\":%i}",
+                               d->line, d->column);
+    }
+    if(all->len) g_printerr("%u errors in %u files\n", all->len, files);
+    if(opt->diagnostics_file) write_output(opt->diagnostics_file, g_string_append(json, all->len ? "\n]\n" : "]\n")->str);
+
+    int res = all->len ? 1 : 0;
+    for(guint i = 0; i < all->len; ++i) free_diagnostic(&g_array_index(all, Diagnostic, i));
+    g_string_free(json, true);
+    return res;
+}
+
+/**
+More input files are translated by all the cores, each file by the first worker that is free, with the options of
+the main output. With `--index` their headings are kept for the index, which links all of them.
+**/
+
+// The index of the translated files, with the options of the main output
+static
+void write_index(CmdOptions* opt) {
+    GArray* files       = opt->translated;
+    guint n             = files->len;
+    char** inputs       = g_new(char*, n);
+    char** outputs      = g_new(char*, n);
+    GArray** headings   = g_new(GArray*, n);
+    for(guint i = 0; i < n; ++i) {
+        TranslatedFile* file    = &g_array_index(files, TranslatedFile, i);
+        inputs[i]               = file->input;
+        outputs[i]              = file->output;
+        headings[i]             = file->headings;
+    }
+    write_output(opt->index_file, index_document(g_array_index(opt->targets, Target, 0).options,
+                                                 inputs, outputs, headings, n, opt->index_file));
+    g_free(inputs);
+    g_free(outputs);
+    g_free(headings);
+}
+
+static
+void translate_batch(CmdOptions* opt) {
+    Options* options    = g_array_index(opt->targets, Target, 0).options;
+    guint n             = g_strv_length(opt->input_files);
+    TranslatedFile* all = g_new0(TranslatedFile, n);
+    guint next          = 0;
+
+    // An input with errors is left with a NULL output
+    void work(G_GNUC_UNUSED int worker) {
+        for(guint i; (i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < n;) {
+            char* source        = read_input(opt->input_files[i]);
+            TokenStream* tokens = check_input(opt, options, opt->input_files[i], source);
+            all[i]              = (TranslatedFile) {.input = opt->input_files[i],
+                                                    .output = tokens ? opt->output_files[i] : NULL};
+            if(tokens)
+                write_output(all[i].output, translate_tokens(options, tokens, opt->index_file ? &all[i].headings : NULL));
+            g_free(source);
+        }
+    }
+    bool more() { return __atomic_load_n(&next, __ATOMIC_RELAXED) < n; }
+    parallel_jobs(MIN(n, (guint) g_get_num_processors()), more, work);
+
+    opt->translated     = g_array_new(false, false, sizeof(TranslatedFile));
+    for(guint i = 0; i < n; ++i) if(all[i].output) g_array_append_val(opt->translated, all[i]);
+    g_free(all);
+    if(opt->index_file) write_index(opt);
+}
+
+/**
+With `-r DIR` the files of a tree are translated, each with the language of its extension, and the outputs are put
+in the same places of the tree under the `-o` directory, or next to the inputs. The files are the ones of a known
+language, or the ones matching an `--include`, less the ones, and the directories, matching an `--exclude`. A
+pattern with a `/` is matched with the path from DIR, otherwise with the name.
+
+All the cores walk the tree, instead of a process for each file. A worker takes the next directory or file from a
+queue, and puts in it what it finds in a directory. When the queue is empty and no worker is busy, the walk is over.
+Without a table of contents, an index or `-k`, a file is translated as the library does, freeing what it uses, so that the
+memory doesn't grow with the size of the tree.
+Links to directories aren't followed, so a tree with a loop is walked once.
+**/
+
+static
+bool translate_buffer(const Options*, const char*, gsize, WriteFunc, gpointer, Failure*);
+
+#if GLIB_CHECK_VERSION(2, 70, 0)
+#define pattern_match g_pattern_spec_match_string
+#else
+#define pattern_match g_pattern_match_string
+#endif
+
+static
+bool matches(Glob* globs, const char* path, const char* name) {
+    for(Glob* g = globs; g->spec; ++g)
+        if(pattern_match(g->spec, g->path ? path : name)) return true;
+    return false;
+}
+
+static
+gint compare_translated(gconstpointer a, gconstpointer b) {
+    return strcmp(((const TranslatedFile*) a)->input, ((const TranslatedFile*) b)->input);
+}
+
+// The target of a file, or NULL if it isn't translated
+static
+Target* tree_target(CmdOptions* opt, const char* path, const char* name) {
+    GArray* targets     = opt->targets;
+    LangSymbols* lang   = lang_find_extension(s_lang_params_table, name);
+    Target* forced      = targets->len == 1 ? &g_array_index(targets, Target, 0) : NULL;
+
+    if(matches(opt->excludes, path, name))                                      return NULL;
+    if(opt->includes->spec ? !matches(opt->includes, path, name)
+                           : !lang || (forced && forced->symbols != lang))      return NULL;
+    if(forced) return forced;
+
+    for(guint i = 0; lang && i < targets->len; ++i)
+        if(g_array_index(targets, Target, i).symbols == lang) return &g_array_index(targets, Target, i);
+    return NULL;
+}
+
+static
+void translate_tree(CmdOptions* opt) {
+    GQueue* todo        = g_queue_new();
+    GArray* done        = opt->translated = g_array_new(false, false, sizeof(TranslatedFile));
+    GMutex lock;
+    GCond changed;
+    int busy            = 0;
+    bool over           = false;
+    g_mutex_init(&lock);
+    g_cond_init(&changed);
+    g_queue_push_tail(todo, g_strdup(""));
+
+    // path is from the root of the tree, directories end with a /
+    void visit(char* path) {
+        char* input             = g_build_filename(opt->tree, path, NULL);
+        if(g_str_has_suffix(path, "/") || !*path) {
+            GError* error       = NULL;
+            GDir* dir           = g_dir_open(input, 0, &error);
+            if(!dir) report_error("%s", error->message);
+
+            GQueue* found       = g_queue_new();
+            for(const char* name; (name = g_dir_read_name(dir));) {
+                char* child     = g_strconcat(path, name, NULL);
+                char* full      = g_build_filename(opt->tree, child, NULL);
+                bool is_dir     = g_file_test(full, G_FILE_TEST_IS_DIR);
+                bool is_link    = g_file_test(full, G_FILE_TEST_IS_SYMLINK);
+                g_free(full);
+
+                if(is_dir && !is_link && !matches(opt->excludes, child, name))
+                    g_queue_push_tail(found, g_strconcat(child, "/", NULL));
+                else if(!is_dir && tree_target(opt, child, name))
+                    g_queue_push_tail(found, g_strdup(child));
+                g_free(child);
+            }
+            g_dir_close(dir);
+
+            g_mutex_lock(&lock);
+            g_queue_splice(todo, found);
+            g_cond_broadcast(&changed);
+            g_mutex_unlock(&lock);
+        }
+        else {
+            char* name          = g_path_get_basename(path);
+            Target* target      = tree_target(opt, path, name);
+            char* relative      = default_output(path, target->options);
+            char* output        = g_build_filename(opt->output_dir ? opt->output_dir : opt->tree, relative, NULL);
+            char* dir           = g_path_get_dirname(output);
+            if(g_mkdir_with_parents(dir, 0777)) report_error("Cannot create the directory %s", dir);
+
+            TranslatedFile file = {.input = input, .output = output, .headings = NULL};
+            char* source        = read_input(input);
+            bool whole          = target->options->toc || opt->index_file || opt->diagnostics;
+            TokenStream* tokens = whole ? check_input(opt, target->options, input, source) : NULL;
+            bool ok             = !whole || tokens;
+            if(!ok) g_free(output);
+            else if(whole)
+                write_output(output, translate_tokens(target->options, tokens, opt->index_file ? &file.headings : NULL));
+            else {
+                GString* text   = g_string_sized_new(strlen(source) * 2);
+                void append(const char* buf, gsize size, gpointer s) { g_string_append_len(s, buf, size); }
+                Failure failure = {.line = 0, .message = NULL};
+                if(!translate_buffer(target->options, source, strlen(source), append, text, &failure))
+                    report_error("%s: %s", input, failure.message);
+                write_output(output, text->str);
+                g_string_free(text, true);
+            }
+            g_free(source);
+            input               = ok ? NULL : input;
+            g_free(dir);
+            g_free(relative);
+            g_free(name);
+
+            g_mutex_lock(&lock);
+            if(ok) g_array_append_val(done, file);
+            g_mutex_unlock(&lock);
+        }
+        g_free(input);
+        g_free(path);
+    }
+
+    void work(G_GNUC_UNUSED int worker) {
+        g_mutex_lock(&lock);
+        for(;;) {
+            while(g_queue_is_empty(todo) && busy) g_cond_wait(&changed, &lock);
+            if(g_queue_is_empty(todo)) {
+                __atomic_store_n(&over, true, __ATOMIC_RELAXED);
+                break;
+            }
+
+            char* path = g_queue_pop_head(todo);
+            ++busy;
+            g_mutex_unlock(&lock);
+            visit(path);
+            g_mutex_lock(&lock);
+            --busy;
+            g_cond_broadcast(&changed);
+        }
+        g_mutex_unlock(&lock);
+    }
+    bool more() { return !__atomic_load_n(&over, __ATOMIC_RELAXED); }
+    parallel_jobs(g_get_num_processors(), more, work);
+    g_array_sort(done, compare_translated);
+    if(opt->index_file) write_index(opt);
+
+    g_queue_free(todo);
+    g_cond_clear(&changed);
+    g_mutex_clear(&lock);
+}
+
+
+/**
+With `-MD` clite also writes what each output is made of, as a rule for make (ninja reads them too), so that a build
+runs clite again only when one of those files changes. The rules go in the file of `-MF`, or next to each output with
+`.d` added to its name. The inputs of an output are its source, the stylesheet copied in the page by `--inline-css`,
+and for an index all the sources. A new file in a tree of `-r` isn't in any rule, so that still needs a new run.
+**/
+
+static
+void append_make_path(GString* out, const char* path) {
+    for(const char* p = path; *p; ++p)
+        if(*p == '$')                   g_string_append(out, "$$");
+        else if(*p == ' ' || *p == '#') g_string_append_c(g_string_append_c(out, '\\'), *p);
+        else                            g_string_append_c(out, *p);
+}
+
+static
+void append_rule(GString* out, Options* options, const char* output, char** inputs, guint n) {
+    append_make_path(out, output);
+    g_string_append_c(out, ':');
+    for(guint i = 0; i < n; ++i) {
+        g_string_append(out, i ? " \\\n  " : " ");
+        append_make_path(out, inputs[i]);
+    }
+    if(inline_css && options->code_symbols->kind == Html) {
+        g_string_append(out, n ? " \\\n  " : " ");
+        append_make_path(out, css);
+    }
+    g_string_append_c(out, '\n');
+}
+
+static
+void write_dependencies(CmdOptions* opt) {
+    if(!opt->dependencies) return;
+
+    GString* all        = g_string_new(NULL);
+    void rule(Options* options, const char* output, char** inputs, guint n) {
+        GString* out    = opt->dependency_file ? all : g_string_new(NULL);
+        append_rule(out, options, output, inputs, n);
+        if(opt->dependency_file) return;
+
+        char* file      = g_strconcat(output, ".d", NULL);
+        write_output(file, out->str);
+        g_free(file);
+        g_string_free(out, true);
+    }
+
+    Options* main       = g_array_index(opt->targets, Target, 0).options;
+    GPtrArray* sources  = g_ptr_array_new();
+    if(opt->translated) {
+        for(guint i = 0; i < opt->translated->len; ++i) {
+            TranslatedFile* file    = &g_array_index(opt->translated, TranslatedFile, i);
+            rule(main, file->output, &file->input, 1);
+            g_ptr_array_add(sources, file->input);
+        }
+    }
+    else
+        for(guint i = 0; i < opt->targets->len; ++i) {
+            Target* target  = &g_array_index(opt->targets, Target, i);
+            rule(target->options, target->output_file, opt->input_files, 1);
+        }
+    if(opt->index_file) rule(main, opt->index_file, (char**) sources->pdata, sources->len);
+
+    if(opt->dependency_file) write_output(opt->dependency_file, all->str);
+    g_ptr_array_free(sources, true);
+    g_string_free(all, true);
+}
+
+#endif
+
+/**
+Embedding clite
+===============
+
+Build systems translating thousands of files pay more to start a process per file than to translate it, so clite
+can also be built as a library (`-DCLITE_LIBRARY`) with the small C API in clite.h.
+
+The options are checked with the same rules of the command line. Translating a buffer goes through the same
+phases that the pipeline uses, one after the other on the calling thread. They free what they consume, so the
+library doesn't leak. Errors come back through a `Failure` that lives on the stack of `clite_translate`.
 **/
 
-char* skip_utf8_bom(char* str) {
-    unsigned char* b = (unsigned char*) str;
-    return  b[0] == 0xEF && b[1] == 0xBB && b[2] == 0xBF    ? (char*) &b[3]  : // UTF-8
-                                                              (char*) b;
+static
+Options* options_new(const char* lang, const char* no, const char* nc, int indentation,
+                     const char* co, const char* cc, Format format, char** error) {
+    g_assert(error);
+
+    LangSymbols* symbols = lang ? lang_find_symbols(s_lang_params_table, (char*) lang) : NULL;
+
+    *error =    lang && !symbols            ? g_strdup_printf("%s is not a supported language", lang)              :
+                !lang && (!no || !nc)       ? g_strdup("You need to specify either -l, or both -p and -c")          :
+                format == FormatMarkdown && !indentation && (!co || !cc)?
+                                              g_strdup("You need to specify either -indent, or both -P and -C")     :
+                                              NULL;
+    if(*error) return NULL;
+
+    Options* options            = g_new0(Options, 1);
+    options->start_narrative    = g_strdup(symbols ? symbols->start : no);
+    options->end_narrative      = g_strdup(symbols ? symbols->end   : nc);
+    options->scan               = find_scanner(options->start_narrative, options->end_narrative);
+    options->code_symbols       = format == FormatHtml  ?
+                                    union_new(CodeSymbols, Html, .language = g_strdup(lang ? lang : ""),
+                                              .highlighter = highlighter_new(symbols)) :
+                                  format == FormatJson  ?
+                                    union_new(CodeSymbols, Json, .language = g_strdup(lang ? lang : "")) :
+                                  indentation   ?
+                                    union_new(CodeSymbols, Indented, .indentation = indentation) :
+                                    union_new(CodeSymbols, Surrounded, .start_code = g_strdup(co), .end_code = g_strdup(cc));
+    return options;
+}
+
+struct CliteOptions { Options options; };
+
+static
+CliteOptions* clite_options_from(Options* options, char* message, CliteError* error) {
+    if(!options) {
+        if(error) *error = (CliteError) {.line = 0, .message = message};
+        else      g_free(message);
+        return NULL;
+    }
+
+    CliteOptions* res   = g_new(CliteOptions, 1);
+    res->options        = *options;
+    g_free(options);
+    return res;
+}
+
+CliteOptions* clite_options_new(const char* language, const char* start_narrative, const char* end_narrative,
+                                int indentation, const char* start_code, const char* end_code, CliteError* error) {
+    char* message       = NULL;
+    Options* options    = options_new(language, start_narrative, end_narrative, indentation,
+                                      start_code, end_code, FormatMarkdown, &message);
+    return clite_options_from(options, message, error);
+}
+
+CliteOptions* clite_options_new_html(const char* language, const char* start_narrative, const char* end_narrative,
+                                     const char* css_href, const char* css_text, CliteError* error) {
+    char* message       = NULL;
+    Options* options    = options_new(language, start_narrative, end_narrative, 0, NULL, NULL, FormatHtml, &message);
+    if(options) {
+        options->code_symbols->Html.css_href = g_strdup(css_href);
+        options->code_symbols->Html.css_text = g_strdup(css_text);
+    }
+    return clite_options_from(options, message, error);
+}
+
+CliteOptions* clite_options_new_json(const char* language, const char* start_narrative, const char* end_narrative,
+                                     CliteError* error) {
+    char* message       = NULL;
+    Options* options    = options_new(language, start_narrative, end_narrative, 0, NULL, NULL, FormatJson, &message);
+    return clite_options_from(options, message, error);
+}
+
+bool clite_options_add_narrative(CliteOptions* options, const char* start_narrative, const char* end_narrative,
+                                 CliteError* error) {
+    g_return_val_if_fail(options, false);
+
+    char* message = NULL;
+    if(options_add_pair(&options->options, start_narrative, end_narrative ? end_narrative : NL, &message))
+        return true;
+
+    if(error) *error = (CliteError) {.line = 0, .message = message};
+    else      g_free(message);
+    return false;
+}
+
+void clite_options_free(CliteOptions* options) {
+    if(!options) return;
+
+    GArray* pairs = options->options.more_pairs;
+    for(guint i = 0; pairs && i < pairs->len; ++i) {
+        g_free(g_array_index(pairs, NarrativePair, i).start);
+        g_free(g_array_index(pairs, NarrativePair, i).end);
+    }
+    if(pairs) g_array_free(pairs, true);
+    automaton_free(options->options.automaton);
+
+    CodeSymbols* cs = options->options.code_symbols;
+    if(cs->kind == Surrounded) {
+        g_free(cs->Surrounded.start_code);
+        g_free(cs->Surrounded.end_code);
+    }
+    if(cs->kind == Html) {
+        g_free(cs->Html.language);
+        g_free(cs->Html.css_href);
+        g_free(cs->Html.css_text);
+        g_free(cs->Html.highlighter);
+    }
+    if(cs->kind == Json) g_free(cs->Json.language);
+    g_free(cs);
+    g_free(options->options.start_narrative);
+    g_free(options->options.end_narrative);
+    g_free(options);
+}
+
+struct CliteCache { RenderCache* cache; };
+
+CliteCache* clite_cache_new(size_t max_bytes) {
+    CliteCache* res = g_new(CliteCache, 1);
+    res->cache      = cache_new(max_bytes);
+    return res;
+}
+
+void clite_cache_free(CliteCache* cache) {
+    if(!cache) return;
+    cache_free(cache->cache);
+    g_free(cache);
+}
+
+CliteCache* clite_cache_open(const char* path, size_t max_bytes) {
+    g_return_val_if_fail(path, NULL);
+
+    CliteCache* res = g_new(CliteCache, 1);
+    res->cache      = cache_open(path, max_bytes);
+    return res;
+}
+
+bool clite_cache_save(CliteCache* cache, CliteError* error) {
+    g_return_val_if_fail(cache && cache->cache->disk, false);
+
+    char* message   = NULL;
+    if(cache_save(cache->cache, &message)) return true;
+
+    if(error) *error = (CliteError) {.line = 0, .message = message};
+    else      g_free(message);
+    return false;
+}
+
+void clite_options_set_cache(CliteOptions* options, CliteCache* cache) {
+    g_return_if_fail(options);
+    options->options.cache = cache ? cache->cache : NULL;
+}
+
+void clite_error_clear(CliteError* error) {
+    if(!error) return;
+
+    g_free(error->message);
+    *error = (CliteError) {.line = 0, .message = NULL};
+}
+
+// Returns false with the line and the message of the error in *failure
+static
+bool translate_buffer(const Options* from, const char* source, gsize size, WriteFunc sink, gpointer user,
+                      Failure* failure) {
+    Options options     = *from;
+    options.failure     = failure;
+
+    PhaseState ps       = {.pending = NULL};
+    char* volatile copy              = NULL;
+    TokenStream* volatile tokens     = NULL;
+    GQueue* volatile chunks          = NULL;
+    Blocks* volatile blocks          = NULL;
+
+    void free_all() {
+        if(chunks) g_queue_free_full(chunks, g_free);
+        if(blocks) blocks_free(blocks);
+        token_stream_free(tokens);
+        g_free(copy);
+    }
+
+    if(setjmp(failure->jump)) {
+        free_all();
+        if(ps.pending) free_block(ps.pending);
+        return false;
+    }
+
+    copy    = g_malloc(size + 1);
+    memcpy(copy, source, size);
+    copy[size] = '\0';
+    copy    = to_utf8(copy, size);
+    tokens  = tokenize(&options, copy);
+    chunks  = g_queue_new();
+    parse(&options, tokens, chunks);
+    blocks  = flatten(&options, tokens, chunks);
+
+    for(guint i = 0; i < blocks->len; ++i)
+        phase_block(&options, &ps, copy_block(blocks_at(blocks, i)), sink, user);
+    phase_block(&options, &ps, NULL, sink, user);
+
+    free_all();
+    return true;
+}
+
+bool clite_translate(const CliteOptions* clite_options, const char* source, size_t size,
+                     CliteSink sink, void* user, CliteError* error) {
+    g_return_val_if_fail(clite_options, false);
+    g_return_val_if_fail(source || size == 0, false);
+    g_return_val_if_fail(sink, false);
+
+    Failure failure     = {.line = 0, .message = NULL};
+    if(translate_buffer(&clite_options->options, source, size, sink, user, &failure)) return true;
+
+    if(error) *error = (CliteError) {.line = failure.line, .column = failure.column, .message = failure.message};
+    else      g_free(failure.message);
+    return false;
+}
+
+struct CliteDocument { const CliteOptions* options; Document* document; gsize size; };
+
+static
+bool document_failed(Failure* failure, CliteError* error) {
+    if(error) *error = (CliteError) {.line = failure->line, .column = failure->column, .message = failure->message};
+    else      g_free(failure->message);
+    return false;
+}
+
+CliteDocument* clite_document_new(const CliteOptions* clite_options, const char* source, size_t size,
+                                  CliteSink sink, void* user, CliteError* error) {
+    g_return_val_if_fail(clite_options, NULL);
+    g_return_val_if_fail(source || size == 0, NULL);
+    g_return_val_if_fail(sink, NULL);
+
+    Options options         = clite_options->options;
+    Failure failure         = {.line = 0, .message = NULL};
+    options.failure         = &failure;
+    char* volatile text     = NULL;
+    if(setjmp(failure.jump)) {
+        g_free(text);
+        document_failed(&failure, error);
+        return NULL;
+    }
+
+    text                    = g_malloc(size + 1);
+    memcpy(text, source, size);
+    text[size]              = '\0';
+    text                    = to_utf8(text, size);
+
+    char* output            = NULL;
+    CliteDocument* res      = g_new(CliteDocument, 1);
+    res->options            = clite_options;
+    res->document           = document_new(&options, text, &output);
+    res->size               = strlen(text);
+    sink(output, strlen(output), user);
+    g_free(output);
+    g_free(text);
+    return res;
+}
+
+bool clite_document_edit(CliteDocument* document, size_t offset, size_t deleted, const char* inserted,
+                         size_t inserted_size, size_t* output_offset, size_t* output_deleted,
+                         CliteSink sink, void* user, CliteError* error) {
+    g_return_val_if_fail(document, false);
+    g_return_val_if_fail(offset <= document->size && deleted <= document->size - offset, false);
+    g_return_val_if_fail(inserted || inserted_size == 0, false);
+    g_return_val_if_fail(output_offset && output_deleted && sink, false);
+
+    Options options         = document->options->options;
+    Failure failure         = {.line = 0, .message = NULL};
+    options.failure         = &failure;
+    char* text              = g_strndup(inserted ? inserted : "", inserted_size);
+    Retranslation* r        = document_edit(&options, document->document,
+                                            &(Edit) {.offset = offset, .deleted = deleted, .inserted = text});
+    if(!r) {
+        g_free(text);
+        return document_failed(&failure, error);
+    }
+
+    document->size          = document->size - deleted + strlen(text);
+    *output_offset          = r->output_offset;
+    *output_deleted         = r->output_deleted;
+    sink(r->output_inserted, strlen(r->output_inserted), user);
+    g_free(r->output_inserted);
+    g_free(r);
+    g_free(text);
+    return true;
+}
+
+void clite_document_free(CliteDocument* document) {
+    if(!document) return;
+    document_free(document->document);
+    g_free(document);
 }
 
 /**
@@ -796,6 +5566,8 @@ There are a couple of things I don't like about GLib and I'm working on an [hobb
 to overcome them. Eventually I'll post it.
 **/
 
+#ifndef CLITE_LIBRARY
+
 int main(int argc, char* argv[])
 {
 #ifdef ARENA
@@ -803,23 +5575,76 @@ int main(int argc, char* argv[])
 #endif
 
     CmdOptions* opt = parse_command_line(argc, argv);
+    Target* targets = (Target*) opt->targets->data;
+    int n           = opt->targets->len;
+    s_jobserver     = jobserver_from(g_getenv("MAKEFLAGS"));
+    if(s_jobserver) atexit(jobserver_release);
+
+    // Once the outputs are written
+    int done() {
+        write_dependencies(opt);
+        save_cache(opt->cache);
+        return report_diagnostics(opt);
+    }
 
-    char* source    = NULL;
-    GError* error   = NULL;
+    if(opt->tree) {
+        translate_tree(opt);
+        return done();
+    }
+
+    if(opt->input_files[1] || opt->index_file) {
+        translate_batch(opt);
+        return done();
+    }
+
+    char* input             = *opt->input_files;
+    char* output            = targets->output_file;
+    bool compressed         = is_gz(input) || is_gz(output);
+    if(opt->stream || (compressed && n == 1 && !targets->options->toc && !opt->diagnostics)) {
+        FILE* in            = is_gz(input)  ? NULL : fopen(input, "rb");
+        FILE* out           = is_gz(output) ? NULL : fopen(output, "wb");
+        gzFile gz_in        = is_gz(input)  ? open_gz(input, "rb")  : NULL;
+        gzFile gz_out       = is_gz(output) ? open_gz(output, "wb") : NULL;
+        if(!in && !gz_in)   report_error("Cannot open %s", input);
+        if(!out && !gz_out) report_error("Cannot open %s", output);
+
+        Prelude prelude     = {.read = in ? read_file : read_gz, .reader = in ? (gpointer) in : gz_in};
+        Encoding encoding   = read_prelude(&prelude);
+        Transcoder from     = {.read = prelude.read, .reader = prelude.reader, .encoding = encoding,
+                               .in = g_malloc(sizeof(prelude.rest)), .len = prelude.len, .room = sizeof(prelude.rest)};
+        memcpy(from.in, prelude.rest, prelude.len);
+        bool utf8           = encoding == EncodingUtf8;
+        translate_pipelined(targets->options, utf8 ? read_after_prelude : read_transcoded,
+                                              utf8 ? (gpointer) &prelude : &from,
+                                              out ? write_file : write_gz, out ? (gpointer) out : gz_out);
+        g_free(from.in);
+
+        if(in)  fclose(in);
+        else    gzclose(gz_in);
+        if(out && fclose(out)) report_error("Cannot write %s", output);
+        if(gz_out) close_gz(gz_out, output);
+        return done();
+    }
 
-    if(!g_file_get_contents(opt->input_file, &source, NULL, &error))
-        report_error(error->message);
+    char* source            = read_input(input);
+    TokenStream* tokens     = check_input(opt, targets->options, input, source);
+    // Nothing is written, so there are no rules either
+    opt->dependencies       = opt->dependencies && tokens;
+    if(!tokens) return done();
 
-    source = skip_utf8_bom(source);
+    Options** options       = g_new(Options*, n);
+    for(int i = 0; i < n; ++i) options[i] = targets[i].options;
 
-    char* text              = translate(opt->options, source);
+    char** texts            = n == 1 ? (char*[]) {translate_tokens(options[0], tokens, NULL)}
+                                     : translate_targets(options, n, tokens);
 
-    if(!g_file_set_contents(opt->output_file, text, -1, &error))
-        report_error(error->message);
+    for(int i = 0; i < n; ++i) write_output(targets[i].output_file, texts[i]);
 
 #ifdef ARENA
     destroy_arena_allocator();
 #endif
 
-    return 0;
+    return done();
 }
+
+#endif
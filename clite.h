@@ -0,0 +1,104 @@
+#ifndef CLITE_INCLUDED
+#define CLITE_INCLUDED
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#if defined(_WIN32) && defined(CLITE_SHARED)
+#   ifdef CLITE_LIBRARY
+#       define CLITE_API __declspec(dllexport)
+#   else
+#       define CLITE_API __declspec(dllimport)
+#   endif
+#elif defined(__GNUC__)
+#   define CLITE_API __attribute__((visibility("default")))
+#else
+#   define CLITE_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Changed when the translation of the same source can change
+#define CLITE_VERSION "1.0.0"
+
+typedef struct CliteOptions CliteOptions;
+typedef struct CliteCache   CliteCache;
+typedef struct CliteDocument CliteDocument;
+
+// line is zero when the error is not about a particular line, column when it is not known. message is owned by the
+// caller and, for an error about a delimiter, ends with its line and a caret under it.
+typedef struct CliteError { int line; int column; char* message; } CliteError;
+
+// Receives the translation a piece at the time
+typedef void (*CliteSink)(const char* data, size_t size, void* user);
+
+// Either language, or both start_narrative and end_narrative.
+// Either indentation > 0, or both start_code and end_code. The strings are copied.
+CLITE_API CliteOptions* clite_options_new(const char* language,
+                                          const char* start_narrative, const char* end_narrative,
+                                          int indentation,
+                                          const char* start_code, const char* end_code,
+                                          CliteError* error);
+
+// Translates to an HTML5 page instead of markdown. The page links css_href, or has css_text inline, if given.
+CLITE_API CliteOptions* clite_options_new_html(const char* language,
+                                               const char* start_narrative, const char* end_narrative,
+                                               const char* css_href, const char* css_text,
+                                               CliteError* error);
+
+// Translates to the JSON AST of pandoc (pandoc -f json) instead of markdown
+CLITE_API CliteOptions* clite_options_new_json(const char* language,
+                                               const char* start_narrative, const char* end_narrative,
+                                               CliteError* error);
+
+// Adds another pair of narrative delimiters, a NULL end_narrative means up to the end of the line
+CLITE_API bool          clite_options_add_narrative(CliteOptions* options,
+                                                    const char* start_narrative, const char* end_narrative,
+                                                    CliteError* error);
+
+CLITE_API void          clite_options_free(CliteOptions* options);
+
+// Keeps the tagged blocks, so that translating again what didn't change is a copy. max_bytes bounds its memory.
+CLITE_API CliteCache*   clite_cache_new(size_t max_bytes);
+
+// Like clite_cache_new, with the entries of the cache file at path too. A missing or damaged file is an empty cache.
+// More processes can share the file, which is kept within max_bytes.
+CLITE_API CliteCache*   clite_cache_open(const char* path, size_t max_bytes);
+
+// Adds the new entries to the file of a cache from clite_cache_open
+CLITE_API bool          clite_cache_save(CliteCache* cache, CliteError* error);
+
+// The options must stop using the cache before it is freed, which doesn't save it
+CLITE_API void          clite_cache_free(CliteCache* cache);
+
+// Translations with these options use the cache, which other options can share. NULL stops using it.
+CLITE_API void          clite_options_set_cache(CliteOptions* options, CliteCache* cache);
+
+// Safe to call from several threads at the same time, also with the same options
+CLITE_API bool          clite_translate(const CliteOptions* options, const char* source, size_t size,
+                                        CliteSink sink, void* user, CliteError* error);
+
+// A document open in an editor, which is translated again after each edit just where it changed. Its translation is
+// written to sink. The options must outlive the document.
+CLITE_API CliteDocument* clite_document_new(const CliteOptions* options, const char* source, size_t size,
+                                            CliteSink sink, void* user, CliteError* error);
+
+// Replaces deleted bytes at offset of the source with inserted_size bytes of inserted. The new translation is the
+// old one with output_deleted bytes at output_offset replaced by what is written to sink. If the edited source doesn't
+// translate, the document is left as it was.
+CLITE_API bool          clite_document_edit(CliteDocument* document, size_t offset, size_t deleted,
+                                            const char* inserted, size_t inserted_size,
+                                            size_t* output_offset, size_t* output_deleted,
+                                            CliteSink sink, void* user, CliteError* error);
+
+CLITE_API void          clite_document_free(CliteDocument* document);
+
+CLITE_API void          clite_error_clear(CliteError* error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CLITE_INCLUDED
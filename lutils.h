@@ -114,6 +114,27 @@ typedef struct alg {
         private_res;                                                                                            \
                                       })
 
+// Moves all the elements of other at the end of q in constant time and frees other
+static inline
+GQueue* g_queue_splice(GQueue* q, GQueue* other) {
+    g_assert(q);
+    g_assert(other);
+
+    if(!g_queue_is_empty(other)) {
+        if(g_queue_is_empty(q)) *q = *other;
+        else {
+            q->tail->next       = other->head;
+            other->head->prev   = q->tail;
+            q->tail             = other->tail;
+            q->length          += other->length;
+        }
+    }
+    other->head = other->tail = NULL;
+    other->length = 0;
+    g_queue_free(other);
+    return q;
+}
+
 inline static
 gint g_asprintf(gchar** string, gchar const *format, ...) {
 	va_list argp;
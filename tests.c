@@ -20,11 +20,33 @@ GString* print_tokens(GQueue* tokens) {
     return result;
 }
 
+static
+int token_line(TokenStream* ts, gsize i) { return token_position(ts, i).line; }
+
+// A copy of a token of the stream, to compare it with the ones of the sequential tokenizer
+static
+Token* token_at(TokenStream* ts, gsize i) {
+    g_assert(i < ts->len);
+
+    int kind = ts->kinds[i], pair = ts->pairs[i];
+    return  kind == Text        ? union_new(Token, Text, .text = g_strndup(ts->source + ts->offsets[i], ts->lengths[i])) :
+            kind == OpenComment ? union_new(Token, OpenComment, .line = token_line(ts, i), .pair = pair)  :
+                                  union_new(Token, CloseComment, .line = token_line(ts, i), .pair = pair);
+}
+
+// The tokens of a stream, one after the other, to compare them with the ones of the sequential tokenizer
+static
+GQueue* stream_tokens(TokenStream* ts) {
+    GQueue* q = g_queue_new();
+    for(gsize i = 0; i < ts->len; ++i) g_queue_push_tail(q, token_at(ts, i));
+    return q;
+}
+
 static
 void test_tokenizer() {
 
     void testToken(char* s) {
-        GQueue* q = tokenize(s_fsharp_options, s);
+        GQueue* q = stream_tokens(tokenize(s_fsharp_options, s));
 
         GString* result = print_tokens(q);
 
@@ -32,11 +54,141 @@ void test_tokenizer() {
     }
     char** toks = tokens;
     array_foreach(toks) testToken(*toks);
+
+    // Lines are counted when asked, in any order
+    TokenStream* ts = tokenize(s_fsharp_options, "a\n(** b\n\n**)\nc(**d**)");
+    g_assert_cmpuint(ts->len, ==, 8);
+    g_assert_cmpint(ts->kinds[4], ==, Text);
+    g_assert_cmpint(token_line(ts, 7), ==, 5);
+    g_assert_cmpint(token_line(ts, 1), ==, 2);
+    g_assert_cmpint(token_line(ts, 3), ==, 4);
+    g_assert_cmpint(token_line(ts, 5), ==, 5);
+    token_stream_free(ts);
+}
+
+static
+void test_line_index() {
+    char* s = "ab\n\tc\u00e9d\r\n\nx";
+    g_assert_cmpuint(count_newlines(s, strlen(s)), ==, 3);
+
+    LineIndex* index = line_index_new(s, strlen(s));
+    Position p = locate(index, 0);
+    g_assert_cmpint(p.line, ==, 1);
+    g_assert_cmpint(p.column, ==, 1);
+    p = locate(index, 7);
+    g_assert_cmpint(p.line, ==, 2);
+    g_assert_cmpint(p.column, ==, 4);
+    g_assert_cmpstr(excerpt(index, p), ==, "     2 | \tc\u00e9d\n       | \t  ^");
+    p = locate(index, strlen(s));
+    g_assert_cmpint(p.line, ==, 4);
+    g_assert_cmpint(p.column, ==, 2);
+    g_assert_cmpstr(excerpt(index, p), ==, "     4 | x\n       |  ^");
+    line_index_free(index);
+
+    // On the end of a line
+    index = line_index_new("ab\ncd", 5);
+    g_assert_cmpstr(excerpt(index, locate(index, 2)), ==, "     1 | ab\n       |   ^");
+    g_assert_cmpstr(excerpt(index, locate(index, 5)), ==, "     2 | cd\n       |   ^");
+    line_index_free(index);
+
+    // Across the checkpoints, as counting from the start
+    gsize size  = 3 * LINE_INDEX_STEP + 17;
+    char* big   = g_malloc(size + 1);
+    for(gsize i = 0; i < size; ++i) big[i] = i % 7 == 6 ? '\n' : 'a';
+    big[size]   = '\0';
+    index       = line_index_new(big, size);
+    for(gsize at = 0; at <= size; at += 4099) {
+        p = locate(index, at);
+        g_assert_cmpint(p.line, ==, 1 + at / 7);
+        g_assert_cmpint(p.column, ==, 1 + at % 7);
+    }
+    line_index_free(index);
+    g_free(big);
+
+    // A long line is cut around the column
+    GString* line = g_string_new("");
+    for(int i = 0; i < 200; ++i) g_string_append_c(line, 'a' + i % 26);
+    index = line_index_new(line->str, line->len);
+    char* shown = excerpt(index, locate(index, 100));
+    g_assert(g_str_has_prefix(shown, "     1 | ...opqr"));
+    g_assert(strstr(shown, "...\n"));
+    g_assert_cmpint(shown[72], ==, 'w');
+    g_assert_cmpuint(strchr(shown, '^') - strrchr(shown, '\n') - 1, ==, 72);
+    line_index_free(index);
+}
+
+static
+bool tokens_equal(GQueue* a, GQueue* b) {
+    if(g_queue_get_length(a) != g_queue_get_length(b)) return false;
+
+    for(GList *x = a->head, *y = b->head; x; x = x->next, y = y->next) {
+        Token *t1 = x->data, *t2 = y->data;
+        bool same = t1->kind == t2->kind &&
+                    (t1->kind == Text           ? !strcmp(t1->Text.text, t2->Text.text)        :
+                     t1->kind == OpenComment    ? t1->OpenComment.line == t2->OpenComment.line :
+                                                  t1->CloseComment.line == t2->CloseComment.line);
+        if(!same) return false;
+    }
+    return true;
+}
+
+static
+void test_parallel_tokenizer() {
+
+    void testToken(char* s) {
+        GQueue* expected = tokenize_sequential(s_fsharp_options, s);
+        for(int segments = 1; segments <= 8; ++segments)
+            g_assert(tokens_equal(expected,
+                                  stream_tokens(tokenize_parallel(s_fsharp_options, s, strlen(s), segments))));
+    }
+    char** toks = tokens;
+    array_foreach(toks) testToken(*toks);
+
+    testToken("a\n(**\n*)b**)\n(***)(**\n**\n**)***)\n\n(**)");
+    testToken("\n\n(*\n*(**(**(**\n**)**)**)c\n");
+}
+
+static
+void test_scanners() {
+    char alphabet[] = "(*)/a\n";
+    gsize n         = strlen(alphabet);
+
+    LangSymbols** symbols = s_lang_params_table;
+    array_foreach(symbols) {
+        Options generic      = {.start_narrative = (*symbols)->start, .end_narrative = (*symbols)->end};
+        Options specialised  = generic;
+        specialised.scan     = find_scanner(generic.start_narrative, generic.end_narrative);
+        g_assert(specialised.scan == scan_packed);
+
+        // All the strings up to 6 chars long
+        char s[7];
+        for(gsize len = 0; len <= 6; ++len) {
+            gsize count = 1;
+            for(gsize i = 0; i < len; ++i) count *= n;
+
+            for(gsize c = 0; c < count; ++c) {
+                gsize x = c;
+                for(gsize i = 0; i < len; ++i, x /= n) s[i] = alphabet[x % n];
+                s[len] = '\0';
+
+                GQueue* expected = tokenize_sequential(&generic, s);
+                g_assert(tokens_equal(expected, stream_tokens(tokenize(&specialised, s))));
+                g_assert(tokens_equal(expected, stream_tokens(tokenize(&generic, s))));
+            }
+        }
+    }
 }
 
 static
 void test_parser() {
 
+    TokenStream* ts = NULL;
+
+    GQueue* range(gsize first, gsize last) {
+        GQueue* q = g_queue_new();
+        for(gsize i = first; i < last; ++i) g_queue_push_tail(q, token_at(ts, i));
+        return q;
+    }
     inline GQueue* enrich(GQueue* tokens) {
         g_queue_push_front(tokens, union_new(Token, OpenComment, .line = 0));
         g_queue_push_back(tokens, union_new(Token, CloseComment, .line = 0));
@@ -44,14 +196,17 @@ void test_parser() {
     }
 
     void testToken(char* s) {
-        GQueue* q = parse(s_fsharp_options, tokenize(s_fsharp_options, s));
+        ts        = tokenize(s_fsharp_options, s);
+        GQueue* q = parse(s_fsharp_options, ts, g_queue_new());
 
         GString* result = g_string_sized_new(64);
         g_queue_foreach(q, g_func(Chunk*, c,
                                     GString* s =    c->kind == NarrativeChunk  ?
-                                                        print_tokens(enrich(c->NarrativeChunk.tokens)):
+                                                        print_tokens(enrich(range(c->NarrativeChunk.first,
+                                                                                  c->NarrativeChunk.last))):
                                                     c->kind == CodeChunk ?
-                                                        print_tokens(c->CodeChunk.tokens)     :
+                                                        print_tokens(range(c->CodeChunk.first,
+                                                                           c->CodeChunk.last))       :
                                                         g_assert_no_match;
                                     g_string_append_printf(result, "%s", s->str);
                                   ), NULL);
@@ -62,6 +217,45 @@ void test_parser() {
     array_foreach(toks) testToken(*toks);
 }
 
+static
+void test_diagnose() {
+    Options options     = *s_fsharp_options;
+    Failure failure     = {.line = 0};
+    options.failure     = &failure;
+
+    // No errors just when parse succeeds, and the first error is the one of parse, at the same line and column
+    char* t[] = {"a (** b **) c", "(** a", "**) a", "a\n(** b (** c **) d **)", "(** a **) **)", "a **) b (** c **)",
+                 "(** a **)\n(** b", "", NULL};
+    for(int i = 0; t[i]; ++i) {
+        TokenStream* ts = tokenize(&options, t[i]);
+        GArray* found   = g_array_new(false, false, sizeof(Diagnostic));
+        guint n         = diagnose(ts, "f", found);
+        volatile bool parsed = false;
+        if(!setjmp(failure.jump)) parsed = parse(&options, ts, g_queue_new()) != NULL;
+        g_assert_cmpint(parsed, ==, !n);
+        if(!parsed) {
+            g_assert_cmpint(g_array_index(found, Diagnostic, 0).line, ==, failure.line);
+            g_assert_cmpint(g_array_index(found, Diagnostic, 0).column, ==, failure.column);
+        }
+        token_stream_free(ts);
+    }
+
+    // All the errors, picking up again at the next open
+    char* s         = "**) a\n(** b (** c **) **)\n(** d (** e\n(** f";
+    TokenStream* ts = tokenize(&options, s);
+    GArray* found   = g_array_new(false, false, sizeof(Diagnostic));
+    g_assert_cmpuint(diagnose(ts, "g", found), ==, 5);
+    int expected[][2] = {{1, 1}, {2, 7}, {3, 7}, {4, 1}, {4, 1}};
+    for(int i = 0; i < 5; ++i) {
+        Diagnostic* d = &g_array_index(found, Diagnostic, i);
+        g_assert_cmpstr(d->file, ==, "g");
+        g_assert_cmpint(d->line, ==, expected[i][0]);
+        g_assert_cmpint(d->column, ==, expected[i][1]);
+    }
+    g_assert_cmpstr(g_array_index(found, Diagnostic, 4).message, ==, "You haven't closed your last narrative comment");
+    token_stream_free(ts);
+}
+
 static
 GString* print_blocks(GQueue* q) {
 
@@ -83,7 +277,7 @@ static
 void test_blockize() {
 
     void testToken(char* str) {
-        GQueue* q = blockize(s_fsharp_options, str);
+        GQueue* q = blocks_queue(blockize(s_fsharp_options, str));
 
         GString* result = print_blocks(q);
         g_assert_cmpstr(str, ==, result->str);
@@ -118,9 +312,9 @@ void test_remove_empty_blocks() {
 
     str_pair** ptr = t;
     array_foreach(ptr) {
-        GQueue* q = remove_empty_blocks(s_fsharp_options, blockize(s_fsharp_options, (*ptr)->exp));
+        Blocks* q = remove_empty_blocks(s_fsharp_options, blockize(s_fsharp_options, (*ptr)->exp));
 
-        GString* result = print_blocks(q);
+        GString* result = print_blocks(blocks_queue(q));
         g_assert_cmpstr((*ptr)->got, ==, result->str);
     };
 }
@@ -135,10 +329,10 @@ void test_merge_blocks() {
 
     str_pair** ptr = t;
     array_foreach(ptr) {
-        GQueue* removed = remove_empty_blocks(s_fsharp_options, blockize(s_fsharp_options, (*ptr)->exp));
-        GQueue* q = merge_blocks(s_fsharp_options,removed);
+        Blocks* removed = remove_empty_blocks(s_fsharp_options, blockize(s_fsharp_options, (*ptr)->exp));
+        Blocks* q = merge_blocks(s_fsharp_options,removed);
 
-        GString* result = print_blocks(q);
+        GString* result = print_blocks(blocks_queue(q));
         g_assert_cmpstr((*ptr)->got, ==, result->str);
     };
 }
@@ -184,9 +378,9 @@ void test_code_tags() {
 
     str_pair** ptr = t;
     array_foreach(ptr) {
-        GQueue* q = process_phases(s_fsharp_options, blockize(s_fsharp_options, (*ptr)->exp));
+        Blocks* q = process_phases(s_fsharp_options, blockize(s_fsharp_options, (*ptr)->exp));
 
-        GString* result = print_blocks(q);
+        GString* result = print_blocks(blocks_queue(q));
         g_assert_cmpstr((*ptr)->got, ==, result->str);
     };
 }
@@ -208,6 +402,1177 @@ void test_translate() {
     };
 }
 
+typedef struct str_reader { char* src; gsize max; } str_reader;
+
+static
+gsize read_str(char* buf, gsize size, gpointer reader) {
+    str_reader* r   = reader;
+    gsize n         = MIN(MIN(size, r->max), strlen(r->src));
+    memcpy(buf, r->src, n);
+    r->src += n;
+    return n;
+}
+
+static
+void write_str(const char* buf, gsize size, gpointer writer) {
+    g_string_append_len(writer, buf, size);
+}
+
+static
+void test_pipeline() {
+    char* t[] = {" bb ", "(** bb **)", "bb (** aa **)", "  (**  **)aa(** **)bb", "(**abc**)(**def**)",
+                 "a **) b\n(** c\n**)\n\n(**d**) e (*", "\n\n   \n", "", NULL};
+
+    char** ptr = t;
+    array_foreach(ptr) {
+        char* expected = translate(s_fsharp_options, *ptr);
+        for(gsize max = 1; max <= 5; ++max) {
+            GString* result = g_string_new("");
+            translate_pipelined(s_fsharp_options, read_str, &(str_reader) {.src = *ptr, .max = max},
+                                write_str, result);
+            g_assert_cmpstr(expected, ==, result->str);
+        }
+    };
+}
+
+// A delimiter across two chunks, a block of more chunks and a long run of blocks merged together
+static
+void test_stream_memory() {
+    GString* src = g_string_new("");
+    for(gsize i = 0; i < STREAM_CHUNK_SIZE - 2; ++i) g_string_append_c(src, 'a');
+    g_string_append(src, "(** straddles **)\n");
+    for(gsize i = 0; i < 3 * STREAM_CHUNK_SIZE; ++i) g_string_append_c(src, i % 80 ? 'b' : '\n');
+    for(int i = 0; i < 2000; ++i) g_string_append(src, "c\n(** **)");
+    g_string_append(src, "(** end **)");
+
+    gsize longest = 0, texts = 0;
+    void count(Token* tok) {
+        if(tok->kind == Text) {
+            longest = MAX(longest, strlen(tok->Text.text));
+            ++texts;
+        }
+        free_token(tok);
+    }
+    tokenize_stream(s_fsharp_options, read_str, &(str_reader) {.src = src->str, .max = G_MAXSIZE}, count);
+    g_assert_cmpuint(longest, <=, STREAM_CHUNK_SIZE);
+    g_assert_cmpuint(texts, >, 2000 + 3);
+
+    char* expected  = translate(s_fsharp_options, src->str);
+    GString* result = g_string_new("");
+    translate_pipelined(s_fsharp_options, read_str, &(str_reader) {.src = src->str, .max = G_MAXSIZE},
+                        write_str, result);
+    g_assert_cmpstr(expected, ==, result->str);
+
+    // The producer waits when the ring holds RING_BYTES, but an item bigger than that goes through alone
+    Ring* ring      = ring_new();
+    gsize sizes[]   = {1000, RING_BYTES / 2, RING_BYTES / 2, 3 * RING_BYTES, 1, 1, 1};
+    gpointer producer(G_GNUC_UNUSED gpointer data) {
+        for(gsize i = 0; i < G_N_ELEMENTS(sizes); ++i) ring_push(ring, GSIZE_TO_POINTER(i + 1), sizes[i]);
+        ring_push(ring, NULL, 0);
+        return NULL;
+    }
+    GThread* thread = g_thread_new("clite-test-producer", producer, NULL);
+    for(gsize i = 0; ; ++i) {
+        g_usleep(1000);
+
+        // Past RING_BYTES there is just the oversized item, as nothing is pushed after it until it is popped
+        gsize bytes     = __atomic_load_n(&ring->bytes, __ATOMIC_RELAXED);
+        guint used      = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - ring->head;
+        if(bytes > RING_BYTES) {
+            g_assert_cmpuint(bytes, ==, 3 * RING_BYTES);
+            g_assert_cmpuint(used, ==, 1);
+        }
+        gpointer item = ring_pop(ring);
+        if(!item) break;
+        g_assert_cmpuint(GPOINTER_TO_SIZE(item), ==, i + 1);
+    }
+    g_thread_join(thread);
+    g_assert_cmpuint(ring->bytes, ==, 0);
+
+    // A side that waits long sleeps until the other one moves, instead of spinning
+    gpointer consumer(G_GNUC_UNUSED gpointer data) { return ring_pop(ring); }
+    thread          = g_thread_new("clite-test-consumer", consumer, NULL);
+    while(!__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST)) g_usleep(1000);
+    ring_push(ring, GSIZE_TO_POINTER(7), 1);
+    g_assert_cmpuint(GPOINTER_TO_SIZE(g_thread_join(thread)), ==, 7);
+    g_assert_cmpint(ring->sleeping, ==, 0);
+    ring_free(ring);
+}
+
+typedef struct bytes_reader { const char* src; gsize len; gsize max; } bytes_reader;
+
+static
+gsize read_bytes(char* buf, gsize size, gpointer reader) {
+    bytes_reader* r = reader;
+    gsize n         = MIN(MIN(size, r->max), r->len);
+    memcpy(buf, r->src, n);
+    r->src += n;
+    r->len -= n;
+    return n;
+}
+
+// The chars with the prelude of the encoding
+static
+GString* encode(const gunichar* chars, gsize n, Encoding e) {
+    GString* res = g_string_new("");
+    void put(guint32 u) {
+        for(gsize k = 0; k < UNIT_SIZE(e); ++k) {
+            gsize shift = e == EncodingUtf16LE || e == EncodingUtf32LE ? 8 * k : 8 * (UNIT_SIZE(e) - 1 - k);
+            g_string_append_c(res, (char) (u >> shift));
+        }
+    }
+    if(e != EncodingUtf8) put(0xFEFF);
+    for(gsize i = 0; i < n; ++i) {
+        gunichar c = chars[i];
+        if(e == EncodingUtf8) {
+            char s[6];
+            g_string_append_len(res, s, g_unichar_to_utf8(c, s));
+        }
+        else if(UNIT_SIZE(e) == 2 && c > 0xFFFF) {
+            put(0xD800 + ((c - 0x10000) >> 10));
+            put(0xDC00 + ((c - 0x10000) & 0x3FF));
+        }
+        else put(c);
+    }
+    return res;
+}
+
+static
+void test_encodings() {
+    struct { char* bytes; gsize len; Encoding e; gsize bom; } boms[] = {
+        {"\xFF\xFE\0\0a", 5, EncodingUtf32LE, 4}, {"\0\0\xFE\xFF", 4, EncodingUtf32BE, 4},
+        {"\xEF\xBB\xBF" "a", 4, EncodingUtf8, 3},   {"\xFF\xFE" "a\0", 4, EncodingUtf16LE, 2},
+        {"\xFE\xFF\0a", 4, EncodingUtf16BE, 2},   {"\xFF", 1, EncodingUtf8, 0}, {"ab", 2, EncodingUtf8, 0}
+    };
+    for(gsize i = 0; i < G_N_ELEMENTS(boms); ++i) {
+        Encoding e;
+        g_assert_cmpuint(find_bom((const guchar*) boms[i].bytes, boms[i].len, &e), ==, boms[i].bom);
+        g_assert_cmpint(e, ==, boms[i].e);
+    }
+
+    // Long ASCII runs, with chars of two, three and four bytes in and across them
+    GArray* chars = g_array_new(false, false, sizeof(gunichar));
+    for(int i = 0; i < 300; ++i) {
+        int at     = i % 60;
+        gunichar c =    at == 0 ? '(' : at == 1 || at == 2 || at == 30 || at == 31 ? '*' : at == 32 ? ')' :
+                        i % 37 == 5 ? 0xE9 : i % 41 == 7 ? 0x65E5 : i % 53 == 11 ? 0x1F600 : 'a' + i % 26;
+        g_array_append_val(chars, c);
+    }
+    GString* utf8       = encode((gunichar*) chars->data, chars->len, EncodingUtf8);
+    char* expected      = translate(s_fsharp_options, utf8->str);
+
+    CliteError error    = {.line = 0, .message = NULL};
+    CliteOptions* o     = clite_options_new("fsharp", NULL, NULL, 0, "````fsharp", "````", &error);
+    Encoding all[]      = {EncodingUtf16LE, EncodingUtf16BE, EncodingUtf32LE, EncodingUtf32BE};
+    for(gsize k = 0; k < G_N_ELEMENTS(all); ++k) {
+        GString* src    = encode((gunichar*) chars->data, chars->len, all[k]);
+        g_assert_cmpstr(to_utf8(g_string_free(g_string_new_len(src->str, src->len), false), src->len), ==, utf8->str);
+
+        GString* result = g_string_new("");
+        g_assert(clite_translate(o, src->str, src->len, write_str, result, &error));
+        g_assert_cmpstr(expected, ==, result->str);
+
+        // A code unit, or a surrogate pair, cut between two reads
+        for(gsize max = 1; max <= 7; ++max) {
+            GString* result     = g_string_new("");
+            bytes_reader r      = {.src = src->str + UNIT_SIZE(all[k]), .len = src->len - UNIT_SIZE(all[k]), .max = max};
+            Transcoder t        = {.read = read_bytes, .reader = &r, .encoding = all[k]};
+            translate_pipelined(s_fsharp_options, read_transcoded, &t, write_str, result);
+            g_assert_cmpstr(expected, ==, result->str);
+            g_free(t.in);
+        }
+    }
+    clite_options_free(o);
+
+    // A lone surrogate and a cut code unit at the end
+    char out[16];
+    gsize used;
+    gsize n = transcode((const guchar*) "\x00\xD8" "a\0" "\x3D\xD8", 6, EncodingUtf16LE, out, &used, false);
+    g_assert_cmpuint(used, ==, 4);
+    g_assert_cmpuint(n, ==, 4);
+    g_assert(!memcmp(out, "\xEF\xBF\xBD" "a", 4));
+    n = transcode((const guchar*) "\x3D\xD8" "b", 3, EncodingUtf16LE, out, &used, true);
+    g_assert_cmpuint(used, ==, 3);
+    g_assert(!memcmp(out, "\xEF\xBF\xBD\xEF\xBF\xBD", n));
+    g_assert_cmpuint(n, ==, 6);
+}
+
+// The parser exits on errors, so edits giving invalid sources are skipped
+static
+bool is_balanced(char* s) {
+    int state = AtTop;
+    bool ok = true;
+    g_queue_foreach(stream_tokens(tokenize(s_fsharp_options, s)), g_func(Token*, tok,
+        ok      = ok && !(tok->kind == CloseComment && state == AtTop) &&
+                        !(tok->kind == OpenComment && state == InNarrative);
+        state   = tok->kind == OpenComment                      ? InNarrative   :
+                  tok->kind == CloseComment && state != InCode  ? AtTop         :
+                  tok->kind == Text && state == AtTop           ? InCode        :
+                                                                  state;
+    ), NULL);
+    return ok && state != InNarrative;
+}
+
+static
+char* dump_blocks(GQueue* q) {
+    GString* result = g_string_sized_new(64);
+    g_queue_foreach(q, g_func(Block*, b,
+        g_string_append_printf(result, "%c[%s]", b->kind == Code ? 'C' : 'N', extract(b));
+    ), NULL);
+    return result->str;
+}
+
+// Short texts in the slots and long ones pointed to, through growing, merging and copying the vector
+static
+void test_block_vector() {
+    char* long_text = g_strnfill(3 * BLOCK_INLINE_SIZE, 'l');
+    char* texts[]   = {"a", long_text, "  ", "b", long_text, "c", NULL};
+    Blocks* blocks  = blocks_new(1);
+    GString* expected = g_string_new("");
+    for(int i = 0; i < 300; ++i) {
+        char* text  = texts[i % 6];
+        int kind    = i % 5 < 3 ? Code : Narrative;
+        blocks_push(blocks, kind, 0, text, strlen(text), false);
+        if(!is_str_all_spaces(text)) g_string_append_printf(expected, "%c[%s]", kind == Code ? 'C' : 'N', text);
+    }
+    g_assert_cmpuint(blocks->len, ==, 300);
+    for(guint i = 0; i < blocks->len; ++i) {
+        BlockSlot* s = &blocks->slots[i];
+        g_assert(s->small == (extract(&s->block) == s->text));
+        g_assert(s->small == (strlen(extract(&s->block)) < BLOCK_INLINE_SIZE));
+    }
+
+    Blocks* copy    = blocks_copy(blocks);
+    remove_empty_blocks(s_fsharp_options, blocks);
+    g_assert_cmpstr(dump_blocks(blocks_queue(blocks)), ==, expected->str);
+
+    GQueue* queue   = blocks_queue(blocks);
+    GString* merged = g_string_new("");
+    for(GList* l = queue->head; l; l = l->next) {
+        Block* b = l->data;
+        bool same = l->prev && ((Block*) l->prev->data)->kind == b->kind;
+        if(same)    g_string_append_printf(merged, "\n%s", extract(b));
+        else        g_string_append_printf(merged, "]%c[%s", b->kind == Code ? 'C' : 'N', extract(b));
+    }
+    merge_blocks(s_fsharp_options, blocks);
+    GString* got = g_string_new("");
+    for(guint i = 0; i < blocks->len; ++i)
+        g_string_append_printf(got, "]%c[%s", blocks_at(blocks, i)->kind == Code ? 'C' : 'N',
+                               extract(blocks_at(blocks, i)));
+    g_assert_cmpstr(got->str, ==, merged->str);
+    for(guint i = 0; i < blocks->len; ++i)
+        g_assert(blocks->slots[i].small == (extract(blocks_at(blocks, i)) == blocks->slots[i].text));
+
+    // The copy didn't change
+    g_assert_cmpuint(copy->len, ==, 300);
+    g_assert_cmpstr(extract(blocks_at(copy, 1)), ==, long_text);
+    g_assert(extract(blocks_at(copy, 0)) == copy->slots[0].text);
+    blocks_free(copy);
+    blocks_free(blocks);
+    g_free(long_text);
+}
+
+static
+GQueue* document_queue(Document* doc) {
+    GQueue* res = g_queue_new();
+    for(guint i = 0; i < doc->blocks->len; ++i) g_queue_push_tail(res, DOC_BLOCKS(doc)[i]);
+    return res;
+}
+
+// Edits doc, checking that it is the document of edited and that its output patches old_out into the translation
+static
+char* check_edit(Options* options, Document* doc, char* old_out, Edit* edit, char* edited) {
+    Retranslation* r    = document_edit(options, doc, edit);
+    char* new_out       = NULL;
+    Document* fresh     = document_new(options, edited, &new_out);
+
+    g_assert_cmpstr(edited, ==, print_blocks(document_queue(doc))->str);
+    g_assert_cmpstr(dump_blocks(document_queue(fresh)), ==, dump_blocks(document_queue(doc)));
+    g_assert_cmpuint(doc->blocks->len, ==, fresh->blocks->len);
+    for(guint i = 0; i <= doc->blocks->len; ++i) {
+        g_assert_cmpuint(DOC_SOURCE(doc)[i], ==, DOC_SOURCE(fresh)[i]);
+        g_assert_cmpuint(DOC_OUTPUT(doc)[i], ==, DOC_OUTPUT(fresh)[i]);
+    }
+
+    g_assert(r->output_offset + r->output_deleted <= strlen(old_out));
+    char* patched = g_strjoin("", g_strndup(old_out, r->output_offset), r->output_inserted,
+                              old_out + r->output_offset + r->output_deleted, NULL);
+    g_assert_cmpstr(new_out, ==, patched);
+    g_assert_cmpuint(doc->length, ==, strlen(patched));
+    document_free(fresh);
+    return patched;
+}
+
+static
+void test_retranslate() {
+    char* docs[] = {"a (** b **) c", "(** x **)\n\n(** y **)  code **) more\n(** z **)", "  (** **)aa(** **)bb",
+                    "code\n(**\nnarr\n**)\ncode2\n(** n2 **)(** n3 **)\n   \n", "(****)", "", NULL};
+    char* inserts[] = {"", "x", "(**", "**)", "*", "\n", " (** q **) ", NULL};
+
+    char** doc = docs;
+    array_foreach(doc) {
+        gsize len = strlen(*doc);
+        for(gsize offset = 0; offset <= len; ++offset)
+        for(gsize deleted = 0; deleted <= 3 && offset + deleted <= len; ++deleted) {
+            char** ins = inserts;
+            array_foreach(ins) {
+                char* edited = g_strjoin("", g_strndup(*doc, offset), *ins, *doc + offset + deleted, NULL);
+                if(!is_balanced(edited)) continue;
+
+                char* old_out   = NULL;
+                Document* d     = document_new(s_fsharp_options, *doc, &old_out);
+                g_assert_cmpstr(translate(s_fsharp_options, *doc), ==, old_out);
+                check_edit(s_fsharp_options, d, old_out,
+                           &(Edit) {.offset = offset, .deleted = deleted, .inserted = *ins}, edited);
+                document_free(d);
+            }
+        }
+    }
+
+    // Typing a document one character at the time, then deleting it from the middle. The document is edited each
+    // time its source is balanced, from the last balanced one.
+    char* typed     = "code\n(** a\n\n## b **)\n  more code\n(** c **)(** d **) end\n";
+    char* base      = "";
+    char* out       = NULL;
+    Document* d     = document_new(s_fsharp_options, base, &out);
+    void edit_to(char* edited) {
+        if(!is_balanced(edited)) return;
+        gsize pre = 0, post = 0, blen = strlen(base), elen = strlen(edited);
+        while(pre < blen && pre < elen && base[pre] == edited[pre]) ++pre;
+        while(post < blen - pre && post < elen - pre && base[blen - post - 1] == edited[elen - post - 1]) ++post;
+        out     = check_edit(s_fsharp_options, d, out, &(Edit) {.offset = pre, .deleted = blen - pre - post,
+                             .inserted = g_strndup(edited + pre, elen - pre - post)}, edited);
+        base    = edited;
+    }
+
+    for(gsize i = 1; i <= strlen(typed); ++i) edit_to(g_strndup(typed, i));
+    for(char* source = typed; *source;) {
+        gsize at    = strlen(source) / 2;
+        source      = g_strjoin("", g_strndup(source, at), source + at + 1, NULL);
+        edit_to(source);
+    }
+    g_assert_cmpstr(base, ==, "");
+    document_free(d);
+}
+
+static
+void test_library() {
+    CliteError error    = {.line = 0, .message = NULL};
+    CliteOptions* o     = clite_options_new("fsharp", NULL, NULL, 0, "````fsharp", "````", &error);
+    g_assert(o);
+
+    char* t[] = {" bb ", "(** bb **)", "bb (** aa **)", "  (**  **)aa(** **)bb", "a **) b\n(** c\n**)", "", NULL};
+    char** ptr = t;
+    array_foreach(ptr) {
+        GString* result = g_string_new("");
+        g_assert(clite_translate(o, *ptr, strlen(*ptr), write_str, result, &error));
+        g_assert_cmpstr(translate(s_fsharp_options, *ptr), ==, result->str);
+    }
+
+    struct { char* src; int line; int column; } errors[] = {
+        {"(** open", 1, 1}, {"**) close", 1, 1}, {"code\n\n(** a (** b **) **)", 3, 7}, {NULL, 0, 0}
+    };
+    for(int i = 0; errors[i].src; ++i) {
+        GString* result = g_string_new("");
+        g_assert(!clite_translate(o, errors[i].src, strlen(errors[i].src), write_str, result, &error));
+        g_assert_cmpint(errors[i].line, ==, error.line);
+        g_assert_cmpint(errors[i].column, ==, error.column);
+        g_assert(error.message);
+        clite_error_clear(&error);
+    }
+
+    // An edit that doesn't translate leaves the document as it was
+    GString* out        = g_string_new("");
+    CliteDocument* doc  = clite_document_new(o, "a (** b **) c", 13, write_str, out, &error);
+    g_assert(doc);
+    g_assert_cmpstr(translate(s_fsharp_options, "a (** b **) c"), ==, out->str);
+
+    GString* ins        = g_string_new("");
+    size_t offset, deleted;
+    g_assert(!clite_document_edit(doc, 9, 3, "", 0, &offset, &deleted, write_str, ins, &error));
+    g_assert(error.message);
+    clite_error_clear(&error);
+    g_assert(clite_document_edit(doc, 6, 1, "bb", 2, &offset, &deleted, write_str, ins, &error));
+    g_string_erase(out, offset, deleted);
+    g_string_insert_len(out, offset, ins->str, ins->len);
+    g_assert_cmpstr(translate(s_fsharp_options, "a (** bb **) c"), ==, out->str);
+    clite_document_free(doc);
+    clite_options_free(o);
+
+    g_assert(!clite_options_new("cobol", NULL, NULL, 4, NULL, NULL, &error));
+    g_assert_cmpstr("cobol is not a supported language", ==, error.message);
+    clite_error_clear(&error);
+    g_assert(!clite_options_new(NULL, "(**", "**)", 0, "```", NULL, &error));
+    clite_error_clear(&error);
+}
+
+// Edits one after the other through the library, each checked against a translation of the whole source
+static
+void test_document_edits() {
+    CliteError error    = {.line = 0, .message = NULL};
+    CliteOptions* o     = clite_options_new("fsharp", NULL, NULL, 4, NULL, NULL, &error);
+    g_assert(o);
+
+    char* source        = g_strdup("(** n **)(** n **) # T\n(** n **)(****)# T\n(****)*)*)**");
+    GString* out        = g_string_new("");
+    CliteDocument* doc  = clite_document_new(o, source, strlen(source), write_str, out, &error);
+    g_assert(doc);
+
+    void edit(gsize offset, gsize deleted, char* inserted) {
+        char* edited    = g_strjoin("", g_strndup(source, offset), inserted, source + offset + deleted, NULL);
+        GString* full   = g_string_new("");
+        bool valid      = clite_translate(o, edited, strlen(edited), write_str, full, &error);
+        clite_error_clear(&error);
+
+        GString* ins    = g_string_new("");
+        size_t at, removed;
+        bool done       = clite_document_edit(doc, offset, deleted, inserted, strlen(inserted), &at, &removed,
+                                              write_str, ins, &error);
+        g_assert(done == valid);
+        clite_error_clear(&error);
+        if(done) {
+            g_string_erase(out, at, removed);
+            g_string_insert_len(out, at, ins->str, ins->len);
+            source      = edited;
+        }
+        g_assert_cmpstr(out->str, ==, done ? full->str : out->str);
+        g_string_free(ins, true);
+        g_string_free(full, true);
+    }
+
+    // An empty block that ended up heading a run, which broke the next edit
+    edit(52, 1, "**");
+    edit(18, 1, "# T");
+
+    char* pieces[]      = {"(**", "**)", "(****)", "*)", "(*", "# T", "\n", " n ", " ", ""};
+    for(int i = 0; i < 3000; ++i) {
+        gsize len       = strlen(source);
+        gsize offset    = g_test_rand_int_range(0, len + 1);
+        gsize deleted   = g_test_rand_int_range(0, MIN(len - offset, 4) + 1);
+        edit(offset, deleted, pieces[g_test_rand_int_range(0, G_N_ELEMENTS(pieces))]);
+        if(strlen(source) > 200) edit(0, strlen(source) - 100, "");
+    }
+    clite_document_free(doc);
+    clite_options_free(o);
+    g_string_free(out, true);
+}
+
+static
+void test_narrative_pairs() {
+    char* message       = NULL;
+    Options* options    = options_new("fsharp", NULL, NULL, 0, "```", "```", FormatMarkdown, &message);
+    g_assert(options_add_pair(options, "//" "/", NL, &message));
+    g_assert(options_add_pair(options, "(*", "*)", &message));
+    g_assert(!options_add_pair(options, "", NL, &message));
+
+    // The automaton finds the same delimiter as trying all of them at each position
+    const char* naive(const char* p, const char* stop, const char* limit, int* pattern) {
+        for(; p < stop; ++p)
+            for(int kind = 0; kind < 2; ++kind)
+                for(int pair = 0; pair < pairs_count(options); ++pair) {
+                    const char* d = pattern_string(options, 2 * pair + kind);
+                    if((gsize) (limit - p) >= strlen(d) && !strncmp(p, d, strlen(d))) {
+                        *pattern = 2 * pair + kind;
+                        return p;
+                    }
+                }
+        return NULL;
+    }
+
+    char alphabet[] = "(*)/a\n";
+    gsize n         = strlen(alphabet);
+    char s[7];
+    for(gsize len = 0; len <= 6; ++len) {
+        gsize count = 1;
+        for(gsize i = 0; i < len; ++i) count *= n;
+
+        for(gsize c = 0; c < count; ++c) {
+            gsize x = c;
+            for(gsize i = 0; i < len; ++i, x /= n) s[i] = alphabet[x % n];
+            s[len] = '\0';
+
+            for(gsize from = 0; from <= len; ++from)
+            for(gsize stop = from; stop <= len; ++stop) {
+                int p1 = -1, p2 = -1;
+                const char* r1 = naive(s + from, s + stop, s + len, &p1);
+                const char* r2 = scan_automaton(options, s + from, s + stop, s + len, &p2);
+                g_assert(r1 == r2 && p1 == p2);
+            }
+
+            GQueue* expected = stream_tokens(tokenize_parallel(options, s, len, 1));
+            for(int segments = 2; segments <= 4; ++segments)
+                g_assert(tokens_equal(expected, stream_tokens(tokenize_parallel(options, s, len, segments))));
+        }
+    }
+
+    char* t[] = {"a\n/" "// one\n/" "// two\nb", "(** x /" "// y **)\n/" "// z", "(* a *) /" "// b\n(** c **)",
+                 "/" "// (** a\nb **)", "\n/" "//\n/" "//", NULL};
+    char* expected[] = {"```\na\n```\n\none\n two\n\n```\nb\n```\n", "x /" "// y \n z\n", "a \n b\n c\n",
+                        "(** a\n\n```\nb **)\n```\n", "", NULL};
+    for(int i = 0; t[i]; ++i) {
+        if(!expected[i]) continue;
+        g_assert_cmpstr(expected[i], ==, translate(options, t[i]));
+        for(gsize max = 1; max <= 5; ++max) {
+            GString* result = g_string_new("");
+            translate_pipelined(options, read_str, &(str_reader) {.src = t[i], .max = max}, write_str, result);
+            g_assert_cmpstr(expected[i], ==, result->str);
+        }
+    }
+
+    // The new lines closing line doc comments count
+    Failure failure     = {.line = 0};
+    options->failure    = &failure;
+    if(!setjmp(failure.jump)) {
+        translate(options, "/" "// a\n/" "// b\n**)");
+        g_assert_not_reached();
+    }
+    g_assert_cmpint(3, ==, failure.line);
+}
+
+static
+void test_html() {
+    char* message       = NULL;
+    Options* options    = options_new("fsharp", NULL, NULL, 0, NULL, NULL, FormatHtml, &message);
+    g_assert(options);
+
+    char* doc = "(** % A <title>\n% Me\n\nSome & text\non two lines\n\n  Another **)\nlet a = \"<b>\"\n";
+    g_assert_cmpstr(translate(options, doc), ==, g_strconcat(
+        "<!DOCTYPE html>\n<html>\n<head>\n  <meta charset=\"utf-8\">\n  <meta name=\"generator\" content=\"clite\">\n"
+        "  <meta name=\"author\" content=\"Me\">\n  <title>A &lt;title&gt;</title>\n"
+        "  <style type=\"text/css\">\n", s_highlight_css, "  </style>\n</head>\n<body>\n"
+        "<header>\n<h1 class=\"title\">A &lt;title&gt;</h1>\n<h2 class=\"author\">Me</h2>\n</header>\n"
+        "<p>Some &amp; text\non two lines</p>\n<p>Another</p>\n"
+        "<pre class=\"sourceCode fsharp\"><code class=\"sourceCode fsharp\">"
+        "<span class=\"kw\">let</span> a = <span class=\"st\">&quot;&lt;b&gt;&quot;</span></code></pre>\n"
+        "</body>\n</html>\n", NULL));
+
+    char* t[] = {doc, "", "code", "(** a **) b (** c **)", NULL};
+    char** ptr = t;
+    array_foreach(ptr) {
+        char* expected = translate(options, *ptr);
+        for(gsize max = 1; max <= 5; ++max) {
+            GString* result = g_string_new("");
+            translate_pipelined(options, read_str, &(str_reader) {.src = *ptr, .max = max}, write_str, result);
+            g_assert_cmpstr(expected, ==, result->str);
+        }
+
+        // Editing the first block changes the start of the document
+        gsize len = strlen(*ptr);
+        for(gsize offset = 0; offset <= len; ++offset) {
+            char* edited = g_strjoin("", g_strndup(*ptr, offset), "%", *ptr + offset, NULL);
+            if(!is_balanced(edited)) continue;
+            char* out   = NULL;
+            Document* d = document_new(options, *ptr, &out);
+            check_edit(options, d, out, &(Edit) {.offset = offset, .deleted = 0, .inserted = "%"}, edited);
+            document_free(d);
+        }
+    }
+
+    CliteError error    = {.line = 0, .message = NULL};
+    CliteOptions* o     = clite_options_new_html("fsharp", NULL, NULL, NULL, "p { }", &error);
+    GString* result     = g_string_new("");
+    g_assert(clite_translate(o, "a", 1, write_str, result, &error));
+    g_assert(strstr(result->str, "<style type=\"text/css\">\np { }\n  </style>"));
+    clite_options_free(o);
+}
+
+// The reference for html_escape, a char at the time
+static
+GString* html_escape_scalar(GString* out, const char* s, gsize len) {
+    for(const char* end = s + len; s < end; ++s)
+        switch(*s) {
+            case '&':   g_string_append(out, "&amp;");  break;
+            case '<':   g_string_append(out, "&lt;");   break;
+            case '>':   g_string_append(out, "&gt;");   break;
+            case '"':   g_string_append(out, "&quot;"); break;
+            default:    g_string_append_c(out, *s);
+        }
+    return out;
+}
+
+static
+void test_html_escape() {
+    char alphabet[] = "<>&\"a\n\x22\x26\x3c\x3e\x24\x3a\x20\xac";
+    guint32 seed    = 1;
+    char s[200];
+
+    for(int i = 0; i < 2000; ++i) {
+        gsize len = i % 150;
+        for(gsize j = 0; j < len; ++j) {
+            seed = seed * 1103515245 + 12345;
+            s[j] = i % 3 ? alphabet[(seed >> 16) % (sizeof(alphabet) - 1)] : 'a' + (seed >> 16) % 26;
+        }
+        g_assert_cmpstr(html_escape_scalar(g_string_new(""), s, len)->str, ==,
+                        html_escape(g_string_new(""), s, len)->str);
+    }
+}
+
+static
+void test_markdown() {
+    char* md(const char* text) { return render_markdown(g_string_new(""), html_markup, text, NULL)->str; }
+
+    g_assert_cmpstr(md("Main ideas\n==========\n\nSome *em*, **strong** and `a < b`.\nSecond line\n"), ==,
+        "<h1 id=\"main-ideas\">Main ideas</h1>\n"
+        "<p>Some <em>em</em>, <strong>strong</strong> and <code>a &lt; b</code>.\nSecond line</p>\n");
+    g_assert_cmpstr(md("## 2. Not freeing (again) ##\nSub\n---\n"), ==,
+        "<h2 id=\"not-freeing-again\">2. Not freeing (again)</h2>\n<h2 id=\"sub\">Sub</h2>\n");
+    g_assert_cmpstr(md("a g_queue_map b_ * c [x](http://a.b/?q=1&r) [y] ![i](p.png) <http://z> \\*d\\*"), ==,
+        "<p>a g_queue_map b_ * c <a href=\"http://a.b/?q=1&amp;r\">x</a> [y] <img src=\"p.png\" alt=\"i\" /> "
+        "<a href=\"http://z\">http://z</a> *d*</p>\n");
+    g_assert_cmpstr(md("* one\n  more\n* [two](u) _x_\n\nafter\n3. a\n4. b\n"), ==,
+        "<ul>\n<li>one\nmore</li>\n<li><a href=\"u\">two</a> <em>x</em></li>\n</ul>\n"
+        "<p>after</p>\n<ol start=\"3\">\n<li>a</li>\n<li>b</li>\n</ol>\n");
+    g_assert_cmpstr(md("text\n***\n```c\nint *a, *b;\n```\n**open *nested* close** ***both*** `` a`b ``"), ==,
+        "<p>text</p>\n<hr />\n<pre class=\"c\"><code>int *a, *b;\n</code></pre>\n"
+        "<p><strong>open <em>nested</em> close</strong> <strong><em>both</em></strong> <code>a`b</code></p>\n");
+
+    // The vectorised search for markup agrees with the char at the time one at every offset
+    char s[] = "plain text with a * and a ` and then [link] or _under_ or \\ or <tag> or !bang and more plain text";
+    for(gsize i = 0; i < sizeof(s) - 1; ++i) {
+        const char* p = s + i;
+        while(*p && !is_inline_special(*p)) ++p;
+        g_assert(next_inline_special(s + i, s + sizeof(s) - 1) == p);
+    }
+}
+
+static
+void test_json() {
+    char* message       = NULL;
+    Options* options    = options_new("c", NULL, NULL, 0, NULL, NULL, FormatJson, &message);
+    g_assert(options);
+
+    char* doc = "/" "** % A title\n% Me\n\nText *em*\n\n1. one\n2. [two](u) **/\nint a = \"\\t\";\n";
+    g_assert_cmpstr(translate(options, doc), ==,
+        "{\"pandoc-api-version\":" PANDOC_API_VERSION ",\"meta\":{"
+        "\"title\":{\"t\":\"MetaInlines\",\"c\":[{\"t\":\"Str\",\"c\":\"A\"},{\"t\":\"Space\"},{\"t\":\"Str\",\"c\":\"title\"}]},"
+        "\"author\":{\"t\":\"MetaList\",\"c\":[{\"t\":\"MetaInlines\",\"c\":[{\"t\":\"Str\",\"c\":\"Me\"}]}]}},"
+        "\"blocks\":[\n"
+        "{\"t\":\"Para\",\"c\":[{\"t\":\"Str\",\"c\":\"Text\"},{\"t\":\"Space\"},{\"t\":\"Emph\",\"c\":[{\"t\":\"Str\",\"c\":\"em\"}]}]},"
+        "{\"t\":\"OrderedList\",\"c\":[[1,{\"t\":\"Decimal\"},{\"t\":\"Period\"}],["
+        "[{\"t\":\"Plain\",\"c\":[{\"t\":\"Str\",\"c\":\"one\"}]}],"
+        "[{\"t\":\"Plain\",\"c\":[{\"t\":\"Link\",\"c\":[[\"\",[],[]],[{\"t\":\"Str\",\"c\":\"two\"}],[\"u\",\"\"]]}]}]]]},\n"
+        "{\"t\":\"CodeBlock\",\"c\":[[\"\",[\"c\"],[]],\"int a = \\\"\\\\t\\\";\"]},\n"
+        "{\"t\":\"RawBlock\",\"c\":[\"markdown\",\"\"]}]}\n");
+
+    g_assert_cmpstr(render_markdown(g_string_new(""), json_markup, "# Top #\n\n- a\n---\n```sh\nx\n\ny,\n```", NULL)->str, ==,
+        "{\"t\":\"Header\",\"c\":[1,[\"top\",[],[]],[{\"t\":\"Str\",\"c\":\"Top\"}]]},"
+        "{\"t\":\"BulletList\",\"c\":[[{\"t\":\"Plain\",\"c\":[{\"t\":\"Str\",\"c\":\"a\"}]}]]},"
+        "{\"t\":\"HorizontalRule\"},{\"t\":\"CodeBlock\",\"c\":[[\"\",[\"sh\"],[]],\"x\\n\\ny,\"]},");
+
+    char* t[] = {doc, "", "code", "/" "** a **" "/ b /" "** c **" "/", NULL};
+    char** ptr = t;
+    array_foreach(ptr) {
+        char* expected = translate(options, *ptr);
+        GString* result = g_string_new("");
+        translate_pipelined(options, read_str, &(str_reader) {.src = *ptr, .max = 3}, write_str, result);
+        g_assert_cmpstr(expected, ==, result->str);
+    }
+
+    // Escaping 16 bytes at the time is the same as escaping a char at the time
+    char s[] = "a \"quoted\" \\path\\ with\ttabs\nand\x01\x1f controls \xc3\xa8 and \x7f plain text after them";
+    GString* chars = g_string_new("");
+    for(gsize i = 0; i < sizeof(s) - 1; ++i) json_escape(chars, s + i, 1);
+    g_assert_cmpstr(json_escape(g_string_new(""), s, sizeof(s) - 1)->str, ==, chars->str);
+    g_assert(strstr(chars->str, "\\\"quoted\\\" \\\\path\\\\ with\\ttabs\\nand\\u0001\\u001f"));
+
+    CliteError error    = {.line = 0, .message = NULL};
+    CliteOptions* o     = clite_options_new_json("c", NULL, NULL, &error);
+    GString* result     = g_string_new("");
+    g_assert(clite_translate(o, "a", 1, write_str, result, &error));
+    g_assert(g_str_has_suffix(result->str, "{\"t\":\"CodeBlock\",\"c\":[[\"\",[\"c\"],[]],\"a\"]},\n"
+                                           "{\"t\":\"RawBlock\",\"c\":[\"markdown\",\"\"]}]}\n"));
+    clite_options_free(o);
+}
+
+static
+void test_targets() {
+    char* message       = NULL;
+    Options* options[]  = {
+        options_new("fsharp", NULL, NULL, 4, NULL, NULL, FormatMarkdown, &message),
+        options_new("fsharp", NULL, NULL, 0, "```fsharp", "```", FormatMarkdown, &message),
+        options_new("fsharp", NULL, NULL, 0, NULL, NULL, FormatHtml, &message),
+        options_new("fsharp", NULL, NULL, 0, NULL, NULL, FormatJson, &message),
+    };
+
+    char* t[] = {"(** % Title\n\nText **)\n  let a = 1  \n(** More **)\nlet b = 2\n\n(** **)\nlet c = 3\n", "", "code", NULL};
+    char** ptr = t;
+    array_foreach(ptr) {
+        char** res = translate_targets(options, G_N_ELEMENTS(options), tokenize(options[0], *ptr));
+        for(guint i = 0; i < G_N_ELEMENTS(options); ++i)
+            g_assert_cmpstr(res[i], ==, translate(options[i], *ptr));
+        g_assert(!res[G_N_ELEMENTS(options)]);
+    }
+}
+
+static
+void test_toc() {
+    char* message       = NULL;
+    Options* md         = options_new("c", NULL, NULL, 0, "```c", "```", FormatMarkdown, &message);
+    Options* html       = options_new("c", NULL, NULL, 0, NULL, NULL, FormatHtml, &message);
+    md->toc             = html->toc = true;
+
+    char* doc = "/" "** % T\n\n# One\ntext\n\nTwo `b`\n---\n### Deep **/\nint a;\n/" "** # One **/\n";
+    g_assert_cmpstr(translate(md, doc), ==,
+        "% T\n\n- [One](#one)\n    - [Two `b`](#two-b)\n        - [Deep](#deep)\n- [One](#one-1)\n\n"
+        "\n# One\ntext\n\nTwo `b`\n---\n### Deep\n\n```c\nint a;\n```\n\n# One\n");
+
+    char* res = translate(html, doc);
+    g_assert(strstr(res, "</header>\n<nav id=\"TOC\">\n<ul>\n<li><a href=\"#one\">One</a><ul>\n"
+                         "<li><a href=\"#two-b\">Two <code>b</code></a><ul>\n<li><a href=\"#deep\">Deep</a></li>\n"
+                         "</ul>\n</li>\n</ul>\n</li>\n<li><a href=\"#one-1\">One</a></li>\n</ul>\n</nav>\n<h1 id=\"one\">"));
+    g_assert(strstr(res, "<h2 id=\"two-b\">") && strstr(res, "<h3 id=\"deep\">") && strstr(res, "<h1 id=\"one-1\">"));
+
+    // The suffixes go where the ids end, in the same block too
+    char* same = translate(html, "/" "** # A\n# A\n\n# A\n **/");
+    g_assert(strstr(same, "<h1 id=\"a\">A</h1>\n<h1 id=\"a-1\">A</h1>\n<h1 id=\"a-2\">A</h1>\n"));
+    Options* json = options_new("c", NULL, NULL, 0, NULL, NULL, FormatJson, &message);
+    json->toc     = true;
+    g_assert(strstr(translate(json, "/" "** # A **/ x /" "** # A **/"), "[1,[\"a-1\",[],[]]"));
+
+    // No headings, no table
+    md->toc = false;
+    char* plain = translate(md, "/" "** text **/ code");
+    md->toc = true;
+    g_assert_cmpstr(translate(md, "/" "** text **/ code"), ==, plain);
+
+    Options* targets[] = {md, html};
+    char** outs = translate_targets(targets, 2, tokenize(md, doc));
+    g_assert_cmpstr(outs[0], ==, translate(md, doc));
+    g_assert_cmpstr(outs[1], ==, res);
+
+    GArray* headings[2];
+    md->toc = false;
+    translate_document(md, doc, &headings[0]);
+    translate_document(md, "/" "** ## A_b **/", &headings[1]);
+    g_assert_cmpstr(index_document(md, (char*[]) {"x.c", "y.c"}, (char*[]) {"out/x.mkd", "out/y.mkd"}, headings, 2,
+                                   "out/index.mkd"), ==,
+        "- [x.c](x.mkd)\n    - [One](x.mkd#one)\n        - [Two `b`](x.mkd#two-b)\n            - [Deep](x.mkd#deep)\n"
+        "    - [One](x.mkd#one-1)\n- [y.c](y.mkd)\n    - [A_b](y.mkd#a_b)\n\n");
+
+    g_assert_cmpstr(relative_path("out", "out/a/x.html"), ==, "a/x.html");
+    g_assert_cmpstr(relative_path("out/./a", "out/b/../c/x.html"), ==, "../c/x.html");
+    g_assert_cmpstr(relative_path(".", "x.html"), ==, "x.html");
+    g_assert_cmpstr(relative_path("/a/b", "/c/x.html"), ==, "../../c/x.html");
+}
+
+static
+void test_cache() {
+    char* message       = NULL;
+    Options* plain      = options_new("c", NULL, NULL, 0, "```c", "```", FormatMarkdown, &message);
+    Options* html       = options_new("c", NULL, NULL, 0, NULL, NULL, FormatHtml, &message);
+    Options* cached[]   = {options_new("c", NULL, NULL, 0, "```c", "```", FormatMarkdown, &message),
+                           options_new("c", NULL, NULL, 0, NULL, NULL, FormatHtml, &message),
+                           options_new("c", NULL, NULL, 4, NULL, NULL, FormatMarkdown, &message)};
+    RenderCache* cache  = cache_new(1 << 20);
+    for(guint i = 0; i < G_N_ELEMENTS(cached); ++i) cached[i]->cache = cache;
+
+    char* doc = "/" "** # Title\ntext **/\n  int a;  \n/" "** more **/\nint b;\n/" "** more **/\nint b;\n";
+    for(int round = 0; round < 2; ++round) {
+        g_assert_cmpstr(translate(cached[0], doc), ==, translate(plain, doc));
+        g_assert_cmpstr(translate(cached[1], doc), ==, translate(html, doc));
+    }
+    g_assert_cmpuint(cache->hits, >, 0);
+
+    // Indented narrative isn't tagged, so it isn't cached
+    guint64 misses = cache->misses;
+    translate(cached[2], "/" "** a **/ b");
+    g_assert_cmpuint(cache->misses, ==, misses + 1);
+
+    // An entry with the same hash but another text isn't used
+    guint64 hash = hash_str(options_fingerprint(cached[0]) + Code, "int c;");
+    cache_insert(cache, hash, g_strdup("int d;"), g_strdup("wrong"));
+    g_assert(!strstr(translate(cached[0], "/" "** a **/int c;"), "wrong"));
+
+    // A small cache drops the old generation, and keeps giving the same output
+    RenderCache* small  = cache_new(64);
+    cached[1]->cache    = small;
+    for(int round = 0; round < 3; ++round)
+        g_assert_cmpstr(translate(cached[1], doc), ==, translate(html, doc));
+    g_assert_cmpuint(g_hash_table_size(small->current) + g_hash_table_size(small->old), <=, 2);
+
+    CliteError error    = {.line = 0, .message = NULL};
+    CliteOptions* o     = clite_options_new_html("c", NULL, NULL, NULL, NULL, &error);
+    CliteCache* c       = clite_cache_new(1 << 20);
+    clite_options_set_cache(o, c);
+    GString* first      = g_string_new("");
+    GString* second     = g_string_new("");
+    g_assert(clite_translate(o, doc, strlen(doc), write_str, first, &error));
+    g_assert(clite_translate(o, doc, strlen(doc), write_str, second, &error));
+    g_assert_cmpstr(first->str, ==, second->str);
+    clite_options_set_cache(o, NULL);
+    clite_cache_free(c);
+    clite_options_free(o);
+}
+
+static
+void test_disk_cache() {
+    char* message       = NULL;
+    Options* plain      = options_new("c", NULL, NULL, 0, NULL, NULL, FormatHtml, &message);
+    Options* options    = options_new("c", NULL, NULL, 0, NULL, NULL, FormatHtml, &message);
+    char* path          = g_build_filename(g_get_tmp_dir(), "clite-test.cache", NULL);
+    char* doc           = "/" "** # Title\ntext **/\n  int a;  \n/" "** more **/\nint b;\n";
+    remove(path);
+
+    // Translates doc with a cache opened from the file, and saves it
+    RenderCache* run(gsize max_size, char* doc) {
+        RenderCache* cache  = cache_open(path, max_size);
+        options->cache      = cache;
+        g_assert_cmpstr(translate(options, doc), ==, translate(plain, doc));
+        g_assert(cache_save(cache, &message));
+        return cache;
+    }
+    gsize file_size() {
+        char* text  = NULL;
+        gsize size  = 0;
+        g_assert(g_file_get_contents(path, &text, &size, NULL));
+        g_free(text);
+        return size;
+    }
+
+    RenderCache* cache  = run(4 << 20, doc);
+    g_assert_cmpuint(cache->disk_hits, ==, 0);
+    cache_free(cache);
+
+    cache               = run(4 << 20, doc);
+    g_assert_cmpuint(cache->disk_hits, ==, 4);
+    g_assert_cmpuint(cache->misses, ==, 0);
+    cache_free(cache);
+
+    // A damaged entry is a miss
+    char* text          = NULL;
+    gsize size          = 0;
+    g_assert(g_file_get_contents(path, &text, &size, NULL));
+    text[size - 9]      ^= 1;
+    g_assert(g_file_set_contents(path, text, size, NULL));
+    cache               = run(4 << 20, doc);
+    g_assert_cmpuint(cache->disk_hits, ==, 3);
+    cache_free(cache);
+
+    // A damaged header is an empty cache, written again by the next save
+    g_assert(g_file_set_contents(path, text, 10, NULL));
+    g_free(text);
+    cache               = run(4 << 20, doc);
+    g_assert_cmpuint(cache->disk_hits, ==, 0);
+    cache_free(cache);
+    cache               = run(4 << 20, doc);
+    g_assert_cmpuint(cache->disk_hits, ==, 4);
+    cache_free(cache);
+
+    // The file is compacted when it gets to its maximum size, keeping the entries of the last run
+    gsize max_size      = 2 * DISK_DATA_START;
+    for(int round = 0; round < 6; ++round) {
+        GString* big    = g_string_new(NULL);
+        for(int i = 0; i < 60; ++i)
+            g_string_append_printf(big, "/" "** block %d %d **/\nint v%d = %d;\n%0900d\n", round, i, i, round, 0);
+        cache_free(run(max_size, big->str));
+        g_assert_cmpuint(file_size(), <=, max_size);
+
+        cache           = run(max_size, big->str);
+        g_assert_cmpuint(cache->misses, ==, 0);
+        cache_free(cache);
+        g_string_free(big, true);
+    }
+
+    options->cache      = NULL;
+    remove(path);
+    g_free(path);
+}
+
+static
+void test_gz() {
+    char* path      = g_build_filename(g_get_tmp_dir(), "clite-test.c.gz", NULL);
+    GString* text   = g_string_new("\xEF\xBB\xBF");
+    for(int i = 0; i < 20000; ++i) g_string_append_printf(text, "/" "** block %d **/\nint v%d;\n", i, i);
+
+    write_output(path, text->str);
+    char* compressed = NULL;
+    gsize size      = 0;
+    g_assert(g_file_get_contents(path, &compressed, &size, NULL));
+    g_assert_cmpuint(size, <, text->len / 4);
+    g_assert_cmpstr(read_input(path), ==, text->str + 3);
+
+    remove(path);
+    g_free(compressed);
+    g_free(path);
+    g_string_free(text, true);
+}
+
+static
+void test_tree() {
+    LangSymbols* c      = lang_find_symbols(s_lang_params_table, "c");
+    g_assert(lang_find_extension(s_lang_params_table, "a/b.c") == c);
+    g_assert(lang_find_extension(s_lang_params_table, "b.h") == c);
+    g_assert(lang_find_extension(s_lang_params_table, "b.c.gz") == c);
+    g_assert(lang_find_extension(s_lang_params_table, "b.fsx") == lang_find_symbols(s_lang_params_table, "fsharp"));
+    g_assert(!lang_find_extension(s_lang_params_table, "b.cc"));
+    g_assert(!lang_find_extension(s_lang_params_table, "b.c/README"));
+    g_assert(!lang_find_extension(s_lang_params_table, "a/.c"));
+
+    char* root          = g_build_filename(g_get_tmp_dir(), "clite-test-tree", NULL);
+    char* path(const char* name) { return g_build_filename(root, name, NULL); }
+    char* doc           = "/" "** # Title\ntext **/\nint a;\n";
+    char* files[]       = {"in/a.c", "in/sub/b.java", "in/skip/c.c", "in/notes.txt"};
+    for(guint i = 0; i < G_N_ELEMENTS(files); ++i) {
+        char* file = path(files[i]);
+        char* dir  = g_path_get_dirname(file);
+        g_assert(!g_mkdir_with_parents(dir, 0777));
+        g_assert(g_file_set_contents(file, doc, -1, NULL));
+    }
+
+    char* message       = NULL;
+    CmdOptions opt      = {.targets = g_array_new(false, false, sizeof(Target)), .tree = path("in"),
+                           .output_dir = path("out"), .includes = patterns(NULL)};
+    for(LangSymbols** s = s_lang_params_table; *s; ++s) {
+        Target target   = {.options = options_new((*s)->language, NULL, NULL, 0, NULL, NULL, FormatHtml, &message),
+                           .symbols = *s};
+        g_array_append_val(opt.targets, target);
+    }
+    opt.excludes        = patterns((char*[]) {"skip", NULL});
+    g_assert(matches(opt.excludes, "in/skip", "skip") && !matches(opt.excludes, "skip/a.c", "a.c"));
+    Glob* paths         = patterns((char*[]) {"sub/*.c", NULL});
+    g_assert(matches(paths, "sub/a.c", "a.c") && !matches(paths, "a.c", "a.c"));
+    translate_tree(&opt);
+
+    char* html          = NULL;
+    g_assert(g_file_get_contents(path("out/a.html"), &html, NULL, NULL));
+    g_assert_cmpstr(html, ==, translate(g_array_index(opt.targets, Target, 1).options, doc));
+    g_assert(g_file_test(path("out/sub/b.html"), G_FILE_TEST_EXISTS));
+    g_assert(!g_file_test(path("out/skip"), G_FILE_TEST_EXISTS));
+    g_assert(!g_file_test(path("out/notes.html"), G_FILE_TEST_EXISTS));
+
+    char* made[]        = {"out/a.html", "out/sub/b.html", "out/sub", "out", "in/a.c", "in/sub/b.java", "in/sub",
+                           "in/skip/c.c", "in/skip", "in/notes.txt", "in", ""};
+    for(guint i = 0; i < G_N_ELEMENTS(made); ++i) g_assert(!remove(path(made[i])));
+    g_free(root);
+}
+
+static
+void test_dependencies() {
+    char* message       = NULL;
+    Options* markdown   = options_new("c", NULL, NULL, 4, NULL, NULL, FormatMarkdown, &message);
+    Options* page       = options_new("c", NULL, NULL, 0, NULL, NULL, FormatHtml, &message);
+
+    GString* out        = g_string_new(NULL);
+    append_rule(out, markdown, "a b.mkd", (char*[]) {"x$#.c", "y.c"}, 2);
+    g_assert_cmpstr(out->str, ==, "a\\ b.mkd: x$$\\#.c \\\n  y.c\n");
+
+    // The stylesheet copied in the page is an input too
+    g_string_truncate(out, 0);
+    inline_css          = true;
+    css                 = "s.css";
+    append_rule(out, page, "a.html", (char*[]) {"a.c"}, 1);
+    append_rule(out, markdown, "a.mkd", (char*[]) {"a.c"}, 1);
+    g_assert_cmpstr(out->str, ==, "a.html: a.c \\\n  s.css\na.mkd: a.c\n");
+    inline_css          = false;
+    css                 = NULL;
+    g_string_free(out, true);
+
+    // With -k an input with errors has no output, so it isn't in the index, nor in the rules
+    char* root          = g_build_filename(g_get_tmp_dir(), "clite-test-dependencies", NULL);
+    char* path(const char* name) { return g_build_filename(root, name, NULL); }
+    g_assert(!g_mkdir_with_parents(root, 0777));
+    g_assert(g_file_set_contents(path("good.c"), "/" "** # Good **/\nint a;\n", -1, NULL));
+    g_assert(g_file_set_contents(path("bad.c"), "/" "** # Bad\nint b;\n", -1, NULL));
+
+    CmdOptions opt      = {.targets = g_array_new(false, false, sizeof(Target)),
+                           .input_files = (char*[]) {path("bad.c"), path("good.c"), NULL},
+                           .output_files = (char*[]) {path("bad.html"), path("good.html"), NULL},
+                           .index_file = path("index.html"), .dependencies = true, .dependency_file = path("deps"),
+                           .diagnostics = g_array_new(false, false, sizeof(Diagnostic))};
+    Target target       = {.options = page};
+    g_array_append_val(opt.targets, target);
+    g_mutex_init(&opt.diagnostics_lock);
+    translate_batch(&opt);
+    write_dependencies(&opt);
+
+    g_assert_cmpuint(opt.diagnostics->len, ==, 1);
+    g_assert(!g_file_test(path("bad.html"), G_FILE_TEST_EXISTS));
+    char* index         = NULL;
+    char* deps          = NULL;
+    g_assert(g_file_get_contents(path("index.html"), &index, NULL, NULL));
+    g_assert(g_file_get_contents(path("deps"), &deps, NULL, NULL));
+    g_assert(strstr(index, "good.html") && !strstr(index, "bad"));
+    g_assert(strstr(deps, "good.html") && !strstr(deps, "bad"));
+
+    char* made[]        = {"good.c", "bad.c", "good.html", "index.html", "deps", ""};
+    for(guint i = 0; i < G_N_ELEMENTS(made); ++i) g_assert(!remove(path(made[i])));
+    g_free(root);
+}
+
+static
+void test_jobserver() {
+    g_assert(!jobserver_from(NULL));
+    g_assert(!jobserver_from("-j4"));
+    Jobserver* closed   = jobserver_from(" -j4 --jobserver-auth=1000,1001");
+    g_assert(closed && closed->read < 0);
+    int null            = open("/dev/null", O_RDWR);
+    char* not_pipes     = g_strdup_printf("-j4 --jobserver-auth=%d,%d", null, null);
+    g_assert(jobserver_from(not_pipes)->read < 0);
+    close(null);
+
+    // Two tokens in the pipe, and the one of the process, for six workers
+    int fds[2];
+    g_assert(!pipe(fds));
+    g_assert(write(fds[1], "++", 2) == 2);
+    char* flags         = g_strdup_printf("-j3 --jobserver-auth=%d,%d", fds[0], fds[1]);
+    s_jobserver         = jobserver_from(flags);
+    g_assert(s_jobserver && s_jobserver->read >= 0);
+    g_assert_cmpint(processors(), ==, 1);
+
+    int next = 0, running = 0, most = 0;
+    void body(G_GNUC_UNUSED int worker) {
+        for(; __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) < 60;) {
+            int now = __atomic_add_fetch(&running, 1, __ATOMIC_RELAXED);
+            for(int m = most; now > m && !__atomic_compare_exchange_n(&most, &m, now, false,
+                                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED););
+            g_usleep(2000);
+            __atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED);
+        }
+    }
+    bool more() { return __atomic_load_n(&next, __ATOMIC_RELAXED) < 60; }
+    parallel_jobs(6, more, body);
+    g_assert_cmpint(most, <=, 3);
+    g_assert_cmpint(most, >, 1);
+
+    // All the tokens are back
+    char back[4];
+    g_assert_cmpint(read(s_jobserver->read, back, sizeof(back)), ==, 2);
+
+    // The tokens of the workers go back at exit too
+    jobserver_take(s_jobserver, '+');
+    jobserver_take(s_jobserver, '+');
+    jobserver_release();
+    g_assert_cmpuint(s_jobserver->held->len, ==, 0);
+    g_assert_cmpint(read(s_jobserver->read, back, sizeof(back)), ==, 2);
+
+    // With none left, a give back writes nothing
+    g_assert_cmpuint(jobserver_give(s_jobserver, false), ==, 0);
+    g_assert_cmpuint(jobserver_give(s_jobserver, true), ==, 0);
+    int flags_read      = fcntl(s_jobserver->read, F_GETFL);
+    g_assert(!fcntl(s_jobserver->read, F_SETFL, flags_read | O_NONBLOCK));
+    g_assert_cmpint(read(s_jobserver->read, back, sizeof(back)), ==, -1);
+
+    close(s_jobserver->read);
+    close(fds[0]);
+    close(fds[1]);
+    g_string_free(s_jobserver->held, true);
+    g_free(s_jobserver);
+    s_jobserver         = NULL;
+    g_free(flags);
+}
+
+static
+void test_highlight() {
+    char* hl(char* lang, const char* code) {
+        Highlighter* h = highlighter_new(lang_find_symbols(s_lang_params_table, lang));
+        return highlight(h, g_string_new(""), code, strlen(code))->str;
+    }
+
+    g_assert_cmpstr(hl("c", "  #include <a.h>\nint x = 0x1F + 1.5e-3; // c < d\n"), ==,
+                    "  <span class=\"ot\">#include &lt;a.h&gt;</span>\n<span class=\"dt\">int</span> x = "
+                    "<span class=\"dv\">0x1F</span> + <span class=\"fl\">1.5e-3</span>; "
+                    "<span class=\"co\">// c &lt; d</span>\n");
+    g_assert_cmpstr(hl("c", "a # b\n#define X \\\n  1\nc"), ==,
+                    "a # b\n<span class=\"ot\">#define X \\\n  1</span>\nc");
+    g_assert_cmpstr(hl("java", "return 'a' + \"x\\\"y\"; /* z */ iff"), ==,
+                    "<span class=\"kw\">return</span> <span class=\"ch\">'a'</span> + "
+                    "<span class=\"st\">&quot;x\\&quot;y&quot;</span>; <span class=\"co\">/* z */</span> iff");
+    g_assert_cmpstr(hl("fsharp", "let f (x: 'a) = (* c *) \"s"), ==,
+                    "<span class=\"kw\">let</span> f (x: 'a) = <span class=\"co\">(* c *)</span> "
+                    "<span class=\"st\">&quot;s</span>");
+    g_assert(!highlighter_new(lang_find_symbols(s_lang_params_table, "cobol")));
+
+    // Big outputs are tagged in parallel, with the same result
+    char* message       = NULL;
+    Options* options    = options_new("c", NULL, NULL, 0, NULL, NULL, FormatHtml, &message);
+    GString* doc        = g_string_new("");
+    for(int i = 0; doc->len < 2 * PARALLEL_TAGS_MIN_SIZE; ++i)
+        g_string_append_printf(doc, "/" "** N %d **" "/\nint f%d() { return %d; }\n", i, i, i);
+
+    Blocks* blocks      = merge_blocks(options, remove_empty_blocks(options, blockize(options, doc->str)));
+    GString* sequential = g_string_new("");
+    for(guint i = 0; i < blocks->len; ++i)
+        g_string_append(sequential, extract(add_code_tag(options, copy_block(blocks_at(blocks, i)))));
+    g_assert_cmpstr(sequential->str, ==, concat_blocks(add_code_tags(options, blocks)));
+}
+
+// Run with -m perf from the source directory
+static
+void bench_html_escape() {
+    char* source = NULL;
+    gsize len;
+    if(!g_file_get_contents("pre.c", &source, &len, NULL)) {
+        g_test_skip("pre.c not found");
+        return;
+    }
+
+    double measure(GString* (*escape)(GString*, const char*, gsize)) {
+        GString* out    = g_string_sized_new(2 * len);
+        GTimer* timer   = g_timer_new();
+        int rounds      = 200;
+        for(int i = 0; i < rounds; ++i) {
+            g_string_truncate(out, 0);
+            escape(out, source, len);
+        }
+        double mbs      = rounds * len / g_timer_elapsed(timer, NULL) / 1e6;
+        g_timer_destroy(timer);
+        g_string_free(out, true);
+        return mbs;
+    }
+
+    double scalar   = measure(html_escape_scalar);
+    double simd     = measure(html_escape);
+    g_test_message("html escape of pre.c: scalar %.0f MB/s, simd %.0f MB/s", scalar, simd);
+    g_test_maximized_result(simd, "%.0f MB/s, %.1fx the scalar version", simd, simd / scalar);
+}
+
+static
+void bench_highlight() {
+    char* source = NULL;
+    gsize len;
+    if(!g_file_get_contents("pre.c", &source, &len, NULL)) {
+        g_test_skip("pre.c not found");
+        return;
+    }
+
+    Highlighter* h  = highlighter_new(lang_find_symbols(s_lang_params_table, "c"));
+    GString* out    = g_string_sized_new(4 * len);
+    GTimer* timer   = g_timer_new();
+    int rounds      = 50;
+    for(int i = 0; i < rounds; ++i) {
+        g_string_truncate(out, 0);
+        highlight(h, out, source, len);
+    }
+    double mbs      = rounds * len / g_timer_elapsed(timer, NULL) / 1e6;
+    g_test_maximized_result(mbs, "highlighting pre.c at %.0f MB/s", mbs);
+}
+
+static
+void bench_cache() {
+    char* source = NULL;
+    if(!g_file_get_contents("pre.c", &source, NULL, NULL)) {
+        g_test_skip("pre.c not found");
+        return;
+    }
+
+    char* message       = NULL;
+    Options* options    = options_new("c", NULL, NULL, 0, NULL, NULL, FormatHtml, &message);
+    double measure() {
+        GTimer* timer = g_timer_new();
+        for(int i = 0; i < 10; ++i) translate(options, source);
+        double s = g_timer_elapsed(timer, NULL) / 10;
+        g_timer_destroy(timer);
+        return s;
+    }
+
+    double uncached     = measure();
+    options->cache      = cache_new(64 << 20);
+    translate(options, source);
+    double cached       = measure();
+    g_test_message("HTML translation of pre.c: %.1f ms, %.1f ms with the cache warm", uncached * 1e3, cached * 1e3);
+    g_test_minimized_result(cached, "cached HTML translation of pre.c in %.4f s", cached);
+}
+
 int run_tests(int argc, char* argv[]) {
     g_test_init(&argc, &argv, NULL);
 
@@ -221,15 +1586,46 @@ int run_tests(int argc, char* argv[]) {
                                                                         .end_code   = "````")};
 
         g_test_add_func("/clite/tokenizer",     test_tokenizer);
+        g_test_add_func("/clite/lineindex",     test_line_index);
+        g_test_add_func("/clite/partokenizer",  test_parallel_tokenizer);
+        g_test_add_func("/clite/scanners",      test_scanners);
         g_test_add_func("/clite/parser",        test_parser);
+        g_test_add_func("/clite/diagnose",      test_diagnose);
         g_test_add_func("/clite/blockize",      test_blockize);
         g_test_add_func("/clite/notalpha",      test_notalpha);
         g_test_add_func("/clite/remblocks",     test_remove_empty_blocks);
         g_test_add_func("/clite/mergeblocks",   test_merge_blocks);
+        g_test_add_func("/clite/blockvector",   test_block_vector);
         g_test_add_func("/clite/indent",        test_indent);
         g_test_add_func("/clite/afterprefix",   test_after_prefix);
         g_test_add_func("/clite/codetags",      test_code_tags);
         g_test_add_func("/clite/translate",      test_translate);
+        g_test_add_func("/clite/pipeline",      test_pipeline);
+        g_test_add_func("/clite/stream_memory", test_stream_memory);
+        g_test_add_func("/clite/encodings",     test_encodings);
+        g_test_add_func("/clite/retranslate",   test_retranslate);
+        g_test_add_func("/clite/library",       test_library);
+        g_test_add_func("/clite/documentedits", test_document_edits);
+        g_test_add_func("/clite/narrativepairs", test_narrative_pairs);
+        g_test_add_func("/clite/html",          test_html);
+        g_test_add_func("/clite/htmlescape",    test_html_escape);
+        g_test_add_func("/clite/highlight",     test_highlight);
+        g_test_add_func("/clite/markdown",      test_markdown);
+        g_test_add_func("/clite/json",          test_json);
+        g_test_add_func("/clite/targets",       test_targets);
+        g_test_add_func("/clite/toc",           test_toc);
+        g_test_add_func("/clite/cache",         test_cache);
+        g_test_add_func("/clite/disk_cache",    test_disk_cache);
+        g_test_add_func("/clite/gz",            test_gz);
+        g_test_add_func("/clite/tree",          test_tree);
+        g_test_add_func("/clite/dependencies",  test_dependencies);
+        g_test_add_func("/clite/jobserver",     test_jobserver);
+    }
+
+    if(g_test_perf()) {
+        g_test_add_func("/clite/perf/htmlescape", bench_html_escape);
+        g_test_add_func("/clite/perf/highlight",  bench_highlight);
+        g_test_add_func("/clite/perf/cache",      bench_cache);
     }
 
     return g_test_run();